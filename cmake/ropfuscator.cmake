@@ -6,6 +6,8 @@ set(ROPF_SRCDIR ${ROPF_DIR}/src)
 set(ROPF_SOURCES
     ${ROPF_SRCDIR}/BinAutopsy.cpp
     ${ROPF_SRCDIR}/Debug.cpp
+    ${ROPF_SRCDIR}/GadgetCache.cpp
+    ${ROPF_SRCDIR}/GadgetScanner.cpp
     ${ROPF_SRCDIR}/LivenessAnalysis.cpp
     ${ROPF_SRCDIR}/MathUtil.cpp
     ${ROPF_SRCDIR}/OpaqueConstruct.cpp
@@ -33,3 +35,13 @@ endif()
 include_directories(${ROPF_DIR}/thirdparty/fmt/include)
 include_directories(${ROPF_DIR}/thirdparty/tinytoml/include)
 add_subdirectory(${ROPF_DIR}/thirdparty)
+
+add_subdirectory(${ROPF_DIR}/tools/ropf-autopsy)
+add_subdirectory(${ROPF_DIR}/tools/ropf-scanbench)
+
+# the unit tests need LLVM's googletest (tests/ is not always shipped with the
+# sources, e.g. in the nix build)
+if(LLVM_INCLUDE_TESTS
+   AND EXISTS ${CMAKE_CURRENT_SOURCE_DIR}/${ROPF_DIR}/tests/unit)
+  add_subdirectory(${ROPF_DIR}/tests/unit)
+endif()
@@ -13,7 +13,7 @@ let
     }).overrideAttrs (old: {
       pname = "ropfuscator-llvm" + lib.optionalString debug "-debug";
       debug = debug;
-      srcs = [ old.src ./cmake ./src ./thirdparty ];
+      srcs = [ old.src ./cmake ./src ./thirdparty ./tools ];
       patches = old.patches ++ [ ./patches/ropfuscator_pass.patch ];
       doCheck = false;
       dontStrip = debug;
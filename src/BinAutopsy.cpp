@@ -6,15 +6,31 @@
 #include "BinAutopsy.h"
 #include "ChainElem.h"
 #include "Debug.h"
+#include "GadgetCache.h"
+#include "GadgetScanner.h"
 #include "MathUtil.h"
 #include "ROPEngine.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/Hashing.h"
 #include "llvm/CodeGen/MachineModuleInfo.h"
+#include "llvm/MC/MCAsmInfo.h"
 #include "llvm/MC/MCCodeEmitter.h"
 #include "llvm/MC/MCContext.h"
 #include "llvm/MC/MCDisassembler/MCDisassembler.h"
+#include "llvm/MC/MCInstrInfo.h"
+#include "llvm/MC/MCRegisterInfo.h"
+#include "llvm/MC/MCTargetOptions.h"
 #include "llvm/Object/ELF.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/SHA1.h"
 #include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Target/TargetOptions.h"
+
+#ifdef LLVM_ON_UNIX
+#include <sys/mman.h>
+#endif
 
 #if LLVM_VERSION_MAJOR >= 9
 #include "MCTargetDesc/X86IntelInstPrinter.h"
@@ -23,10 +39,19 @@
 #endif
 
 #define FMT_HEADER_ONLY
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <fmt/format.h>
-#include <fstream>
+#include <future>
+#include <iterator>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <string.h>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 
 using namespace llvm;
 using llvm::object::ELF32LE;
@@ -34,39 +59,28 @@ using llvm::object::ELF32LEFile;
 
 namespace ropf {
 
-class ELFParser {
-public:
-  ELFParser(const std::string &path)
-      : path(path), dynsym(0), verdef(0), versym(0) {
-    std::ifstream f(path, std::ios::binary);
-
-    if (!f.good()) {
-      dbg_fmt("Given file {} does not exist or is invalid", path);
-      exit(1);
-    }
-
-    // dbg_fmt("Analysing {}\n", path);
-
-    f.seekg(0, std::ios::end);
+namespace {
 
-    size_t size = f.tellg();
+// makeError - returns an error with the given message, formatted as by
+// fmt::format()
+template <typename... Args>
+Error makeError(const char *format, const Args &...args) {
+  return make_error<StringError>(fmt::format(format, args...),
+                                 inconvertibleErrorCode());
+}
 
-    f.seekg(0, std::ios::beg);
-    buf.resize(size);
-    f.read(&buf[0], size);
-    f.close();
+} // namespace
 
-    auto elf_opt = ELF32LEFile::create(StringRef(&buf[0], size));
+class ELFParser {
+public:
+  // create - maps and parses the library at path
+  static Expected<std::unique_ptr<ELFParser>> create(const std::string &path) {
+    std::unique_ptr<ELFParser> parser(new ELFParser(path));
 
-    if (!elf_opt) {
-      dbg_fmt("ELF file error: {}: {}\n", path, elf_opt.takeError());
-      exit(1);
+    if (Error error = parser->open()) {
+      return error;
     }
-
-    this->elf.reset(new ELF32LEFile(*elf_opt));
-
-    parseSections();
-    parseVerdefs();
+    return parser;
   }
 
   const uint8_t *base() const { return elf->base(); }
@@ -129,15 +143,25 @@ public:
             sym.getBinding() == ELF_STB_WEAK);
   }
 
-  std::string getSymbolVersion(int symindex) const {
+  // getSymbolVersions - returns the version index of every dynamic symbol
+  // (empty if the library is not versioned)
+  ArrayRef<uint16_t> getSymbolVersions() const {
+    if (!versym) {
+      return ArrayRef<uint16_t>();
+    }
+
     auto versyms = elf->getSectionContentsAsArray<uint16_t>(versym);
 
     if (!versyms) {
-      return "";
+      consumeError(versyms.takeError());
+      return ArrayRef<uint16_t>();
     }
 
-    uint16_t value = (*versyms)[symindex];
+    return *versyms;
+  }
 
+  // getVersionName - returns the version name for the given version index
+  StringRef getVersionName(uint16_t value) const {
     if (value == ELF_VER_NDX_LOCAL || value == ELF_VER_NDX_GLOBAL ||
         value >= ELF_VER_NDX_LORESERVE) {
       return "";
@@ -156,10 +180,19 @@ public:
 
   std::string getSHA1HashRaw() const {
     if (sha1hash.empty()) {
+      // hash the file in a single streaming pass, telling the kernel to read
+      // ahead aggressively and to drop the pages early
+      const size_t chunkSize = 1 << 20;
+      adviseSequentialAccess(true);
+
       llvm::SHA1 sha1;
-      sha1.update(
-          llvm::ArrayRef<uint8_t>((const uint8_t *)&buf[0], buf.size()));
+      for (size_t pos = 0; pos < size(); pos += chunkSize) {
+        sha1.update(llvm::ArrayRef<uint8_t>(base() + pos,
+                                            std::min(chunkSize, size() - pos)));
+      }
       sha1hash = sha1.final();
+
+      adviseSequentialAccess(false);
     }
     return sha1hash;
   }
@@ -175,6 +208,48 @@ public:
   }
 
 private:
+  ELFParser(const std::string &path)
+      : path(path), dynsym(0), verdef(0), versym(0) {}
+
+  Error open() {
+    // The library is mapped read-only instead of being copied in memory:
+    // only the pages that are actually accessed are loaded, and they are
+    // shared with the page cache (and so with other compiler processes).
+    uint64_t size  = 0;
+    auto     fdOpt = sys::fs::openNativeFileForRead(path);
+
+    if (!fdOpt) {
+      consumeError(fdOpt.takeError());
+      return makeError("Given file {} does not exist or is invalid", path);
+    }
+
+    std::error_code ec = sys::fs::file_size(path, size);
+
+    if (!ec && size > 0) {
+      mapping.reset(new sys::fs::mapped_file_region(
+          *fdOpt, sys::fs::mapped_file_region::readonly, size, 0, ec));
+    }
+    sys::fs::closeFile(*fdOpt);
+
+    if (ec || size == 0) {
+      return makeError("Given file {} does not exist or is invalid", path);
+    }
+
+    auto elf_opt = ELF32LEFile::create(
+        StringRef(mapping->const_data(), mapping->size()));
+
+    if (!elf_opt) {
+      return makeError(
+          "ELF file error: {}: {}", path, toString(elf_opt.takeError()));
+    }
+
+    this->elf.reset(new ELF32LEFile(*elf_opt));
+
+    parseSections();
+    parseVerdefs();
+    return Error::success();
+  }
+
   struct Verdef {
     uint16_t vd_version;
     uint16_t vd_flags;
@@ -218,15 +293,25 @@ private:
   // version table index: max value + 1
   static const int ELF_VER_NDX_LORESERVE = 0xff00;
 
-  std::string                  path;
-  std::unique_ptr<ELF32LEFile> elf;
-  std::vector<char>            buf;
-  mutable std::string          sha1hash;
-  const ELF32LE::Shdr         *dynsym;
-  const ELF32LE::Shdr         *verdef;
-  const ELF32LE::Shdr         *versym;
-  StringRef                    dynstrtab;
-  std::vector<std::string>     verdefs;
+  std::string                                  path;
+  std::unique_ptr<ELF32LEFile>                 elf;
+  std::unique_ptr<sys::fs::mapped_file_region> mapping;
+  mutable std::string                          sha1hash;
+  const ELF32LE::Shdr                         *dynsym;
+  const ELF32LE::Shdr                         *verdef;
+  const ELF32LE::Shdr                         *versym;
+  StringRef                                    dynstrtab;
+  std::vector<std::string>                     verdefs;
+
+  // adviseSequentialAccess - hints the kernel about the access pattern of the
+  // mapped file (sequential while hashing, random while searching gadgets).
+  void adviseSequentialAccess(bool sequential) const {
+#ifdef LLVM_ON_UNIX
+    ::madvise(const_cast<char *>(mapping->const_data()),
+              mapping->size(),
+              sequential ? MADV_SEQUENTIAL : MADV_NORMAL);
+#endif
+  }
 
   void parseSections() {
     // identify dynsym, verdef, versym sections
@@ -300,37 +385,73 @@ private:
 };
 
 BinaryAutopsy::BinaryAutopsy(const GlobalConfig  &config,
-                             const Module        &module,
                              const TargetMachine &target,
                              MCContext           &context)
-    : module(module), target(target), context(context), config(config),
-      elf(new ELFParser(config.libraryPath)) {
-  std::string sha1 = elf->getSHA1HashHex();
-  dbg_fmt("[*] Extracting gadgets from: {} SHA1={}\n", elf->getPath(), sha1);
-  if (!config.librarySHA1.empty() && config.librarySHA1 != sha1) {
-    dbg_fmt("[!] Error: library SHA1 mismatch: expected={}, actual={}\n",
-            config.librarySHA1,
-            sha1);
-    exit(1);
+    : target(target), context(context), config(config),
+      isModuleSymbolAnalysed(false) {}
+
+Error BinaryAutopsy::analyseLibraries() {
+  std::vector<std::string> hashes;
+  std::vector<std::string> paths = {config.libraryPath};
+
+  paths.insert(paths.end(),
+               config.extraGadgetLibraries.begin(),
+               config.extraGadgetLibraries.end());
+
+  for (const std::string &libPath : paths) {
+    auto lib = ELFParser::create(libPath);
+
+    if (!lib) {
+      return lib.takeError();
+    }
+    libraries.push_back(std::move(*lib));
   }
-  for (const std::string &libPath : config.linkedLibraries) {
-    otherLibs.emplace_back(new ELFParser(libPath));
+
+  for (auto &lib : libraries) {
+    hashes.push_back(lib->getSHA1HashHex());
+    dbg_fmt("[*] Extracting gadgets from: {} SHA1={}\n",
+            lib->getPath(),
+            hashes.back());
+  }
+
+  if (!config.librarySHA1.empty() && config.librarySHA1 != hashes[0]) {
+    return makeError("[!] Error: library SHA1 mismatch: expected={}, actual={}",
+                     config.librarySHA1,
+                     hashes[0]);
   }
-  isModuleSymbolAnalysed = false;
 
-  dissect(elf.get());
-  analyseUsedSymbols();
+  GadgetCache cache(config, hashes);
+  if (cache.load(*this)) {
+    dbg_fmt("[*] Loaded gadgets from cache: {}\n", cache.getPath());
+  } else {
+    dissect(cache);
+    cache.save(*this);
+  }
+  buildGadgetTable();
+  xgraph.finalize();
+  return analyseUsedSymbols(cache);
 }
 
 BinaryAutopsy::~BinaryAutopsy() {}
 
-void BinaryAutopsy::dissect(ELFParser *elf) {
-  dumpSections(elf, Sections);
-  dumpSegments(elf, Segments);
-  dumpDynamicSymbols(elf, Symbols, true);
+void BinaryAutopsy::dissect(const GadgetCache &cache) {
+  std::vector<Microgadget *> gadgets;
+
+  for (unsigned lib = 0; lib < libraries.size(); lib++) {
+    const ELFParser *elf = libraries[lib].get();
+    LibraryScan      scan;
+
+    dumpSections(elf, lib, Sections);
+    dumpSegments(elf, lib, Segments);
+    dumpDynamicSymbols(elf, lib, Symbols, true);
+    dumpGadgets(elf, lib, cache, scan);
+
+    for (auto &gadget : scan.gadgets) {
+      gadgets.push_back(
+          gadgetStore.create(gadget.Instr, gadget.addresses, lib));
+    }
+  }
 
-  std::vector<std::shared_ptr<Microgadget>> gadgets;
-  dumpGadgets(elf, gadgets);
   for (auto gadget : gadgets) {
     addGadget(gadget);
   }
@@ -342,24 +463,125 @@ BinaryAutopsy *BinaryAutopsy::instance = 0;
 BinaryAutopsy *BinaryAutopsy::getInstance(const GlobalConfig    &config,
                                           llvm::MachineFunction &MF) {
   if (instance == nullptr) {
-    instance = new BinaryAutopsy(config,
-                                 *MF.getFunction().getParent(),
-                                 MF.getTarget(),
-                                 MF.getContext());
+    std::unique_ptr<BinaryAutopsy> BA(
+        new BinaryAutopsy(config, MF.getTarget(), MF.getContext()));
+
+    if (Error error = BA->analyseLibraries()) {
+      dbg_fmt("{}\n", toString(std::move(error)));
+      exit(1);
+    }
+    instance = BA.release();
+  }
+
+  if (!instance->isModuleSymbolAnalysed) {
+    instance->analyseModuleSymbols(*MF.getFunction().getParent());
   }
 
   return instance;
 }
 
+extern "C" void LLVMInitializeX86Disassembler();
+
+std::future<Expected<BinaryAutopsy *>>
+BinaryAutopsy::startAnalysis(const GlobalConfig &config,
+                             const std::string  &triple) {
+  if (instance != nullptr) {
+    return std::future<Expected<BinaryAutopsy *>>();
+  }
+
+  // the target registry is not thread-safe, so the disassembler is registered
+  // before starting the thread
+  LLVMInitializeX86Disassembler();
+
+  // Errors are not reported here, but returned to the thread waiting for the
+  // result: exiting from this thread would run the static destructors while
+  // the main thread is still using them.
+  auto analyse = [&config, triple]() -> Expected<BinaryAutopsy *> {
+    std::string   error;
+    const Target *T = TargetRegistry::lookupTarget(triple, error);
+
+    if (!T) {
+      // getInstance() will analyse the libraries on the main thread
+      dbg_fmt("[!] Cannot start the library analysis: {}\n", error);
+      return nullptr;
+    }
+
+    std::unique_ptr<TargetMachine> TM(
+        T->createTargetMachine(triple, "", "", TargetOptions(), None));
+
+    if (!TM) {
+      dbg_fmt("[!] Cannot start the library analysis: no target machine\n");
+      return nullptr;
+    }
+
+#if LLVM_VERSION_MAJOR >= 13
+    std::unique_ptr<MCContext> MC(new MCContext(TM->getTargetTriple(),
+                                                TM->getMCAsmInfo(),
+                                                TM->getMCRegisterInfo(),
+                                                TM->getMCSubtargetInfo()));
+#else
+    std::unique_ptr<MCContext> MC(
+        new MCContext(TM->getMCAsmInfo(), TM->getMCRegisterInfo(), nullptr));
+#endif
+
+    std::unique_ptr<BinaryAutopsy> BA(new BinaryAutopsy(config, *TM, *MC));
+
+    if (Error error = BA->analyseLibraries()) {
+      return error;
+    }
+    BA->ownedTarget  = std::move(TM);
+    BA->ownedContext = std::move(MC);
+
+    return BA.release();
+  };
+
+  return std::async(std::launch::async, analyse);
+}
+
+void BinaryAutopsy::waitForAnalysis(
+    std::future<Expected<BinaryAutopsy *>> &pending) {
+  if (!pending.valid()) {
+    return;
+  }
+
+  Expected<BinaryAutopsy *> result = pending.get();
+
+  if (!result) {
+    dbg_fmt("{}\n", toString(result.takeError()));
+    exit(1);
+  }
+
+  // nullptr if the analysis could not be started
+  if (*result) {
+    instance = *result;
+  }
+}
+
+Expected<std::unique_ptr<BinaryAutopsy>>
+BinaryAutopsy::create(const GlobalConfig  &config,
+                      const Module        &module,
+                      const TargetMachine &target,
+                      MCContext           &context) {
+  std::unique_ptr<BinaryAutopsy> BA(new BinaryAutopsy(config, target, context));
+
+  if (Error error = BA->analyseLibraries()) {
+    return error;
+  }
+  BA->analyseModuleSymbols(module);
+  return BA;
+}
+
 void BinaryAutopsy::dumpSegments(const ELFParser      *elf,
+                                 unsigned              library,
                                  std::vector<Section> &segments) const {
   for (auto &seg : elf->getCodeSegments()) {
     segments.push_back(
-        Section("<unnamed-segment>", seg.p_offset, seg.p_filesz));
+        Section("<unnamed-segment>", seg.p_offset, seg.p_filesz, library));
   }
 }
 
 void BinaryAutopsy::dumpSections(const ELFParser      *elf,
+                                 unsigned              library,
                                  std::vector<Section> &sections) const {
   DEBUG_WITH_TYPE(SECTIONS,
                   dbg_fmt("[SECTIONS]\tLooking for CODE sections... \n"));
@@ -367,7 +589,8 @@ void BinaryAutopsy::dumpSections(const ELFParser      *elf,
   for (auto &section : elf->getCodeSections()) {
     std::string sectname = elf->getSectionName(section);
 
-    sections.push_back(Section(sectname, section.sh_addr, section.sh_size));
+    sections.push_back(
+        Section(sectname, section.sh_addr, section.sh_size, library));
 
     DEBUG_WITH_TYPE(SECTIONS,
                     dbg_fmt("[SECTIONS]\tFound section {}\n", sectname));
@@ -375,51 +598,84 @@ void BinaryAutopsy::dumpSections(const ELFParser      *elf,
 }
 
 void BinaryAutopsy::dumpDynamicSymbols(const ELFParser     *elf,
+                                       unsigned             library,
                                        std::vector<Symbol> &Symbols,
                                        bool                 safeOnly) const {
   // dbg_fmt("[*] Scanning for symbols... \n");
-  auto                  symbols = elf->getDynamicSymbols();
-  std::set<std::string> symbolNames;
+  auto   symbols  = elf->getDynamicSymbols();
+  auto   versions = elf->getSymbolVersions();
+  size_t first    = Symbols.size();
+
+  // firstDef - maps each symbol name (pointing into the string table) to the
+  // index of its first definition in Symbols, or -1 if it was not kept
+  DenseMap<StringRef, int64_t> firstDef;
+  firstDef.reserve(symbols.size());
+
+  // multiversioned - indexes of the symbols that have more than one version
+  std::vector<size_t> multiversioned;
 
   // Scan for all the symbols
   for (size_t i = 0; i < symbols.size(); i++) {
     const ELF32LE::Sym &sym = symbols[i];
 
     // Consider only function symbols with global scope
-    if (elf->isGlobalOrWeakFunction(sym) && sym.isDefined()) {
-      auto name_opt = elf->getSymbolName(sym);
+    if (!elf->isGlobalOrWeakFunction(sym) || !sym.isDefined()) {
+      continue;
+    }
 
-      if (!name_opt) {
-        continue;
-      }
+    auto name_opt = elf->getSymbolName(sym);
+
+    if (!name_opt) {
+      consumeError(name_opt.takeError());
+      continue;
+    }
 
-      std::string symbolName = name_opt->str();
-      uint64_t    addr       = sym.getValue();
+    // we cannot use multiple versions of the same symbol,
+    // so we detect duplicate.
+    auto inserted = firstDef.try_emplace(*name_opt, -1);
 
+    if (inserted.second) {
       // Get version string to avoid symbol aliasing
-      std::string versionString = elf->getSymbolVersion(i);
-
-      // we cannot use multiple versions of the same symbol,
-      // so we detect duplicate.
-      if (symbolNames.find(symbolName) == symbolNames.end()) {
-        symbolNames.insert(symbolName);
-        Symbol sym(symbolName, versionString, addr);
-        if (!safeOnly || isSafeSymbol(sym)) {
-          Symbols.emplace_back(sym);
-        }
-      } else {
-        // multi-versioned symbol
-        if (safeOnly && config.avoidMultiversionSymbol) {
-          for (auto it = Symbols.begin(); it != Symbols.end(); ++it) {
-            if (it->Label == symbolName) {
-              Symbols.erase(it);
-              break;
-            }
-          }
-        }
+      StringRef versionString =
+          i < versions.size() ? elf->getVersionName(versions[i]) : "";
+
+      Symbol symbol(name_opt->str(),
+                    versionString.str(),
+                    sym.getValue(),
+                    library);
+
+      if (!safeOnly || isSafeSymbol(symbol)) {
+        inserted.first->second = Symbols.size();
+        Symbols.emplace_back(std::move(symbol));
+      }
+    } else if (safeOnly && config.avoidMultiversionSymbol &&
+               inserted.first->second >= 0) {
+      // multi-versioned symbol: removed after the scan
+      multiversioned.push_back(inserted.first->second);
+      inserted.first->second = -1;
+    }
+  }
+
+  if (multiversioned.empty()) {
+    return;
+  }
+
+  // remove the multi-versioned symbols, preserving the order of the others
+  std::vector<bool> removed(Symbols.size() - first, false);
+  for (size_t idx : multiversioned) {
+    removed[idx - first] = true;
+  }
+
+  size_t kept = first;
+  for (size_t idx = first; idx < Symbols.size(); idx++) {
+    if (!removed[idx - first]) {
+      if (kept != idx) {
+        Symbols[kept] = std::move(Symbols[idx]);
       }
+      kept++;
     }
   }
+  Symbols.erase(Symbols.begin() + kept, Symbols.end());
 }
 
 bool BinaryAutopsy::isSafeSymbol(const Symbol &symbol) const {
@@ -438,63 +694,285 @@ bool BinaryAutopsy::isSafeSymbol(const Symbol &symbol) const {
   return true;
 }
 
-void BinaryAutopsy::analyseUsedSymbols() {
-  isModuleSymbolAnalysed = true;
-  std::set<std::string> names;
+void BinaryAutopsy::dumpSymbolNameHashes(const ELFParser       *elf,
+                                         std::vector<uint64_t> &hashes) const {
+  auto symbols = elf->getDynamicSymbols();
 
-  for (const auto &f : module.getFunctionList()) {
-    names.insert(f.getName().str());
+  hashes.clear();
+  hashes.reserve(symbols.size());
+  for (const ELF32LE::Sym &sym : symbols) {
+    if (!elf->isGlobalOrWeakFunction(sym) || !sym.isDefined()) {
+      continue;
+    }
+
+    if (auto name_opt = elf->getSymbolName(sym)) {
+      hashes.push_back(xxHash64(*name_opt));
+    }
   }
 
-  for (const auto &g : module.getGlobalList()) {
-    names.insert(g.getName().str());
+  std::sort(hashes.begin(), hashes.end());
+  hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+}
+
+Expected<std::vector<uint64_t>>
+BinaryAutopsy::getSymbolNameHashes(const GadgetCache &cache,
+                                   const std::string &path,
+                                   const ELFParser   *elf) const {
+  std::vector<uint64_t> index;
+
+  if (cache.loadSymbolIndex(path, index)) {
+    return index;
+  }
+
+  // the library is parsed only if its index is not cached yet
+  if (elf) {
+    dumpSymbolNameHashes(elf, index);
+  } else {
+    auto lib = ELFParser::create(path);
+
+    if (!lib) {
+      return lib.takeError();
+    }
+    dumpSymbolNameHashes(lib->get(), index);
+  }
+  cache.saveSymbolIndex(path, index);
+
+  return index;
+}
+
+Error BinaryAutopsy::analyseUsedSymbols(const GadgetCache &cache) {
+  // Names are compared through their 64-bit hashes. A collision can only
+  // cause a safe symbol to be discarded, never a forbidden one to be kept.
+  auto contains = [](const std::vector<uint64_t> &names, uint64_t hash) {
+    return std::binary_search(names.begin(), names.end(), hash);
+  };
+
+  // forbidden - names defined by the linked libraries
+  std::vector<std::vector<uint64_t>> forbidden;
+  // defined - names defined by each gadget library. If more than one gadget
+  // library defines a symbol, a reference to it may be resolved to the wrong
+  // library, so such symbols are not used either.
+  std::vector<std::vector<uint64_t>> defined;
+
+  if (libraries.size() > 1) {
+    for (auto &lib : libraries) {
+      auto names = getSymbolNameHashes(cache, lib->getPath(), lib.get());
+
+      if (!names) {
+        return names.takeError();
+      }
+      defined.push_back(std::move(*names));
+    }
+  }
+
+  for (const std::string &libPath : config.linkedLibraries) {
+    // a gadget library may be listed among the linked ones as well
+    bool isGadgetLibrary = std::any_of(
+        libraries.begin(), libraries.end(), [&](const auto &lib) {
+          bool result = false;
+          return !sys::fs::equivalent(libPath, lib->getPath(), result) &&
+                 result;
+        });
+
+    if (!isGadgetLibrary) {
+      auto names = getSymbolNameHashes(cache, libPath, nullptr);
+
+      if (!names) {
+        return names.takeError();
+      }
+      forbidden.push_back(std::move(*names));
+    }
   }
 
-  for (auto &lib : otherLibs) {
-    std::vector<Symbol> symbols;
-    dumpDynamicSymbols(lib.get(), symbols, false);
-    for (auto &sym : symbols) {
-      names.insert(sym.Label);
+  auto isForbidden = [&](const Symbol &sym) {
+    uint64_t hash = xxHash64(sym.Label);
+    for (auto &names : forbidden) {
+      if (contains(names, hash)) {
+        return true;
+      }
     }
+    for (unsigned lib = 0; lib < defined.size(); lib++) {
+      if (lib != sym.Library && contains(defined[lib], hash)) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  Symbols.erase(std::remove_if(Symbols.begin(), Symbols.end(), isForbidden),
+                Symbols.end());
+  return Error::success();
+}
+
+void BinaryAutopsy::analyseModuleSymbols(const Module &module) {
+  isModuleSymbolAnalysed = true;
+
+  std::vector<uint64_t> moduleNames;
+  for (const auto &f : module.getFunctionList()) {
+    moduleNames.push_back(xxHash64(f.getName()));
+  }
+  for (const auto &g : module.getGlobalList()) {
+    moduleNames.push_back(xxHash64(g.getName()));
   }
+  std::sort(moduleNames.begin(), moduleNames.end());
+
+  auto isForbidden = [&](const Symbol &sym) {
+    return std::binary_search(moduleNames.begin(),
+                              moduleNames.end(),
+                              xxHash64(sym.Label));
+  };
+
+  Symbols.erase(std::remove_if(Symbols.begin(), Symbols.end(), isForbidden),
+                Symbols.end());
+
+  // Symbols are grouped by library, in the order of libraries
+  auto byLibrary = [](const Symbol &a, const Symbol &b) {
+    return a.Library < b.Library;
+  };
+
+  std::stable_sort(Symbols.begin(), Symbols.end(), byLibrary);
 
-  for (auto it = Symbols.begin(); it != Symbols.end();) {
-    if (names.find(it->Label) != names.end()) {
-      it = Symbols.erase(it);
-    } else {
-      ++it;
+  librarySymbols.clear();
+  for (unsigned lib = 0; lib < libraries.size(); lib++) {
+    auto range = std::equal_range(Symbols.begin(),
+                                  Symbols.end(),
+                                  Symbol("", "", 0, lib),
+                                  byLibrary);
+
+    if (range.first == range.second) {
+      dbg_fmt("[!] Error: no usable symbols in {}\n",
+              libraries[lib]->getPath());
+      exit(1);
     }
+
+    librarySymbols.emplace_back(range.first - Symbols.begin(),
+                                range.second - Symbols.begin());
   }
 }
 
-const Symbol *BinaryAutopsy::getRandomSymbol() const {
-  uint32_t index = math::Random::range32(0, Symbols.size() - 1);
+const Symbol *BinaryAutopsy::getRandomSymbol(unsigned library) const {
+  auto     range = librarySymbols[library];
+  uint32_t index = math::Random::range32(range.first, range.second - 1);
 
   return &Symbols[index];
 }
 
-extern "C" void LLVMInitializeX86Disassembler();
+namespace {
+
+// InstrFormatter - prints instructions in Intel syntax, for debug output. It
+// owns the target descriptions it needs, so that gadgets can be printed at
+// any time, regardless of the target machine that found them.
+class InstrFormatter {
+  std::unique_ptr<MCRegisterInfo>      regInfo;
+  std::unique_ptr<MCAsmInfo>           asmInfo;
+  std::unique_ptr<MCInstrInfo>         instrInfo;
+  std::unique_ptr<X86IntelInstPrinter> printer;
+
+  InstrFormatter() {
+    std::string   triple = "i386-unknown-linux-gnu";
+    std::string   error;
+    const Target *T = TargetRegistry::lookupTarget(triple, error);
+
+    if (!T) {
+      return;
+    }
+
+    regInfo.reset(T->createMCRegInfo(triple));
+#if LLVM_VERSION_MAJOR >= 10
+    asmInfo.reset(T->createMCAsmInfo(*regInfo, triple, MCTargetOptions()));
+#else
+    asmInfo.reset(T->createMCAsmInfo(*regInfo, triple));
+#endif
+    instrInfo.reset(T->createMCInstrInfo());
+    printer.reset(new X86IntelInstPrinter(*asmInfo, *instrInfo, *regInfo));
+  }
+
+public:
+  // mutex - serializes the use of the printer and of strings
+  std::mutex mutex;
+
+  // strings - interned results of Microgadget::getAsmInstr(), which are
+  // referenced until the end of the process
+  std::set<std::string> strings;
+
+  static InstrFormatter &get() {
+    static InstrFormatter formatter;
+    return formatter;
+  }
+
+  std::string format(const MCInst &instr) {
+    if (!printer) {
+      return "<unknown>";
+    }
+
+    std::string        result;
+    raw_string_ostream os(result);
+#if LLVM_VERSION_MAJOR >= 10
+    printer->printInstruction(&instr, 0, os);
+#else
+    printer->printInstruction(&instr, os);
+#endif
+    os.flush();
+    if (!result.empty() && result[0] == '\t') {
+      result = result.substr(1);
+    }
+    return result;
+  }
+};
+
+} // namespace
+
+const std::string &Microgadget::getAsmInstr() const {
+  InstrFormatter             &formatter = InstrFormatter::get();
+  std::lock_guard<std::mutex> lock(formatter.mutex);
+  std::string                 asmInstr;
+
+  for (const MCInst &inst : getInstr()) {
+    if (inst.getOpcode() == X86::RETL) {
+      break;
+    }
+    if (!asmInstr.empty()) {
+      asmInstr += "; ";
+    }
+    asmInstr += formatter.format(inst);
+  }
+  return *formatter.strings.insert(std::move(asmInstr)).first;
+}
 
 class DisassemblerHelper {
-  MCDisassembler      *disasm;
-  X86IntelInstPrinter *printer;
-  ArrayRef<uint8_t>    data;
+  MCDisassembler   *disasm;
+  ArrayRef<uint8_t> data;
 
 public:
   DisassemblerHelper(const TargetMachine &target,
                      MCContext           &context,
                      const ELFParser     &elf) {
-    LLVMInitializeX86Disassembler();
     disasm =
         target.getTarget().createMCDisassembler(*target.getMCSubtargetInfo(),
                                                 context);
-    printer = new X86IntelInstPrinter(*target.getMCAsmInfo(),
-                                      *target.getMCInstrInfo(),
-                                      *target.getMCRegisterInfo());
-    data    = ArrayRef<uint8_t>(elf.base(), elf.size());
+    data = ArrayRef<uint8_t>(elf.base(), elf.size());
   }
 
-  ~DisassemblerHelper() { delete printer; }
+  // decode - decodes a single instruction at address, reading at most size
+  // bytes. Returns false if the bytes are not a valid instruction.
+  bool
+  decode(uint64_t address, size_t size, MCInst &result, uint64_t &readsize) {
+#if LLVM_VERSION_MAJOR >= 10
+    auto status = disasm->getInstruction(result,
+                                         readsize,
+                                         data.slice(address, size),
+                                         address,
+                                         llvm::nulls());
+#else
+    auto status = disasm->getInstruction(result,
+                                         readsize,
+                                         data.slice(address, size),
+                                         address,
+                                         llvm::nulls(),
+                                         llvm::nulls());
+#endif
+    return status == MCDisassembler::DecodeStatus::Success;
+  }
 
   void
   disassemble(uint64_t address, size_t &size, MCInst *result, size_t &count) {
@@ -502,23 +980,7 @@ public:
     size_t   pos      = 0;
     uint64_t readsize = 0;
     for (i = 0, pos = 0; i < count && pos < size; i++, pos += readsize) {
-#if LLVM_VERSION_MAJOR >= 10
-      auto status =
-          disasm->getInstruction(result[i],
-                                 readsize,
-                                 data.slice(address + pos, size - pos),
-                                 address + pos,
-                                 llvm::nulls());
-#else
-      auto status =
-          disasm->getInstruction(result[i],
-                                 readsize,
-                                 data.slice(address + pos, size - pos),
-                                 address + pos,
-                                 llvm::nulls(),
-                                 llvm::nulls());
-#endif
-      if (status != MCDisassembler::DecodeStatus::Success) {
+      if (!decode(address + pos, size - pos, result[i], readsize)) {
         // disassemble error
         count = 0;
         size  = 0;
@@ -528,134 +990,558 @@ public:
     count = i;
     size  = pos;
   }
+};
 
-  std::string formatInstr(const MCInst &instr) {
-    std::string        result;
-    raw_string_ostream os(result);
-#if LLVM_VERSION_MAJOR >= 10
-    printer->printInstruction(&instr, 0, os);
-#else
-    printer->printInstruction(&instr, os);
-#endif
-    os.flush();
-    if (!result.empty() && result[0] == '\t') {
-      result = result.substr(1);
-    }
-    return result;
+namespace {
+
+// number of scan positions in each chunk processed by dumpGadgets()
+const uint64_t SCAN_CHUNK_SIZE = 64 * 1024;
+
+// ScanHit - an occurrence of a gadget, with the position of the RET or JMP
+// that ends it
+struct ScanHit {
+  uint64_t         address;
+  uint64_t         site;
+  ArrayRef<MCInst> instr;
+
+  bool isJmp() const { return instr.size() == 1; }
+
+  // operator< - the order of a serial scan of a code region: RET gadgets by
+  // site, then by address and length; JMP gadgets last
+  bool operator<(const ScanHit &other) const {
+    return std::make_tuple(isJmp(), site, address, instr.size()) <
+           std::make_tuple(
+               other.isJmp(), other.site, other.address, other.instr.size());
   }
 };
 
-void BinaryAutopsy::dumpGadgets(
-    const ELFParser                           *elf,
-    std::vector<std::shared_ptr<Microgadget>> &gadgets) const {
-  DisassemblerHelper disasm(target, context, *elf);
-
-  // map to check duplication
-  std::map<std::string, std::shared_ptr<Microgadget>> gadgetMap;
+// ScanTask - a chunk of a code region to be scanned for gadgets ending with
+// RET and for indirect JMP gadgets. Gadgets found in the chunk are
+// deduplicated, and each of their occurrences is recorded as a hit.
+struct ScanTask {
+  // begin, end - scan positions owned by the chunk
+  uint64_t begin, end;
+  // limit - end of the code region
+  uint64_t limit;
+  // region - index of the code region
+  size_t   region;
+  // first, last - only the gadgets starting in [first, last) are recorded
+  uint64_t first, last;
+
+  // found - instructions of the distinct gadgets found; the hits point to
+  // them, which stay in place when the vector grows
+  std::vector<std::vector<MCInst>> found;
+  std::vector<ScanHit>             hits;
+};
 
-  const uint8_t *buf = elf->base();
+// GadgetKeyInfo - DenseMap traits identifying a gadget by the opcodes and
+// the operands of its instructions, so that no instruction needs to be
+// printed during the extraction
+struct GadgetKeyInfo {
+  static ArrayRef<MCInst> getEmptyKey() {
+    return ArrayRef<MCInst>(DenseMapInfo<const MCInst *>::getEmptyKey(),
+                            (size_t)0);
+  }
 
-  for (auto &s : (config.searchSegmentForGadget ? Segments : Sections)) {
-    int cnt = 0;
-
-    // Scan for RET instructions
-    for (uint64_t i = s.Address; i < (uint64_t)(s.Address + s.Length); i++) {
-      if (buf[i] == (uint8_t)0xc3) { // ret
-        size_t         offset  = i + 1;
-        const uint8_t *cur_pos = buf + offset;
-
-        // Iteratively try to decode starting from MAXDEPTH to 1
-        // bytes before the actual RET
-        for (int depth = MAXDEPTH; depth > 0; depth--) {
-
-          // ignore repeat prefix
-          uint8_t firstbyte = *(cur_pos - depth);
-          if (firstbyte == 0xf2 || firstbyte == 0xf3) {
-            continue;
-          }
+  static ArrayRef<MCInst> getTombstoneKey() {
+    return ArrayRef<MCInst>(DenseMapInfo<const MCInst *>::getTombstoneKey(),
+                            (size_t)0);
+  }
 
-          uint64_t addr = offset - depth;
-
-          MCInst instructions[2];
-          size_t count = 2;
-          size_t size  = depth;
-          disasm.disassemble(addr, size, instructions, count);
-
-          // Valid gadgets must have two instructions, and the
-          // last one must be a RET
-          if (count == 2 && instructions[1].getOpcode() == X86::RETL &&
-              // exclude PREFIX RET
-              instructions[0].getOpcode() != X86::DATA16_PREFIX &&
-              instructions[0].getOpcode() != X86::LOCK_PREFIX &&
-              instructions[0].getOpcode() != X86::REP_PREFIX &&
-              instructions[0].getOpcode() != X86::REPNE_PREFIX) {
-            // Each gadget is identified with its mnemonic
-            // and operators (ugly but straightforward :P)
-            std::string asm_instr = disasm.formatInstr(instructions[0]);
-
-            auto it = gadgetMap.find(asm_instr);
-            if (it != gadgetMap.end()) {
-              it->second->addresses.push_back(addr);
-            } else {
-              std::shared_ptr<Microgadget> gadget(
-                  new Microgadget(instructions, count, addr, asm_instr));
-              gadgets.push_back(gadget);
-              gadgetMap.emplace(asm_instr, gadget);
-
-              cnt++;
-            }
-          }
+  static unsigned getHashValue(ArrayRef<MCInst> instrs) {
+    hash_code hash = hash_value(instrs.size());
+    for (const MCInst &instr : instrs) {
+      hash = hash_combine(hash, instr.getOpcode());
+      for (const MCOperand &op : instr) {
+        if (op.isReg()) {
+          hash = hash_combine(hash, 'r', op.getReg());
+        } else if (op.isImm()) {
+          hash = hash_combine(hash, 'i', op.getImm());
+        } else {
+          hash = hash_combine(hash, '?');
         }
       }
     }
+    return hash;
+  }
+
+  static bool isEqual(const MCInst &a, const MCInst &b) {
+    if (a.getOpcode() != b.getOpcode() ||
+        a.getNumOperands() != b.getNumOperands()) {
+      return false;
+    }
 
-    // scan for indirect jmp instructions
-    for (uint64_t addr = s.Address; addr < (uint64_t)(s.Address + s.Length) - 1;
-         addr++) {
-
-      if (buf[addr] == 0xff && buf[addr + 1] >= 0xe0 && buf[addr + 1] < 0xe8) {
-        MCInst inst;
-        size_t count = 1;
-        size_t size  = 2;
-        disasm.disassemble(addr, size, &inst, count);
-        // Valid gadgets must have just one instruction of JMP register
-        if (count == 1 && inst.getOpcode() == X86::JMP32r) {
-          std::string asm_instr = disasm.formatInstr(inst);
-
-          auto it = gadgetMap.find(asm_instr);
-          if (it != gadgetMap.end()) {
-            it->second->addresses.push_back(addr);
-          } else {
-            std::shared_ptr<Microgadget> gadget(
-                new Microgadget(&inst, 1, addr, asm_instr));
-            gadgets.push_back(gadget);
-            gadgetMap.emplace(asm_instr, gadget);
-
-            cnt++;
-          }
+    for (unsigned i = 0; i < a.getNumOperands(); i++) {
+      const MCOperand &opA = a.getOperand(i);
+      const MCOperand &opB = b.getOperand(i);
+
+      if (opA.isReg() && opB.isReg()) {
+        if (opA.getReg() != opB.getReg()) {
+          return false;
         }
+      } else if (opA.isImm() && opB.isImm()) {
+        if (opA.getImm() != opB.getImm()) {
+          return false;
+        }
+      } else {
+        // other kinds of operands are not produced by the disassembler
+        return false;
       }
     }
-    // dbg_fmt("{} found!\n", cnt);
+    return true;
   }
-}
 
-const Microgadget *BinaryAutopsy::findGadget(GadgetType   type,
-                                             unsigned int reg1,
-                                             unsigned int reg2) const {
-  auto it = GadgetPrimitives.find(GadgetType::XCHG);
+  static bool isEqual(ArrayRef<MCInst> a, ArrayRef<MCInst> b) {
+    // the empty and tombstone keys are the only ones without instructions
+    if (a.size() != b.size() || a.empty()) {
+      return a.size() == b.size() && a.data() == b.data();
+    }
 
-  if (it == GadgetPrimitives.end() || it->second.empty()) {
+    for (size_t i = 0; i < a.size(); i++) {
+      if (!isEqual(a[i], b[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+// GadgetSet - instructions of the gadgets found, to check duplication
+using GadgetSet = DenseSet<ArrayRef<MCInst>, GadgetKeyInfo>;
+
+void addScanResult(ScanTask     &task,
+                   GadgetSet    &gadgetSet,
+                   const MCInst *instr,
+                   size_t        count,
+                   uint64_t      addr,
+                   uint64_t      site) {
+  if (addr < task.first || addr >= task.last) {
+    // recorded by the task owning addr, or reused from the previous scan
+    return;
+  }
+
+  auto it = gadgetSet.find(ArrayRef<MCInst>(instr, count));
+  if (it == gadgetSet.end()) {
+    task.found.emplace_back(instr, instr + count);
+    it = gadgetSet.insert(task.found.back()).first;
+  }
+  task.hits.push_back({addr, site, *it});
+}
+
+// number of entries of DecodeCache, a power of two greater than MAXDEPTH
+const uint64_t DECODE_CACHE_SIZE = 8;
+
+// DecodeCache - memoizes the instructions decoded in the windows before a
+// RET. The windows of a RET site overlap, and so do the ones of neighbouring
+// sites, so most positions would otherwise be decoded several times.
+// Entries are indexed by start offset and tagged with the end of the window,
+// since a truncated window may decode the same bytes differently (e.g. as a
+// standalone prefix).
+class DecodeCache {
+  struct Entry {
+    uint64_t start = UINT64_MAX;
+    uint64_t end   = 0;
+    uint64_t size  = 0;
+    bool     valid = false;
+    MCInst   instr;
+  };
+
+  DisassemblerHelper &disasm;
+  Entry               entries[DECODE_CACHE_SIZE];
+
+public:
+  DecodeCache(DisassemblerHelper &disasm) : disasm(disasm) {}
+
+  // decode - returns the instruction at start, decoded reading bytes up to
+  // end (excluded), or nullptr if they are not a valid instruction
+  const Entry *decode(uint64_t start, uint64_t end) {
+    Entry &entry = entries[start & (DECODE_CACHE_SIZE - 1)];
+    if (entry.start != start || entry.end != end) {
+      entry.start = start;
+      entry.end   = end;
+      entry.instr = MCInst();
+      entry.valid = disasm.decode(start, end - start, entry.instr, entry.size);
+    }
+    return entry.valid ? &entry : nullptr;
+  }
+};
+
+void scanRetGadgets(DisassemblerHelper          &disasm,
+                    const uint8_t               *buf,
+                    const std::vector<uint64_t> &sites,
+                    ScanTask                    &task) {
+  // map to check duplication
+  GadgetSet   gadgetSet;
+  DecodeCache cache(disasm);
+
+  // Decode before each RET instruction
+  for (uint64_t i : sites) {
+    size_t         offset  = i + 1;
+    const uint8_t *cur_pos = buf + offset;
+
+    // Iteratively try to decode starting from MAXDEPTH_MULTI to 1
+    // bytes before the actual RET
+    for (int depth = MAXDEPTH_MULTI; depth > 0; depth--) {
+      if ((size_t)depth > offset) {
+        continue;
+      }
+
+      // ignore repeat prefix
+      uint8_t firstbyte = *(cur_pos - depth);
+      if (firstbyte == 0xf2 || firstbyte == 0xf3) {
+        continue;
+      }
+
+      uint64_t addr = offset - depth;
+
+      // skip the windows that certainly do not form a gadget, without
+      // invoking the disassembler
+      if (depth <= MAXDEPTH && mayBeRetGadget(buf, addr, offset)) {
+        // Valid gadgets must have two instructions in the window, and the
+        // last one must be a RET
+        auto first  = cache.decode(addr, offset);
+        auto second = first && addr + first->size < offset
+                          ? cache.decode(addr + first->size, offset)
+                          : nullptr;
+
+        if (second && second->instr.getOpcode() == X86::RETL &&
+            // exclude PREFIX RET
+            first->instr.getOpcode() != X86::DATA16_PREFIX &&
+            first->instr.getOpcode() != X86::LOCK_PREFIX &&
+            first->instr.getOpcode() != X86::REP_PREFIX &&
+            first->instr.getOpcode() != X86::REPNE_PREFIX) {
+          MCInst instructions[2] = {first->instr, second->instr};
+
+          // Each gadget is identified with its opcodes and operands
+          addScanResult(task, gadgetSet, instructions, 2, addr, i);
+        }
+      }
+
+      // Gadgets made of several instructions must end exactly with the RET
+      // of this site, so that each of them is found only once
+      if (depth >= 3 && mayBeRetSequence(buf, addr, offset)) {
+        MCInst   instructions[MAXINSTRS + 1];
+        size_t   count = 0;
+        uint64_t pos   = addr;
+
+        while (pos < i && count < MAXINSTRS) {
+          auto entry = cache.decode(pos, offset);
+          if (!entry || entry->instr.getOpcode() == X86::RETL) {
+            break;
+          }
+          instructions[count++] = entry->instr;
+          pos += entry->size;
+        }
+
+        auto ret = pos == i && count >= 2 ? cache.decode(i, offset) : nullptr;
+
+        if (ret && ret->instr.getOpcode() == X86::RETL) {
+          instructions[count++] = ret->instr;
+          addScanResult(task, gadgetSet, instructions, count, addr, i);
+        }
+      }
+    }
+  }
+}
+
+void scanJmpGadgets(DisassemblerHelper          &disasm,
+                    const std::vector<uint64_t> &sites,
+                    ScanTask                    &task) {
+  // map to check duplication
+  GadgetSet gadgetSet;
+
+  // Decode each indirect jmp instruction
+  for (uint64_t addr : sites) {
+    MCInst inst;
+    size_t count = 1;
+    size_t size  = 2;
+    disasm.disassemble(addr, size, &inst, count);
+    // Valid gadgets must have just one instruction of JMP register
+    if (count == 1 && inst.getOpcode() == X86::JMP32r) {
+      addScanResult(task, gadgetSet, &inst, 1, addr, addr);
+    }
+  }
+}
+
+// getRegSlot - returns the slot of a gadget operand in the gadget lookup
+// table, or -1 if the register has none
+int getRegSlot(unsigned int reg) {
+  switch (reg) {
+  case X86::EAX: return 0;
+  case X86::ECX: return 1;
+  case X86::EDX: return 2;
+  case X86::EBX: return 3;
+  case X86::ESP: return 4;
+  case X86::EBP: return 5;
+  case X86::ESI: return 6;
+  case X86::EDI: return 7;
+  case X86::NoRegister: return N_REG_SLOTS - 1;
+  default: return -1;
+  }
+}
+
+// readsFirstOperand - tells whether a gadget of the given type reads its first
+// register (the second one, if any, is always only read)
+bool readsFirstOperand(GadgetType type) {
+  return type != GadgetType::MOV && type != GadgetType::COPY &&
+         type != GadgetType::LOAD;
+}
+
+// writesFirstOperand - tells whether a gadget of the given type writes its
+// first register
+bool writesFirstOperand(GadgetType type) {
+  return type != GadgetType::STORE && type != GadgetType::JMP;
+}
+
+// isFreeReg - tells whether the physical register reg holds one of the given
+// logical registers
+bool isFreeReg(const XchgState                 &state,
+               unsigned int                     reg,
+               const std::vector<unsigned int> &freeRegs) {
+  return std::any_of(freeRegs.begin(), freeRegs.end(), [&](unsigned int r) {
+    return (unsigned int)state.searchLogicalReg(r) == reg;
+  });
+}
+
+// NO_TRANSFER - cost of an operand transfer that is not possible
+const size_t NO_TRANSFER = SIZE_MAX;
+
+// SLOT_REGS - the register of each slot of the gadget lookup table (see
+// getRegSlot())
+const unsigned int SLOT_REGS[N_REG_SLOTS - 1] = {
+    X86::EAX, X86::ECX, X86::EDX, X86::EBX,
+    X86::ESP, X86::EBP, X86::ESI, X86::EDI};
+
+} // namespace
+
+void BinaryAutopsy::dumpGadgets(const ELFParser   *elf,
+                                unsigned           library,
+                                const GadgetCache &cache,
+                                LibraryScan       &result) const {
+  // The code regions are split in blocks by their content. A block is not
+  // scanned again if the previous scan of the library has a block with the
+  // same bytes, followed by the same block (or by the end of the region),
+  // since a gadget starting in a block may end up to MAXDEPTH_MULTI - 1 bytes
+  // past it: its gadgets are just moved to the new address of the block. The
+  // first block of each region is always scanned, as it also owns the gadgets
+  // starting right before the region.
+  //
+  // The remaining blocks are split in chunks, which are scanned in parallel.
+  // Each chunk owns the scan positions in [begin, end), but decoding may read
+  // up to MAXDEPTH_MULTI bytes before them. Sorting the occurrences of each
+  // region in the order of a serial scan gives the same gadgets, in the same
+  // order, regardless of the number of threads and of the blocks reused.
+  LibraryScan previous, current;
+  bool        incremental = cache.loadLibraryScan(elf->getPath(), previous);
+
+  // previousBlocks - blocks of the previous scan by hash, as (region, index)
+  std::unordered_multimap<uint64_t, std::pair<size_t, size_t>> previousBlocks;
+  // previousHits - occurrences found by the previous scan, sorted by site
+  std::vector<ScanHit> previousHits;
+
+  if (incremental) {
+    for (size_t r = 0; r < previous.regions.size(); r++) {
+      for (size_t j = 0; j < previous.regions[r].size(); j++) {
+        previousBlocks.emplace(previous.regions[r][j].hash,
+                               std::make_pair(r, j));
+      }
+    }
+    for (auto &gadget : previous.gadgets) {
+      for (size_t j = 0; j < gadget.addresses.size(); j++) {
+        previousHits.push_back(
+            {gadget.addresses[j], gadget.sites[j], gadget.Instr});
+      }
+    }
+    std::sort(previousHits.begin(),
+              previousHits.end(),
+              [](const ScanHit &a, const ScanHit &b) {
+                return a.site < b.site;
+              });
+  }
+
+  auto sameBytes = [](const CodeBlock &a, const CodeBlock &b) {
+    return a.hash == b.hash && a.end - a.begin == b.end - b.begin;
+  };
+
+  // findPrevious - returns the position of a previous block that can replace
+  // blocks[k], or nullptr if there is none
+  auto findPrevious = [&](const std::vector<CodeBlock> &blocks,
+                          size_t k) -> const std::pair<size_t, size_t> * {
+    auto range = previousBlocks.equal_range(blocks[k].hash);
+    for (auto it = range.first; it != range.second; ++it) {
+      auto  &oldBlocks = previous.regions[it->second.first];
+      size_t j         = it->second.second;
+      bool   oldLast   = j + 1 == oldBlocks.size();
+      bool   newLast   = k + 1 == blocks.size();
+
+      if (sameBytes(oldBlocks[j], blocks[k]) && oldLast == newLast &&
+          (newLast || sameBytes(oldBlocks[j + 1], blocks[k + 1]))) {
+        return &it->second;
+      }
+    }
     return nullptr;
+  };
+
+  std::vector<ScanTask>             tasks;
+  std::vector<std::vector<ScanHit>> regionHits;
+  uint64_t                          scanned = 0, total = 0;
+
+  for (auto &s : (config.searchSegmentForGadget ? Segments : Sections)) {
+    if (s.Library != library) {
+      continue;
+    }
+
+    uint64_t end    = s.Address + s.Length;
+    size_t   region = current.regions.size();
+
+    current.regions.emplace_back();
+    regionHits.emplace_back();
+    std::vector<CodeBlock> &blocks = current.regions.back();
+    std::vector<ScanHit>   &hits   = regionHits.back();
+    splitCodeBlocks(elf->base(), s.Address, end, blocks);
+    total += s.Length;
+
+    // scan - adds the tasks finding the gadgets starting in [first, last)
+    auto scan = [&](uint64_t first, uint64_t last) {
+      uint64_t siteEnd = std::min(last + MAXDEPTH_MULTI - 1, end);
+      for (uint64_t i = std::max(first, s.Address); i < siteEnd;
+           i += SCAN_CHUNK_SIZE) {
+        uint64_t chunkEnd = std::min(i + SCAN_CHUNK_SIZE, siteEnd);
+        tasks.push_back({i, chunkEnd, end, region, first, last, {}, {}});
+        scanned += chunkEnd - i;
+      }
+    };
+
+    // the first block also owns the gadgets starting before the region
+    uint64_t regionFirst = s.Address - std::min<uint64_t>(s.Address,
+                                                          MAXDEPTH_MULTI - 1);
+    uint64_t dirtyFirst  = 0;
+    bool     dirty       = false;
+
+    for (size_t k = 0; k < blocks.size(); k++) {
+      auto match = incremental && k > 0 ? findPrevious(blocks, k) : nullptr;
+      if (!match) {
+        if (!dirty) {
+          dirtyFirst = k > 0 ? blocks[k].begin : regionFirst;
+          dirty      = true;
+        }
+        continue;
+      }
+      if (dirty) {
+        scan(dirtyFirst, blocks[k].begin);
+        dirty = false;
+      }
+
+      // the occurrences starting in the previous block end before siteEnd
+      auto    &oldBlocks = previous.regions[match->first];
+      auto    &oldBlock  = oldBlocks[match->second];
+      uint64_t siteEnd   = std::min(oldBlock.end + MAXDEPTH_MULTI - 1,
+                                  oldBlocks.back().end);
+      auto     it        = std::partition_point(
+          previousHits.begin(), previousHits.end(), [&](const ScanHit &hit) {
+            return hit.site < oldBlock.begin;
+          });
+
+      for (; it != previousHits.end() && it->site < siteEnd; ++it) {
+        if (it->address >= oldBlock.begin && it->address < oldBlock.end) {
+          hits.push_back({it->address - oldBlock.begin + blocks[k].begin,
+                          it->site - oldBlock.begin + blocks[k].begin,
+                          it->instr});
+        }
+      }
+    }
+    if (dirty) {
+      scan(dirtyFirst, end);
+    }
   }
 
-  for (auto &g : it->second) {
-    if (g->reg1 == reg1 && g->reg2 == reg2) {
-      return g.get();
+  if (incremental) {
+    dbg_fmt("[*] Reusing the previous gadget scan of {}: {} of {} bytes "
+            "scanned again\n",
+            elf->getPath(),
+            scanned,
+            total);
+  }
+
+  unsigned numThreads = config.gadgetScanThreads;
+  if (numThreads == 0) {
+    numThreads = std::thread::hardware_concurrency();
+  }
+  numThreads = std::max(1u, std::min<unsigned>(numThreads, tasks.size()));
+
+  // the target registry is not thread-safe
+  LLVMInitializeX86Disassembler();
+
+  std::atomic<size_t> nextTask(0);
+
+  auto worker = [&]() {
+    DisassemblerHelper    disasm(target, context, *elf);
+    std::vector<uint64_t> retSites, jmpSites;
+
+    for (size_t i = nextTask++; i < tasks.size(); i = nextTask++) {
+      ScanTask &task = tasks[i];
+
+      // only the candidate sites found by the scanner are decoded
+      retSites.clear();
+      jmpSites.clear();
+      findGadgetSites(
+          elf->base(), task.begin, task.end, task.limit, retSites, jmpSites);
+
+      scanRetGadgets(disasm, elf->base(), retSites, task);
+      scanJmpGadgets(disasm, jmpSites, task);
     }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < numThreads; i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : threads) {
+    thread.join();
   }
 
-  return nullptr;
+  for (auto &task : tasks) {
+    auto &hits = regionHits[task.region];
+    hits.insert(hits.end(), task.hits.begin(), task.hits.end());
+  }
+
+  // indexes - positions of the gadgets in current.gadgets, to check
+  // duplication
+  DenseMap<ArrayRef<MCInst>, size_t, GadgetKeyInfo> indexes;
+
+  for (auto &hits : regionHits) {
+    std::sort(hits.begin(), hits.end());
+
+    for (auto &hit : hits) {
+      auto it = indexes.find(hit.instr);
+      if (it != indexes.end()) {
+        ScannedGadget &gadget = current.gadgets[it->second];
+        gadget.addresses.push_back(hit.address);
+        gadget.sites.push_back(hit.site);
+      } else {
+        current.gadgets.push_back({hit.instr.vec(), {hit.address}, {hit.site}});
+        indexes.try_emplace(current.gadgets.back().Instr,
+                            current.gadgets.size() - 1);
+      }
+    }
+  }
+
+  cache.saveLibraryScan(elf->getPath(), current);
+  result = std::move(current);
+}
+
+const Microgadget *BinaryAutopsy::findGadget(GadgetType   type,
+                                             unsigned int reg1,
+                                             unsigned int reg2) const {
+  int slot1 = getRegSlot(reg1);
+  int slot2 = getRegSlot(reg2);
+
+  if (slot1 < 0 || slot2 < 0) {
+    return nullptr;
+  }
+
+  return gadgetTable[static_cast<size_t>(type)][slot1][slot2];
 }
 
 void BinaryAutopsy::buildXchgGraph() {
@@ -687,9 +1573,310 @@ void BinaryAutopsy::buildXchgGraph() {
   }
 }
 
-void BinaryAutopsy::addGadget(std::shared_ptr<Microgadget> gadget) {
+namespace {
+
+// isNop - returns true if the instruction does nothing
+bool isNop(const MCInst &inst) {
+  switch (inst.getOpcode()) {
+  case X86::NOOP:
+  case X86::NOOPW:
+  case X86::NOOPL: return true;
+  default: return false;
+  }
+}
+
+// isPop - returns true if the instruction is "pop REG"
+bool isPop(const MCInst &inst) {
+  return inst.getOpcode() == X86::POP32r || inst.getOpcode() == X86::POP32rmr;
+}
+
+// operand indexes of GadgetForm
+const int NO_OPERAND  = -1;
+const int EAX_OPERAND = -2;
+// condition code of GadgetForm, for non-conditional instructions
+const int NO_COND = -1;
+// primitive of GadgetForm, for instructions not useful in some case
+const GadgetType NO_PRIMITIVE = GadgetType::UNDEFINED;
+
+// GadgetForm - an instruction form implementing a gadget primitive.
+struct GadgetForm {
+  unsigned opcode;
+
+  // type - primitive implemented when the registers of the gadget differ;
+  // sameType - primitive implemented when they are the same register
+  GadgetType type;
+  GadgetType sameType;
+
+  // reg1, reg2 - operand indexes of the registers of the primitive, or
+  // NO_OPERAND / EAX_OPERAND
+  int reg1;
+  int reg2 = NO_OPERAND;
+
+  // mem - index of the memory operand, which must be a plain [REG] (its base
+  // register is then referenced by reg1 or reg2), or NO_OPERAND
+  int mem = NO_OPERAND;
+
+  // cond - condition code, held by the last operand, or NO_COND
+  int cond = NO_COND;
+};
+
+// GADGET_FORMS - the instruction forms recognised by addGadget(). An
+// instruction is listed more than once if it implements several primitives.
+// clang-format off
+const GadgetForm GADGET_FORMS[] = {
+  // pop REG: init
+  {X86::POP32r,      GadgetType::MOV,   NO_PRIMITIVE,       0},
+  {X86::POP32rmr,    GadgetType::MOV,   NO_PRIMITIVE,       0},
+  // add REG1, REG2: add, add_1
+  {X86::ADD32rr,     GadgetType::ADD,   GadgetType::ADD_1,  1, 2},
+  {X86::ADD32rr_REV, GadgetType::ADD,   GadgetType::ADD_1,  1, 2},
+  // sub REG1, REG2: sub, sub_1 (which also zeroes REG like xor_1)
+  {X86::SUB32rr,     GadgetType::SUB,   GadgetType::SUB_1,  1, 2},
+  {X86::SUB32rr_REV, GadgetType::SUB,   GadgetType::SUB_1,  1, 2},
+  {X86::SUB32rr,     NO_PRIMITIVE,      GadgetType::XOR_1,  1, 2},
+  {X86::SUB32rr_REV, NO_PRIMITIVE,      GadgetType::XOR_1,  1, 2},
+  // and REG1, REG2: and, and_1
+  {X86::AND32rr,     GadgetType::AND,   GadgetType::AND_1,  1, 2},
+  {X86::AND32rr_REV, GadgetType::AND,   GadgetType::AND_1,  1, 2},
+  // or REG1, REG2: or, or_1
+  {X86::OR32rr,      GadgetType::OR,    GadgetType::OR_1,   1, 2},
+  {X86::OR32rr_REV,  GadgetType::OR,    GadgetType::OR_1,   1, 2},
+  // and REG, REG, or REG, REG and test REG, REG just set the flags, in the
+  // same way
+  {X86::AND32rr,     NO_PRIMITIVE,      GadgetType::OR_1,   1, 2},
+  {X86::AND32rr_REV, NO_PRIMITIVE,      GadgetType::OR_1,   1, 2},
+  {X86::OR32rr,      NO_PRIMITIVE,      GadgetType::AND_1,  1, 2},
+  {X86::OR32rr_REV,  NO_PRIMITIVE,      GadgetType::AND_1,  1, 2},
+  {X86::TEST32rr,    NO_PRIMITIVE,      GadgetType::AND_1,  0, 1},
+  {X86::TEST32rr,    NO_PRIMITIVE,      GadgetType::OR_1,   0, 1},
+  // xor REG1, REG2: xor, xor_1
+  {X86::XOR32rr,     GadgetType::XOR,   GadgetType::XOR_1,  1, 2},
+  {X86::XOR32rr_REV, GadgetType::XOR,   GadgetType::XOR_1,  1, 2},
+  // inc/dec/neg/not REG
+  {X86::INC32r,      GadgetType::INC,   NO_PRIMITIVE,       0},
+  {X86::INC32r_alt,  GadgetType::INC,   NO_PRIMITIVE,       0},
+  {X86::DEC32r,      GadgetType::DEC,   NO_PRIMITIVE,       0},
+  {X86::DEC32r_alt,  GadgetType::DEC,   NO_PRIMITIVE,       0},
+  {X86::NEG32r,      GadgetType::NEG,   NO_PRIMITIVE,       0},
+  {X86::NOT32r,      GadgetType::NOT,   NO_PRIMITIVE,       0},
+  // mov REG1, REG2 / lea REG1, [REG2]: copy
+  {X86::MOV32rr,     GadgetType::COPY,  NO_PRIMITIVE,       0, 1},
+  {X86::MOV32rr_REV, GadgetType::COPY,  NO_PRIMITIVE,       0, 1},
+  {X86::LEA32r,      GadgetType::COPY,  NO_PRIMITIVE,       0, 1, 1},
+  // mov REG1, [REG2]: load, load_1
+  {X86::MOV32rm,     GadgetType::LOAD,  GadgetType::LOAD_1, 0, 1, 1},
+  // mov [REG1], REG2: store (mov [eax], eax is useless in most cases)
+  {X86::MOV32mr,     GadgetType::STORE, NO_PRIMITIVE,       0, 5, 0},
+  // xchg eax, REG2 / xchg REG1, REG2: xchg
+  {X86::XCHG32ar,    GadgetType::XCHG,  NO_PRIMITIVE,       EAX_OPERAND, 1},
+  {X86::XCHG32rr,    GadgetType::XCHG,  NO_PRIMITIVE,       0, 1},
+  // cmove/cmovb REG1, REG2: cmove, cmovb
+#if LLVM_VERSION_MAJOR >= 9
+  {X86::CMOV32rr,    GadgetType::CMOVE, NO_PRIMITIVE,       1, 2, NO_OPERAND,
+   X86::COND_E},
+  {X86::CMOV32rr,    GadgetType::CMOVB, NO_PRIMITIVE,       1, 2, NO_OPERAND,
+   X86::COND_B},
+#else
+  {X86::CMOVE32rr,   GadgetType::CMOVE, NO_PRIMITIVE,       1, 2},
+  {X86::CMOVB32rr,   GadgetType::CMOVB, NO_PRIMITIVE,       1, 2},
+#endif
+  // push REG1; ret / jmp REG1: jmp
+  {X86::PUSH32r,     GadgetType::JMP,   NO_PRIMITIVE,       0},
+  {X86::PUSH32rmr,   GadgetType::JMP,   NO_PRIMITIVE,       0},
+  {X86::JMP32r,      GadgetType::JMP,   NO_PRIMITIVE,       0},
+};
+// clang-format on
+
+// getFormReg - returns the register referenced by an operand index of
+// GadgetForm
+unsigned int getFormReg(const MCInst &inst, int operand) {
+  switch (operand) {
+  case NO_OPERAND: return X86::NoRegister;
+  case EAX_OPERAND: return X86::EAX;
+  default: return inst.getOperand(operand).getReg();
+  }
+}
+
+// isPlainMemOperand - checks that the memory operand starting at index mem
+// is [REG], i.e. it has a base register but no index register, displacement
+// or segment
+bool isPlainMemOperand(const MCInst &inst, int mem) {
+  if (mem == NO_OPERAND) {
+    return true;
+  }
+
+  // reg(mem + 4):[reg(mem) + imm(mem + 1) * reg(mem + 2) + imm(mem + 3)]
+  const MCOperand &baseReg    = inst.getOperand(mem);
+  const MCOperand &scaleReg   = inst.getOperand(mem + 2);
+  const MCOperand &disp       = inst.getOperand(mem + 3);
+  const MCOperand &segmentReg = inst.getOperand(mem + 4);
+
+  bool hasBaseReg  = baseReg.isReg() && baseReg.getReg() != X86::NoRegister;
+  bool hasScaleReg = scaleReg.isReg() && scaleReg.getReg() != X86::NoRegister;
+  bool hasSegmentReg =
+      segmentReg.isReg() && segmentReg.getReg() != X86::NoRegister;
+  bool hasDisplacement = !disp.isImm() || disp.getImm() != 0;
+  return hasBaseReg && !hasScaleReg && !hasSegmentReg && !hasDisplacement;
+}
+
+} // namespace
+
+bool BinaryAutopsy::computeEffects(Microgadget &gadget) const {
+  static const unsigned GR32[] = {X86::EAX,
+                                  X86::ECX,
+                                  X86::EDX,
+                                  X86::EBX,
+                                  X86::ESP,
+                                  X86::EBP,
+                                  X86::ESI,
+                                  X86::EDI};
+
+  const MCInstrInfo    *instrInfo = target.getMCInstrInfo();
+  const MCRegisterInfo *regInfo   = target.getMCRegisterInfo();
+  GadgetEffects         effects;
+  bool                  stackWritten = false;
+
+  // getRegMask - returns the GR32 registers overlapping reg, as a mask
+  auto getRegMask = [&](unsigned reg) {
+    uint8_t mask = 0;
+    for (unsigned i = 0; i < std::size(GR32); i++) {
+      if (regInfo->isSubRegisterEq(GR32[i], reg)) {
+        mask |= 1 << i;
+      }
+    }
+    return mask;
+  };
+
+  auto addWrittenReg = [&](unsigned reg) {
+    if (reg == X86::EFLAGS) {
+      effects.clobbersFlags = true;
+    }
+    effects.regsWritten |= getRegMask(reg);
+    stackWritten |= regInfo->isSubRegisterEq(X86::ESP, reg);
+  };
+
+  auto addReadReg = [&](unsigned reg) {
+    if (reg == X86::EFLAGS) {
+      effects.readsFlags = true;
+    }
+    effects.regsRead |= getRegMask(reg);
+  };
+
+  for (const MCInst &inst : gadget.getInstr()) {
+    const MCInstrDesc &desc = instrInfo->get(inst.getOpcode());
+
+    // the final RET is not part of the effects
+    if (inst.getOpcode() == X86::RETL) {
+      break;
+    }
+
+    if (isPop(inst)) {
+      effects.stackSlots++;
+      addWrittenReg(inst.getOperand(0).getReg());
+      continue;
+    }
+
+    for (unsigned i = 0; i < inst.getNumOperands(); i++) {
+      const MCOperand &operand = inst.getOperand(i);
+      if (!operand.isReg()) {
+        continue;
+      }
+      if (i < desc.getNumDefs()) {
+        addWrittenReg(operand.getReg());
+      } else {
+        addReadReg(operand.getReg());
+      }
+    }
+    // xchg eax, REG does not list REG among its definitions
+    if (inst.getOpcode() == X86::XCHG16ar ||
+        inst.getOpcode() == X86::XCHG32ar) {
+      addWrittenReg(inst.getOperand(0).getReg());
+    }
+
+#if LLVM_VERSION_MAJOR >= 16
+    for (MCPhysReg reg : desc.implicit_defs()) {
+      addWrittenReg(reg);
+    }
+    for (MCPhysReg reg : desc.implicit_uses()) {
+      addReadReg(reg);
+    }
+#else
+    for (const MCPhysReg *it = desc.getImplicitDefs(); it && *it; ++it) {
+      addWrittenReg(*it);
+    }
+    for (const MCPhysReg *it = desc.getImplicitUses(); it && *it; ++it) {
+      addReadReg(*it);
+    }
+#endif
+
+    effects.readsMemory |= desc.mayLoad();
+    effects.writesMemory |= desc.mayStore();
+  }
+
+  gadget.Effects = effects;
+  return !stackWritten;
+}
+
+const Microgadget *
+BinaryAutopsy::findMultiPopGadget(const unsigned int *regs,
+                                  size_t              count) const {
+  auto it = GadgetPrimitives.find(GadgetType::MULTI_MOV);
+
+  if (it == GadgetPrimitives.end()) {
+    return nullptr;
+  }
+
+  for (auto &g : it->second) {
+    if (g->Effects.stackSlots != count) {
+      continue;
+    }
+
+    size_t i = 0;
+    while (i < count && g->getInstr()[i].getOperand(0).getReg() == regs[i]) {
+      i++;
+    }
+    if (i == count) {
+      return g;
+    }
+  }
+
+  return nullptr;
+}
+
+void BinaryAutopsy::addGadget(Microgadget *gadget) {
+  bool summarised = computeEffects(*gadget);
+
+  // index of the instruction that gives the semantics of the gadget
+  size_t main = 0;
+
+  // Gadgets made of several instructions (the last one is the RET) are only
+  // used if they just pop registers, or if all their instructions but one are
+  // NOPs: in this case they are categorised as that instruction.
+  if (gadget->getInstr().size() > 2) {
+    ArrayRef<MCInst> body = gadget->getInstr().drop_back();
+    size_t           nops = std::count_if(body.begin(), body.end(), isNop);
+
+    if (!summarised) {
+      return;
+    }
+
+    // pop REG1; pop REG2; ...: multi_mov
+    if (std::all_of(body.begin(), body.end(), isPop)) {
+      gadget->reg1 = body[0].getOperand(0).getReg();
+      gadget->reg2 = body[1].getOperand(0).getReg();
+      gadget->Type = GadgetType::MULTI_MOV;
+      GadgetPrimitives[GadgetType::MULTI_MOV].push_back(gadget);
+      return;
+    }
+
+    if (nops != body.size() - 1) {
+      return;
+    }
+    main = std::find_if_not(body.begin(), body.end(), isNop) - body.begin();
+  }
+
   // Categorise the gadgets in primitives
-  const MCInst &inst = gadget->Instr[0];
+  const MCInst &inst = gadget->getInstr()[main];
 
   bool espUsed = false;
   // gadgets with ESP as operand, since we cannot deal with the
@@ -704,280 +1891,416 @@ void BinaryAutopsy::addGadget(std::shared_ptr<Microgadget> gadget) {
     return;
   }
 
-  switch (inst.getOpcode()) {
-  // pop REG: init
-  case X86::POP32r:
-  case X86::POP32rmr: {
-    gadget->reg1 = inst.getOperand(0).getReg();
-    gadget->reg2 = X86::NoRegister;
-    gadget->Type = GadgetType::MOV;
-    GadgetPrimitives[GadgetType::MOV].push_back(gadget);
-    break;
-  }
-  // add REG1, REG2: add
-  case X86::ADD32rr: {
-    gadget->reg1 = inst.getOperand(1).getReg();
-    gadget->reg2 = inst.getOperand(2).getReg();
-    if (gadget->reg1 != gadget->reg2) {
-      gadget->Type = GadgetType::ADD;
-      GadgetPrimitives[GadgetType::ADD].push_back(gadget);
-    } else {
-      gadget->Type = GadgetType::ADD_1;
-      GadgetPrimitives[GadgetType::ADD_1].push_back(gadget);
-    }
-    break;
-  }
-  // sub REG1, REG2: sub
-  case X86::SUB32rr: {
-    gadget->reg1 = inst.getOperand(1).getReg();
-    gadget->reg2 = inst.getOperand(2).getReg();
-    if (gadget->reg1 != gadget->reg2) {
-      gadget->Type = GadgetType::SUB;
-      GadgetPrimitives[GadgetType::SUB].push_back(gadget);
-    } else {
-      gadget->Type = GadgetType::SUB_1;
-      GadgetPrimitives[GadgetType::SUB_1].push_back(gadget);
-    }
-    break;
-  }
-  // and REG1, REG2: and
-  case X86::AND32rr: {
-    gadget->reg1 = inst.getOperand(1).getReg();
-    gadget->reg2 = inst.getOperand(2).getReg();
-    if (gadget->reg1 != gadget->reg2) {
-      gadget->Type = GadgetType::AND;
-      GadgetPrimitives[GadgetType::AND].push_back(gadget);
-    } else {
-      gadget->Type = GadgetType::AND_1;
-      GadgetPrimitives[GadgetType::AND_1].push_back(gadget);
-    }
-    break;
-  }
-  // xor REG1, REG2: xor_1, xor_2
-  case X86::XOR32rr: {
-    gadget->reg1 = inst.getOperand(1).getReg();
-    gadget->reg2 = inst.getOperand(2).getReg();
-    if (gadget->reg1 != gadget->reg2) {
-      gadget->Type = GadgetType::XOR;
-      GadgetPrimitives[GadgetType::XOR].push_back(gadget);
-    } else {
-      gadget->Type = GadgetType::XOR_1;
-      GadgetPrimitives[GadgetType::XOR_1].push_back(gadget);
-    }
-    break;
-  }
-  // mov REG1, REG2: copy
-  case X86::MOV32rr: {
-    gadget->reg1 = inst.getOperand(0).getReg();
-    gadget->reg2 = inst.getOperand(1).getReg();
-    if (gadget->reg1 != gadget->reg2) {
-      gadget->Type = GadgetType::COPY;
-      GadgetPrimitives[GadgetType::COPY].push_back(gadget);
-    }
-    break;
-  }
-  // mov REG, MEM: load
-  case X86::MOV32rm: {
-    // mov reg0, reg5:[reg1 + imm_scale2 * reg3 + imm_disp4]
-    bool hasScaleReg = inst.getOperand(3).isReg() &&
-                       inst.getOperand(3).getReg() != X86::NoRegister;
-    bool hasSegmentReg = inst.getOperand(5).isReg() &&
-                         inst.getOperand(5).getReg() != X86::NoRegister;
-    bool hasDisplacement =
-        !inst.getOperand(4).isImm() || inst.getOperand(4).getImm() != 0;
-    if (hasScaleReg || hasSegmentReg || hasDisplacement) {
-      break;
-    }
-    gadget->reg1 = inst.getOperand(0).getReg();
-    gadget->reg2 = inst.getOperand(1).getReg();
-    if (gadget->reg1 != gadget->reg2) {
-      gadget->Type = GadgetType::LOAD;
-      GadgetPrimitives[GadgetType::LOAD].push_back(gadget);
-    } else {
-      gadget->Type = GadgetType::LOAD_1;
-      GadgetPrimitives[GadgetType::LOAD_1].push_back(gadget);
-    }
-    break;
-  }
-  // mov MEM, REG: store
-  case X86::MOV32mr: {
-    // mov reg4:[reg0 + imm_scale1 * reg2 + imm_disp3], reg5
-    bool hasScaleReg = inst.getOperand(2).isReg() &&
-                       inst.getOperand(2).getReg() != X86::NoRegister;
-    bool hasSegmentReg = inst.getOperand(4).isReg() &&
-                         inst.getOperand(4).getReg() != X86::NoRegister;
-    bool hasDisplacement =
-        !inst.getOperand(3).isImm() || inst.getOperand(3).getImm() != 0;
-    if (hasScaleReg || hasSegmentReg || hasDisplacement) {
-      break;
+  bool added = false;
+
+  for (const GadgetForm &form : GADGET_FORMS) {
+    if (form.opcode != inst.getOpcode() ||
+        !isPlainMemOperand(inst, form.mem)) {
+      continue;
     }
-    gadget->reg1 = inst.getOperand(0).getReg();
-    gadget->reg2 = inst.getOperand(5).getReg();
-    if (gadget->reg1 != gadget->reg2) {
-      gadget->Type = GadgetType::STORE;
-      GadgetPrimitives[GadgetType::STORE].push_back(gadget);
+    if (form.cond != NO_COND &&
+        inst.getOperand(inst.getNumOperands() - 1).getImm() != form.cond) {
+      continue;
     }
-    // mov [eax], eax is useless in most cases so we just ignore it
-    break;
-  }
-  // xchg eax, REG2: xchg
-  case X86::XCHG32ar: {
-    gadget->reg1 = X86::EAX;
-    gadget->reg2 = inst.getOperand(1).getReg();
-    if (gadget->reg1 != gadget->reg2) {
-      gadget->Type = GadgetType::XCHG;
-      GadgetPrimitives[GadgetType::XCHG].push_back(gadget);
+
+    unsigned int reg1 = getFormReg(inst, form.reg1);
+    unsigned int reg2 = getFormReg(inst, form.reg2);
+    GadgetType   type =
+        reg2 != X86::NoRegister && reg1 == reg2 ? form.sameType : form.type;
+    if (type == GadgetType::UNDEFINED) {
+      continue;
     }
-    break;
+
+    // the same gadget may implement several primitives (e.g. sub REG, REG is
+    // both sub_1 and xor_1): each primitive gets its own copy
+    Microgadget *primitive = added ? gadgetStore.copy(*gadget) : gadget;
+    primitive->reg1 = reg1;
+    primitive->reg2 = reg2;
+    primitive->Type = type;
+    GadgetPrimitives[type].push_back(primitive);
+    added = true;
   }
-  // xchg REG1, REG2: xchg
-  case X86::XCHG32rr: {
-    gadget->reg1 = inst.getOperand(0).getReg();
-    gadget->reg2 = inst.getOperand(1).getReg();
-    if (gadget->reg1 != gadget->reg2) {
-      gadget->Type = GadgetType::XCHG;
-      GadgetPrimitives[GadgetType::XCHG].push_back(gadget);
-    }
-    break;
+}
+
+void BinaryAutopsy::buildGadgetTable() {
+  std::fill_n(&gadgetTable[0][0][0],
+              N_GADGET_TYPES * N_REG_SLOTS * N_REG_SLOTS,
+              nullptr);
+
+  for (auto &gadgets : distinctGadgets) {
+    gadgets.clear();
   }
-#if LLVM_VERSION_MAJOR >= 9
-  case X86::CMOV32rr: {
-    gadget->reg1       = inst.getOperand(1).getReg();
-    gadget->reg2       = inst.getOperand(2).getReg();
-    X86::CondCode cond = (X86::CondCode)inst.getOperand(3).getImm();
-    if (gadget->reg1 != gadget->reg2) {
-      if (cond == X86::COND_E) {
-        gadget->Type = GadgetType::CMOVE;
-      } else if (cond == X86::COND_B) {
-        gadget->Type = GadgetType::CMOVB;
-      } else {
-        break;
+
+  for (auto &kv : GadgetPrimitives) {
+    size_t type = static_cast<size_t>(kv.first);
+
+    for (auto &gadget : kv.second) {
+      int slot1 = getRegSlot(gadget->reg1);
+      int slot2 = getRegSlot(gadget->reg2);
+
+      // addGadget() only uses the registers with a slot
+      if (slot1 < 0 || slot2 < 0) {
+        continue;
+      }
+
+      // the gadget found first is kept, as with a linear search
+      const Microgadget *&entry = gadgetTable[type][slot1][slot2];
+      if (!entry) {
+        entry = gadget;
+        distinctGadgets[type].push_back(entry);
       }
-      GadgetPrimitives[gadget->Type].push_back(gadget);
     }
-    break;
-  }
-#else
-  // cmove REG1, REG2: cmove
-  case X86::CMOVE32rr: {
-    gadget->reg1 = inst.getOperand(1).getReg();
-    gadget->reg2 = inst.getOperand(2).getReg();
-    if (gadget->reg1 != gadget->reg2) {
-      gadget->Type = GadgetType::CMOVE;
-      GadgetPrimitives[GadgetType::CMOVE].push_back(gadget);
-    }
-    break;
-  }
-  // cmovb REG1, REG2: cmovb
-  case X86::CMOVB32rr: {
-    gadget->reg1 = inst.getOperand(1).getReg();
-    gadget->reg2 = inst.getOperand(2).getReg();
-    if (gadget->reg1 != gadget->reg2) {
-      gadget->Type = GadgetType::CMOVB;
-      GadgetPrimitives[GadgetType::CMOVB].push_back(gadget);
-    }
-    break;
-  }
-#endif
-  // push REG1; ret: jmp
-  // jmp REG1: jmp
-  case X86::PUSH32r:
-  case X86::PUSH32rmr:
-  case X86::JMP32r: {
-    gadget->reg1 = inst.getOperand(0).getReg();
-    gadget->reg2 = X86::NoRegister;
-    gadget->Type = GadgetType::JMP;
-    GadgetPrimitives[GadgetType::JMP].push_back(gadget);
-    break;
-  }
-  default:
-    // gadget->Type == GadgetType::UNDEFINED;
-    // GadgetPrimitives[GadgetType::UNDEFINED].push_back(gadget);
-    break;
   }
 }
 
 bool BinaryAutopsy::areExchangeable(unsigned int a, unsigned int b) const {
-  int  pred[N_REGS], dist[N_REGS];
-  bool visited[N_REGS];
-
-  return xgraph.checkPath(a, b, pred, dist, visited);
+  return xgraph.checkPath(a, b);
 }
 
-ROPChain BinaryAutopsy::findGadgetPrimitive(XchgState   &state,
-                                            GadgetType   type,
-                                            unsigned int reg1,
-                                            unsigned int reg2) const {
+ROPChain BinaryAutopsy::findGadgetPrimitive(
+    XchgState                       &state,
+    GadgetType                       type,
+    unsigned int                     reg1,
+    unsigned int                     reg2,
+    const std::vector<unsigned int> &freeRegs) const {
   // Note: everytime we need to operate on reg1 and reg2, we need to check
   // which is the actual register that holds that operand.
-  ROPChain           result;
-  const Microgadget *found = nullptr;
+  ROPChain result;
 
-  auto it_gadgets = GadgetPrimitives.find(type);
+  // Attempt #1: find a primitive gadget having the same operands
+  const Microgadget *found = findGadget(type,
+                                        getEffectiveReg(state, reg1),
+                                        getEffectiveReg(state, reg2));
+
+  if (found) {
+    result.emplace_back(ChainElem::fromGadget(found));
+    return result;
+  }
 
-  if (it_gadgets == GadgetPrimitives.end()) {
+  // single-operand primitives (e.g. INIT, POP, ADD_1, JMP) are only used
+  // with their own register: the callers fall back to other strategies
+  if (reg2 == X86::NoRegister) {
     return result;
   }
 
-  const auto &gadgets = it_gadgets->second;
+  // Attempt #2: find a primitive gadget whose operands can be reached from
+  // the ones required, with xchg gadgets or by copying them into free
+  // registers. Gadgets with the same operands are interchangeable here, so
+  // only the first one of each pair of operands is checked. The cost of each
+  // gadget is computed from the exchange graph distances and from a table of
+  // copy distances, filled at most once per call, and only the chain of the
+  // cheapest one is built. Since the copies are planned on the registers free
+  // before the exchanges, the chain of a plan may turn out to be impossible:
+  // the next cheapest plan is built in that case.
+  const OperandMove moves[] = {
+      OperandMove::KEEP, OperandMove::EXCHANGE, OperandMove::COPY};
+  const auto &gadgets = distinctGadgets[static_cast<size_t>(type)];
 
-  // Attempt #1: find a primitive gadget having the same operands
-  for (auto &gadget : gadgets) {
-    if (gadget->reg1 == getEffectiveReg(state, reg1) &&
-        (reg1 == X86::NoRegister ||
-         gadget->reg2 == getEffectiveReg(state, reg2))) {
-      found = gadget.get();
-      break;
+  CopyDistances                copyDistances;
+  std::vector<OperandTransfer> transfers;
+
+  initCopyDistances(state, freeRegs, copyDistances);
+
+  transfers.reserve(gadgets.size() * 2);
+
+  for (const Microgadget *gadget : gadgets) {
+    OperandTransfer best, bestExchange;
+
+    for (OperandMove move2 : moves) {
+      for (OperandMove move1 : moves) {
+        OperandTransfer transfer = {gadget, move1, move2, NO_TRANSFER};
+
+        transfer.cost = planTransfer(
+            state, transfer, reg1, reg2, freeRegs, copyDistances);
+
+        if (transfer.cost < best.cost) {
+          best = transfer;
+        }
+        if (move1 != OperandMove::COPY && move2 != OperandMove::COPY &&
+            transfer.cost < bestExchange.cost) {
+          bestExchange = transfer;
+        }
+      }
+    }
+
+    if (best.cost != NO_TRANSFER) {
+      transfers.push_back(best);
+    }
+
+    // if the copies turn out to be impossible, the gadget can still be
+    // reached with exchanges
+    if (bestExchange.cost != NO_TRANSFER && bestExchange.cost != best.cost) {
+      transfers.push_back(bestExchange);
     }
   }
 
-  // we cannot exchange registers in jmp gadget; just fail
-  if (!found && type == GadgetType::JMP) {
-    return result;
+  std::stable_sort(transfers.begin(),
+                   transfers.end(),
+                   [](const OperandTransfer &a, const OperandTransfer &b) {
+                     return a.cost < b.cost;
+                   });
+
+  for (const OperandTransfer &transfer : transfers) {
+    XchgState transferState(state);
+
+    if (transferOperands(
+            transferState, transfer, reg1, reg2, freeRegs, result)) {
+      state = transferState;
+      return result;
+    }
+
+    result = ROPChain();
   }
 
-  if (found) {
-    result.emplace_back(ChainElem::fromGadget(found));
-    return result;
+  return result;
+}
+
+void BinaryAutopsy::initCopyDistances(
+    const XchgState                 &state,
+    const std::vector<unsigned int> &freeRegs,
+    CopyDistances                   &distances) const {
+  for (unsigned int r : freeRegs) {
+    int slot = getRegSlot(getEffectiveReg(state, r));
+    if (slot >= 0 && slot < N_REG_SLOTS - 1) {
+      distances.isFree[slot] = true;
+    }
   }
+}
 
-  // Attempt #2: find a primitive gadget that has at least operands
-  // exchangeable with the ones required. A proper xchg chain will be
-  // generated.
+size_t BinaryAutopsy::getCopyDistance(CopyDistances &distances,
+                                      unsigned int   src,
+                                      unsigned int   dest) const {
+  int srcSlot  = getRegSlot(src);
+  int destSlot = getRegSlot(dest);
 
-  for (auto &gadget : gadgets) {
+  if (srcSlot < 0 || srcSlot >= N_REG_SLOTS - 1 || destSlot < 0 ||
+      destSlot >= N_REG_SLOTS - 1) {
+    return NO_TRANSFER;
+  }
 
-    // check if given op0 and op1 are respectively exchangeable with
-    // op0 and op1 of the gadget
-    if (areExchangeable(getEffectiveReg(state, reg1), gadget->reg1) &&
-        ((reg2 == X86::NoRegister) // only if op1 is present
-         ^ areExchangeable(getEffectiveReg(state, reg2), gadget->reg2))) {
+  uint8_t *dist = distances.rows[srcSlot];
 
-      if (reg2 != X86::NoRegister) {
-        if ((getEffectiveReg(state, reg1) == gadget->reg2 &&
-             getEffectiveReg(state, reg2) == gadget->reg1) ||
-            (getEffectiveReg(state, reg1) == gadget->reg1 &&
-             getEffectiveReg(state, reg2) == gadget->reg2) ||
-            (getEffectiveReg(state, reg1) == getEffectiveReg(state, reg2) &&
-             gadget->reg1 == gadget->reg2)) {
-          DEBUG_WITH_TYPE(XCHG_CHAIN, dbg_fmt("\t\tavoiding double xchg\n"));
-        } else {
-          auto xchgChain1 =
-              exchangeRegs(state, getEffectiveReg(state, reg2), gadget->reg2);
-          result.append(xchgChain1);
+  if (!distances.filled[srcSlot]) {
+    // Breadth First Search from src, going on only through the free
+    // registers
+    int queue[N_REG_SLOTS - 1];
+    int first = 0, last = 0;
+
+    std::fill_n(dist, N_REG_SLOTS - 1, UINT8_MAX);
+    dist[srcSlot] = 0;
+    queue[last++] = srcSlot;
+
+    while (first < last) {
+      int u = queue[first++];
+
+      if (u != srcSlot && !distances.isFree[u]) {
+        continue;
+      }
+
+      for (int v = 0; v < N_REG_SLOTS - 1; v++) {
+        if (dist[v] == UINT8_MAX &&
+            findGadget(GadgetType::COPY, SLOT_REGS[v], SLOT_REGS[u])) {
+          dist[v]       = dist[u] + 1;
+          queue[last++] = v;
         }
       }
+    }
+    distances.filled[srcSlot] = true;
+  }
+
+  return dist[destSlot] == UINT8_MAX ? NO_TRANSFER : dist[destSlot];
+}
 
-      auto xchgChain0 =
-          exchangeRegs(state, getEffectiveReg(state, reg1), gadget->reg1);
-      result.append(xchgChain0);
+size_t BinaryAutopsy::planTransfer(const XchgState                 &state,
+                                   const OperandTransfer           &transfer,
+                                   unsigned int                     reg1,
+                                   unsigned int                     reg2,
+                                   const std::vector<unsigned int> &freeRegs,
+                                   CopyDistances &copyDistances) const {
+  const Microgadget *gadget = transfer.gadget;
+  GadgetType         type   = gadget->Type;
+  unsigned int       src1   = getEffectiveReg(state, reg1);
+  unsigned int       src2   = getEffectiveReg(state, reg2);
+  size_t             cost   = 1;
+
+  // the operands of the gadget are the same register if and only if the
+  // ones of the primitive are
+  if ((reg1 == reg2) != (gadget->reg1 == gadget->reg2)) {
+    return NO_TRANSFER;
+  }
 
-      result.emplace_back(ChainElem::fromGadget(gadget.get()));
-      break;
+  // exchange - exchanges the contents of a and b, adding the cost of the
+  // xchg gadgets needed. Returns false if they cannot be exchanged.
+  auto exchange = [&](unsigned int a, unsigned int b) {
+    int distance = xgraph.getDistance(a, b);
+    if (distance <= 0) {
+      return false;
     }
+
+    cost += 2 * distance - 1;
+    src1 = src1 == a ? b : src1 == b ? a : src1;
+    src2 = src2 == a ? b : src2 == b ? a : src2;
+    return true;
+  };
+
+  // copying an operand needs its own free register in the gadget
+  auto canCopy = [&](unsigned int reg) {
+    return !freeRegs.empty() && reg1 != reg2 && isFreeReg(state, reg, freeRegs);
+  };
+
+  // exchanges are performed first, second operand first
+  if (transfer.move2 == OperandMove::EXCHANGE &&
+      (src2 == gadget->reg2 || !exchange(src2, gadget->reg2))) {
+    return NO_TRANSFER;
   }
 
-  return result;
+  if (transfer.move1 == OperandMove::EXCHANGE &&
+      (src1 == gadget->reg1 || !exchange(src1, gadget->reg1))) {
+    return NO_TRANSFER;
+  }
+
+  if (transfer.move2 == OperandMove::COPY) {
+    if (src2 == gadget->reg2 || !canCopy(gadget->reg2)) {
+      return NO_TRANSFER;
+    }
+
+    size_t copy = getCopyDistance(copyDistances, src2, gadget->reg2);
+    if (copy == NO_TRANSFER) {
+      return NO_TRANSFER;
+    }
+    cost += copy;
+  } else if (src2 != gadget->reg2) {
+    return NO_TRANSFER;
+  }
+
+  if (transfer.move1 == OperandMove::COPY) {
+    // the values popped by a pop gadget must follow it in the chain, so its
+    // register cannot be copied back afterwards
+    if (src1 == gadget->reg1 || type == GadgetType::MOV ||
+        !canCopy(gadget->reg1)) {
+      return NO_TRANSFER;
+    }
+
+    size_t copyIn  = readsFirstOperand(type)
+                         ? getCopyDistance(copyDistances, src1, gadget->reg1)
+                         : 0;
+    size_t copyOut = writesFirstOperand(type)
+                         ? getCopyDistance(copyDistances, gadget->reg1, src1)
+                         : 0;
+    if (copyIn == NO_TRANSFER || copyOut == NO_TRANSFER) {
+      return NO_TRANSFER;
+    }
+    cost += copyIn + copyOut;
+  } else if (src1 != gadget->reg1) {
+    return NO_TRANSFER;
+  }
+
+  return cost;
+}
+
+bool BinaryAutopsy::transferOperands(XchgState                       &state,
+                                     const OperandTransfer           &transfer,
+                                     unsigned int                     reg1,
+                                     unsigned int                     reg2,
+                                     const std::vector<unsigned int> &freeRegs,
+                                     ROPChain &result) const {
+  const Microgadget *gadget = transfer.gadget;
+  GadgetType         type   = gadget->Type;
+
+  if (transfer.move2 == OperandMove::EXCHANGE) {
+    result.append(
+        exchangeRegs(state, getEffectiveReg(state, reg2), gadget->reg2));
+  }
+
+  if (transfer.move1 == OperandMove::EXCHANGE) {
+    result.append(
+        exchangeRegs(state, getEffectiveReg(state, reg1), gadget->reg1));
+  }
+
+  // copies leave the state untouched; the copy of the second operand must not
+  // be overwritten by the one of the first operand
+  if (transfer.move2 == OperandMove::COPY &&
+      !findCopyPath(state,
+                    getEffectiveReg(state, reg2),
+                    gadget->reg2,
+                    freeRegs,
+                    X86::NoRegister,
+                    result)) {
+    return false;
+  }
+
+  bool         copyFirst = transfer.move1 == OperandMove::COPY;
+  unsigned int src1      = getEffectiveReg(state, reg1);
+  unsigned int copy2     = X86::NoRegister;
+
+  if (transfer.move2 == OperandMove::COPY) {
+    copy2 = gadget->reg2;
+  }
+
+  if (copyFirst && readsFirstOperand(type) &&
+      !findCopyPath(state, src1, gadget->reg1, freeRegs, copy2, result)) {
+    return false;
+  }
+
+  result.emplace_back(ChainElem::fromGadget(gadget));
+
+  if (copyFirst && writesFirstOperand(type) &&
+      !findCopyPath(
+          state, gadget->reg1, src1, freeRegs, X86::NoRegister, result)) {
+    return false;
+  }
+
+  return true;
+}
+
+bool BinaryAutopsy::findCopyPath(const XchgState                 &state,
+                                 unsigned int                     src,
+                                 unsigned int                     dest,
+                                 const std::vector<unsigned int> &freeRegs,
+                                 unsigned int                     excluded,
+                                 ROPChain &result) const {
+  // the registers the value can go through, in breadth first order, with the
+  // index of the register it comes from
+  std::vector<unsigned int> nodes = {src};
+  std::vector<int>          pred  = {-1};
+  std::vector<unsigned int> candidates;
+
+  for (unsigned int r : freeRegs) {
+    unsigned int reg = getEffectiveReg(state, r);
+    if (reg != src && reg != dest && reg != excluded) {
+      candidates.push_back(reg);
+    }
+  }
+  candidates.push_back(dest);
+
+  for (size_t i = 0; i < nodes.size(); i++) {
+    for (unsigned int reg : candidates) {
+      if (std::find(nodes.begin(), nodes.end(), reg) != nodes.end() ||
+          !findGadget(GadgetType::COPY, reg, nodes[i])) {
+        continue;
+      }
+
+      nodes.push_back(reg);
+      pred.push_back(i);
+
+      if (reg != dest) {
+        continue;
+      }
+
+      std::vector<const Microgadget *> path;
+      for (int k = nodes.size() - 1; pred[k] != -1; k = pred[k]) {
+        path.push_back(findGadget(GadgetType::COPY, nodes[k], nodes[pred[k]]));
+      }
+
+      for (auto it = path.rbegin(); it != path.rend(); ++it) {
+        result.emplace_back(ChainElem::fromGadget(*it));
+      }
+
+      return true;
+    }
+  }
+
+  return false;
 }
 
 ROPChain BinaryAutopsy::buildXchgChain(XchgPath const &path) const {
@@ -1020,21 +2343,25 @@ unsigned int BinaryAutopsy::getEffectiveReg(const XchgState &state,
   return state.searchLogicalReg(reg);
 }
 
+std::string BinaryAutopsy::getLibraryHash(unsigned library) const {
+  return libraries[library]->getSHA1HashHex();
+}
+
 void BinaryAutopsy::debugPrintGadgets() const {
   const auto *regInfo = target.getMCRegisterInfo();
 
   for (auto &kv : GadgetPrimitives) {
-    dbg_fmt("Gadgets of type {}:\n", (int)kv.first);
+    dbg_fmt("Gadgets of type {}:\n", getGadgetTypeName(kv.first));
     for (auto &g : kv.second) {
       dbg_fmt("  {}\t{}#{}, {}#{}\t@",
-              g->asmInstr,
+              g->getAsmInstr(),
               regInfo->getName(g->reg1),
               g->reg1,
               regInfo->getName(g->reg2),
               g->reg2);
 
-      for (uint64_t addr : g->addresses) {
-        dbg_fmt(" 0x{:x}", addr);
+      for (uint64_t addr : g->getAddresses()) {
+        dbg_fmt(" {}:0x{:x}", g->Library, addr);
       }
       dbg_fmt("\n");
     }
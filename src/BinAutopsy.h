@@ -12,10 +12,14 @@
 //      - microgadgets from executable sections
 //
 // Microgadgets are a subset of what are commonly known as ROP Gadgets, with the
-// only difference that we grab only the ones composed by a single instruction
-// before the ret, e.g.:
+// only difference that we grab only short ones: a single instruction before
+// the ret, e.g.:
 //        mov eax, ebx
 //        ret
+// a single instruction padded with nops, or a sequence of pops, e.g.:
+//        pop eax
+//        pop edx
+//        ret
 //
 // This module offers also a set of helper methods to search for a specific
 // microgadget or verify the exchangeability of its operands.
@@ -24,6 +28,7 @@
 #define BINAUTOPSY_H
 
 #include "ChainElem.h"
+#include "GadgetScanner.h"
 #include "Microgadget.h"
 #include "ROPEngine.h"
 #include "ROPfuscatorConfig.h"
@@ -33,7 +38,10 @@
 #include "XchgGraph.h"
 #include "llvm/IR/Module.h"
 #include "llvm/MC/MCContext.h"
+#include "llvm/Support/Error.h"
 #include "llvm/Target/TargetMachine.h"
+#include <cstdint>
+#include <future>
 #include <map>
 #include <memory>
 #include <string>
@@ -45,9 +53,39 @@ namespace ropf {
 // see BinaryAutopsy::extractGadgets()
 #define MAXDEPTH 4
 
+// Max bytes before the RET to be examined for gadgets made of several
+// instructions (RET included), and max number of instructions before the RET
+#define MAXDEPTH_MULTI 8
+#define MAXINSTRS 4
+
+// Number of register slots of the gadget lookup table: the eight 32-bit
+// general purpose registers, and no register
+#define N_REG_SLOTS 9
+
 // forward declaration
 class ROPChain;
 class ELFParser;
+class GadgetCache;
+
+// ScannedGadget - a gadget found by the gadget scan, before classification
+struct ScannedGadget {
+  std::vector<llvm::MCInst> Instr;
+  std::vector<uint64_t>     addresses;
+
+  // sites - for each address, the position of the RET or JMP that ends the
+  // gadget
+  std::vector<uint64_t> sites;
+};
+
+// LibraryScan - raw results of the gadget scan of a library, kept by
+// GadgetCache so that a later version of the same library can be scanned
+// again only where its code has changed (see BinaryAutopsy::dumpGadgets()).
+struct LibraryScan {
+  // regions - blocks of each code region of the library
+  std::vector<std::vector<CodeBlock>> regions;
+
+  std::vector<ScannedGadget> gadgets;
+};
 
 // BinaryAutopsy - dumps all the data needed by ROPfuscator.
 // It provides also methods to look for specific gadgets and performs
@@ -60,18 +98,33 @@ private:
   // Singleton
   static BinaryAutopsy *instance;
   BinaryAutopsy(const GlobalConfig        &config,
-                const llvm::Module        &module,
                 const llvm::TargetMachine &target,
                 llvm::MCContext           &context);
   BinaryAutopsy()                      = delete;
   BinaryAutopsy(const BinaryAutopsy &) = delete;
-  ~BinaryAutopsy();
 
-  const llvm::Module        &module;
   const llvm::TargetMachine &target;
   llvm::MCContext           &context;
   const GlobalConfig        &config;
 
+  // ownedTarget, ownedContext - target machine and MC context created for an
+  // analysis running in background (see startAnalysis())
+  std::unique_ptr<llvm::TargetMachine> ownedTarget;
+  std::unique_ptr<llvm::MCContext>     ownedContext;
+
+  // gadgetTable - for each gadget type and slots of its operands, the first
+  // gadget of GadgetPrimitives with those operands (see buildGadgetTable())
+  const Microgadget *gadgetTable[N_GADGET_TYPES][N_REG_SLOTS][N_REG_SLOTS];
+
+  // distinctGadgets - for each gadget type, the gadgets of gadgetTable in the
+  // order of GadgetPrimitives
+  std::vector<const Microgadget *> distinctGadgets[N_GADGET_TYPES];
+
+  // analyseLibraries - opens the libraries given in config and analyses them,
+  // or loads the analysis from the cache. Errors are returned rather than
+  // reported, since it may run on a background thread (see startAnalysis()).
+  llvm::Error analyseLibraries();
+
 public:
   // XchgGraph instance
   XchgGraph xgraph;
@@ -84,42 +137,80 @@ public:
   // Segments - results from dumpSegments() are placed here
   std::vector<Section> Segments;
 
+  // gadgetStore - owns the gadgets of GadgetPrimitives
+  GadgetStore gadgetStore;
+
   // GadgetPrimitives - results from dumpGadgets() are placed here
-  std::map<GadgetType, std::vector<std::shared_ptr<Microgadget>>>
-      GadgetPrimitives;
+  std::map<GadgetType, std::vector<const Microgadget *>> GadgetPrimitives;
 
-  // elf - a handle to analyse ELF file. Used by dumpSections() and
-  // dumpDynamicSymbols()
-  std::unique_ptr<ELFParser> elf;
+  // libraries - handles to the gadget libraries: config.libraryPath, followed
+  // by config.extraGadgetLibraries. Sections, symbols and gadgets refer to
+  // them by index.
+  std::vector<std::unique_ptr<ELFParser>> libraries;
 
-  // otherlibs - handles to other ELF libraries.
-  std::vector<std::unique_ptr<ELFParser>> otherLibs;
+  // librarySymbols - range [first, second) of Symbols of each library
+  std::vector<std::pair<size_t, size_t>> librarySymbols;
 
   bool isModuleSymbolAnalysed;
 
-  // getInstance - returns an instance of this singleton class
+  // getInstance - returns an instance of this singleton class. If an analysis
+  // has been started with startAnalysis(), waitForAnalysis() must be called
+  // first.
   static BinaryAutopsy *getInstance(const GlobalConfig    &config,
                                     llvm::MachineFunction &MF);
 
+  // startAnalysis - starts analysing the libraries given in config on a
+  // background thread, with a target machine and MC context of its own, so
+  // that the analysis overlaps with the code generation of the module.
+  // config must neither change nor be destroyed until the result is passed
+  // to waitForAnalysis(). The result is an invalid future if the singleton
+  // instance exists already.
+  static std::future<llvm::Expected<BinaryAutopsy *>>
+  startAnalysis(const GlobalConfig &config, const std::string &triple);
+
+  // waitForAnalysis - waits for the analysis started by startAnalysis(), if
+  // pending is valid, and makes its result the singleton instance. The errors
+  // of the analysis are reported here, on the calling thread.
+  static void
+  waitForAnalysis(std::future<llvm::Expected<BinaryAutopsy *>> &pending);
+
+  // create - analyses the library given in config, independently of the
+  // singleton instance. This is meant for standalone tools (e.g.
+  // ropf-autopsy); config must outlive the returned object.
+  static llvm::Expected<std::unique_ptr<BinaryAutopsy>>
+  create(const GlobalConfig        &config,
+         const llvm::Module        &module,
+         const llvm::TargetMachine &target,
+         llvm::MCContext           &context);
+
+  ~BinaryAutopsy();
+
   // -----------------------------------------------------------------------------
   //  ANALYSES
   // -----------------------------------------------------------------------------
 
 private:
-  // dissect - dumps all the data and performs every analysis.
-  void dissect(ELFParser *);
+  // dissect - dumps all the data and performs every analysis on each gadget
+  // library. The scan results of earlier versions of the libraries are taken
+  // from the cache, if available.
+  void dissect(const GadgetCache &);
 
   // dumpSections - parses the ELF header to obtain a list of
   // sections that contain executable code, from which the symbol and gadget
   // extraction will take place.
-  void dumpSections(const ELFParser *, std::vector<Section> &) const;
+  void dumpSections(const ELFParser *,
+                    unsigned library,
+                    std::vector<Section> &) const;
 
-  void dumpSegments(const ELFParser *, std::vector<Section> &) const;
+  void dumpSegments(const ELFParser *,
+                    unsigned library,
+                    std::vector<Section> &) const;
 
   // dumpDynamicSymbols - extracts symbols from the .dynsym section. It takes
   // into account only function symbols with global scope and used in executable
   // sections.
   void dumpDynamicSymbols(const ELFParser *,
+                          unsigned library,
                           std::vector<Symbol> &,
                           bool safeOnly) const;
 
@@ -128,44 +219,87 @@ private:
   bool isSafeSymbol(const Symbol &) const;
 
   // dumpGadgets - extracts every microgadget (i.e., single instructions
-  // before a RET) that can be found in executable sections. Each instruction is
-  // decoded with LLVM disassembler engine.
+  // before a RET, or short sequences of up to MAXINSTRS instructions) that can
+  // be found in executable sections. Each instruction is decoded with LLVM
+  // disassembler engine. Blocks of code unchanged since the scan stored in the
+  // cache are not decoded again: their gadgets are moved to the new addresses.
   void dumpGadgets(const ELFParser *,
-                   std::vector<std::shared_ptr<Microgadget>> &) const;
+                   unsigned library,
+                   const GadgetCache &,
+                   LibraryScan &) const;
 
   // buildXchgGraph - creates a new instance of xgraph and feeds it with all the
   // XCHG gadgets that have been found.
   void buildXchgGraph();
 
-  // register gadget in GadgetPrimitives with some filters.
-  void addGadget(std::shared_ptr<Microgadget> gadget);
+  // buildGadgetTable - indexes GadgetPrimitives by gadget type and operands,
+  // so that gadgets are looked up in constant time while building the chains.
+  void buildGadgetTable();
 
-  // analyseUsedSymbols - traverse the module and register the symbol names
-  // with forbidden list
-  void analyseUsedSymbols();
+  // register gadget in GadgetPrimitives with some filters.
+  void addGadget(Microgadget *gadget);
+
+  // computeEffects - fills the effect summary of the gadget. Returns false if
+  // the gadget modifies the stack pointer other than with POP, in which case
+  // the summary is incomplete (the gadget may not return to the chain).
+  bool computeEffects(Microgadget &gadget) const;
+
+  // dumpSymbolNameHashes - returns the sorted hashes of the names of the
+  // global function symbols defined by a library. Used to match the symbols of
+  // linked libraries without keeping their names around.
+  void dumpSymbolNameHashes(const ELFParser *, std::vector<uint64_t> &) const;
+
+  // analyseUsedSymbols - traverse the linked libraries, and remove from
+  // Symbols every symbol whose name is defined there or in another gadget
+  // library
+  llvm::Error analyseUsedSymbols(const GadgetCache &);
+
+  // analyseModuleSymbols - remove from Symbols every symbol whose name is
+  // defined in the module, and group the remaining ones by library. This is
+  // the only part of the analysis that depends on the module, so it is done
+  // on the thread that owns it.
+  void analyseModuleSymbols(const llvm::Module &module);
+
+  // getSymbolNameHashes - returns the result of dumpSymbolNameHashes() for the
+  // given library, using the copy in the cache if possible.
+  llvm::Expected<std::vector<uint64_t>>
+  getSymbolNameHashes(const GadgetCache &,
+                      const std::string &path,
+                      const ELFParser   *elf) const;
 
 public:
   // -----------------------------------------------------------------------------
   //  HELPER METHODS
   // -----------------------------------------------------------------------------
 
-  // getRandomSymbol - returns a random symbol. This is used to reference each
-  // gadget in the ROP chain as sum of a random symbol address and the gadget
-  // offset from it.
-  const Symbol *getRandomSymbol() const;
-
-  // findGadget - set of overloaded methods to look for a specific gadget in
-  // the set of the ones that have been previously discovered.
-  // const Microgadget *findGadget(std::string asmInstr) const;
+  // getRandomSymbol - returns a random symbol of the given gadget library.
+  // This is used to reference each gadget in the ROP chain as sum of a random
+  // symbol address and the gadget offset from it.
+  const Symbol *getRandomSymbol(unsigned library = 0) const;
 
+  // findGadget - returns the first gadget of the given type with the given
+  // operands, or nullptr if there is none.
   const Microgadget *findGadget(GadgetType   type,
                                 unsigned int op0,
                                 unsigned int op1 = llvm::X86::NoRegister) const;
 
-  ROPChain findGadgetPrimitive(XchgState   &state,
-                               GadgetType   type,
-                               unsigned int reg1,
-                               unsigned int reg2 = llvm::X86::NoRegister) const;
+  // findMultiPopGadget - returns a gadget made only of "pop REG"
+  // instructions, popping exactly the given registers in the given order.
+  const Microgadget *findMultiPopGadget(const unsigned int *regs,
+                                        size_t              count) const;
+
+  // findGadgetPrimitive - returns a chain implementing the given primitive
+  // on the logical registers reg1 and reg2. If no gadget has exactly these
+  // operands and the primitive has two of them, they are moved into the ones
+  // of the gadget needing the shortest chain, exchanging them with xchg
+  // gadgets or copying them with COPY gadgets through freeRegs, the logical
+  // registers whose value is no longer needed.
+  ROPChain findGadgetPrimitive(
+      XchgState                       &state,
+      GadgetType                       type,
+      unsigned int                     reg1,
+      unsigned int                     reg2     = llvm::X86::NoRegister,
+      const std::vector<unsigned int> &freeRegs = {}) const;
 
   // areExchangeable - uses XChgGraph to check whether two (or more
   // registers) can be mutually exchanged.
@@ -180,12 +314,85 @@ public:
 
   unsigned int getEffectiveReg(const XchgState &state, unsigned int reg) const;
 
+  // getLibraryHash - returns the SHA1 hash (in hex) of the given gadget
+  // library.
+  std::string getLibraryHash(unsigned library = 0) const;
+
   void debugPrintGadgets() const;
 
 private:
   // Takes a path from the XchgGraph and build a ROP Chains with the right
   // Xchg microgadgets
   ROPChain buildXchgChain(XchgPath const &path) const;
+
+  // OperandMove - how an operand of a primitive is moved into the register of
+  // a gadget implementing it (see findGadgetPrimitive())
+  enum class OperandMove { KEEP, EXCHANGE, COPY };
+
+  // OperandTransfer - the moves of both operands of a primitive into the
+  // registers of a gadget, and the length of the resulting chain (SIZE_MAX if
+  // they are not possible)
+  struct OperandTransfer {
+    const Microgadget *gadget = nullptr;
+    OperandMove        move1  = OperandMove::KEEP;
+    OperandMove        move2  = OperandMove::KEEP;
+    size_t             cost   = SIZE_MAX;
+  };
+
+  // CopyDistances - number of COPY gadgets needed to move a value from a
+  // general purpose register to another, by slot (see buildGadgetTable()),
+  // passing only through the physical registers holding free logical
+  // registers. The row of each source register is filled on first use (see
+  // getCopyDistance()).
+  struct CopyDistances {
+    uint8_t rows[N_REG_SLOTS - 1][N_REG_SLOTS - 1];
+    bool    filled[N_REG_SLOTS - 1] = {};
+    bool    isFree[N_REG_SLOTS - 1] = {};
+  };
+
+  // initCopyDistances - marks the physical registers holding freeRegs as the
+  // ones the copies can pass through.
+  void initCopyDistances(const XchgState                 &state,
+                         const std::vector<unsigned int> &freeRegs,
+                         CopyDistances                   &distances) const;
+
+  // getCopyDistance - returns the number of COPY gadgets needed to move the
+  // value of the physical register src into dest, or SIZE_MAX if it is not
+  // possible.
+  size_t getCopyDistance(CopyDistances &distances,
+                         unsigned int   src,
+                         unsigned int   dest) const;
+
+  // planTransfer - returns the length of the chain moving the logical
+  // registers reg1 and reg2 into the operands of the gadget as given by
+  // transfer, followed by the gadget, or SIZE_MAX if it is not possible. It
+  // is computed without building the chain.
+  size_t planTransfer(const XchgState                 &state,
+                      const OperandTransfer           &transfer,
+                      unsigned int                     reg1,
+                      unsigned int                     reg2,
+                      const std::vector<unsigned int> &freeRegs,
+                      CopyDistances                   &copyDistances) const;
+
+  // transferOperands - appends to result the chain planned by planTransfer().
+  // Returns false if some copy turns out not to be possible.
+  bool transferOperands(XchgState                       &state,
+                        const OperandTransfer           &transfer,
+                        unsigned int                     reg1,
+                        unsigned int                     reg2,
+                        const std::vector<unsigned int> &freeRegs,
+                        ROPChain                        &result) const;
+
+  // findCopyPath - appends to result the fewest COPY gadgets moving the value
+  // of the physical register src into dest, passing only through the
+  // physical registers holding freeRegs, except for excluded. Returns false
+  // if there is no such sequence.
+  bool findCopyPath(const XchgState                 &state,
+                    unsigned int                     src,
+                    unsigned int                     dest,
+                    const std::vector<unsigned int> &freeRegs,
+                    unsigned int                     excluded,
+                    ROPChain                        &result) const;
 };
 
 } // namespace ropf
@@ -137,7 +137,7 @@ struct ChainElem {
   void debugPrint(std::ostream &os) const {
     switch (type) {
     case Type::GADGET:
-      fmt::print(os, "GADGET\t:{}\n", microgadget->asmInstr);
+      fmt::print(os, "GADGET\t:{}\n", microgadget->getAsmInstr());
       break;
     case Type::IMM_VALUE: fmt::print(os, "IMM_VALUE\t:{}\n", value); break;
     case Type::IMM_GLOBAL:
@@ -0,0 +1,646 @@
+// ==============================================================================
+//   GADGET CACHE
+//   part of the ROPfuscator project
+// ==============================================================================
+
+#include "GadgetCache.h"
+#include "BinAutopsy.h"
+#include "Debug.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+#define FMT_HEADER_ONLY
+#include <algorithm>
+#include <fmt/format.h>
+
+using namespace llvm;
+
+namespace ropf {
+
+namespace {
+
+const char CACHE_MAGIC[8]        = {'R', 'O', 'P', 'F', 'G', 'C', 'H', 'E'};
+const char SYMBOL_INDEX_MAGIC[8] = {'R', 'O', 'P', 'F', 'S', 'Y', 'M', 'S'};
+const char LIBRARY_SCAN_MAGIC[8] = {'R', 'O', 'P', 'F', 'S', 'C', 'A', 'N'};
+
+// MCOperand kinds stored in the cache
+enum OperandKind : uint8_t { OPERAND_INVALID = 0, OPERAND_REG, OPERAND_IMM };
+
+class CacheWriter {
+  support::endian::Writer W;
+
+public:
+  CacheWriter(raw_ostream &os) : W(os, support::little) {}
+
+  template <typename T> void write(T value) { W.write<T>(value); }
+
+  void writeString(const std::string &s) {
+    write<uint32_t>(s.size());
+    W.OS << s;
+  }
+
+  void writeMagic(const char (&magic)[8]) { W.OS.write(magic, sizeof(magic)); }
+};
+
+class CacheReader {
+  StringRef data;
+  size_t    pos;
+  bool      error;
+
+public:
+  CacheReader(StringRef data) : data(data), pos(0), error(false) {}
+
+  bool failed() const { return error; }
+
+  template <typename T> T read() {
+    if (error || data.size() - pos < sizeof(T)) {
+      error = true;
+      return T();
+    }
+    T value = support::endian::read<T, support::little, support::unaligned>(
+        data.data() + pos);
+    pos += sizeof(T);
+    return value;
+  }
+
+  // readCount - reads the number of elements of an array; each element takes
+  // at least one byte, so larger values can only come from a corrupted file.
+  size_t readCount() {
+    uint32_t count = read<uint32_t>();
+    if (error || count > data.size() - pos) {
+      error = true;
+      return 0;
+    }
+    return count;
+  }
+
+  std::string readString() {
+    size_t len = readCount();
+    if (error) {
+      return "";
+    }
+    std::string s = data.substr(pos, len).str();
+    pos += len;
+    return s;
+  }
+
+  bool readMagic(const char (&magic)[8]) {
+    if (data.size() - pos < sizeof(magic) ||
+        memcmp(data.data() + pos, magic, sizeof(magic)) != 0) {
+      error = true;
+      return false;
+    }
+    pos += sizeof(magic);
+    return true;
+  }
+};
+
+void writeSections(CacheWriter &W, const std::vector<Section> &sections) {
+  W.write<uint32_t>(sections.size());
+  for (auto &s : sections) {
+    W.writeString(s.Label);
+    W.write<uint64_t>(s.Address);
+    W.write<uint64_t>(s.Length);
+    W.write<uint32_t>(s.Library);
+  }
+}
+
+void readSections(CacheReader &R, std::vector<Section> &sections) {
+  size_t count = R.readCount();
+  for (size_t i = 0; i < count && !R.failed(); i++) {
+    std::string label   = R.readString();
+    uint64_t    address = R.read<uint64_t>();
+    uint64_t    length  = R.read<uint64_t>();
+    unsigned    library = R.read<uint32_t>();
+    sections.emplace_back(label, address, length, library);
+  }
+}
+
+void writeInstr(CacheWriter &W, const MCInst &inst) {
+  W.write<uint32_t>(inst.getOpcode());
+  W.write<uint32_t>(inst.getNumOperands());
+  for (unsigned int i = 0; i < inst.getNumOperands(); i++) {
+    const MCOperand &op = inst.getOperand(i);
+    if (op.isReg()) {
+      W.write<uint8_t>(OPERAND_REG);
+      W.write<int64_t>(op.getReg());
+    } else if (op.isImm()) {
+      W.write<uint8_t>(OPERAND_IMM);
+      W.write<int64_t>(op.getImm());
+    } else {
+      // expressions are never produced by the disassembler
+      W.write<uint8_t>(OPERAND_INVALID);
+      W.write<int64_t>(0);
+    }
+  }
+}
+
+MCInst readInstr(CacheReader &R) {
+  MCInst inst;
+  inst.setOpcode(R.read<uint32_t>());
+  size_t numOperands = R.readCount();
+  for (size_t i = 0; i < numOperands && !R.failed(); i++) {
+    uint8_t kind  = R.read<uint8_t>();
+    int64_t value = R.read<int64_t>();
+    switch (kind) {
+    case OPERAND_REG:
+      inst.addOperand(MCOperand::createReg(value));
+      break;
+    case OPERAND_IMM:
+      inst.addOperand(MCOperand::createImm(value));
+      break;
+    default:
+      inst.addOperand(MCOperand());
+      break;
+    }
+  }
+  return inst;
+}
+
+// hashKey - returns a cache file name for the given key
+std::string hashKey(StringRef prefix, StringRef key) {
+  SHA1 sha1;
+  sha1.update(key);
+  std::string filename = prefix.str();
+  for (unsigned char c : sha1.final()) {
+    filename += fmt::format("{:02x}", c);
+  }
+  return filename + ".bin";
+}
+
+// getFileIdentity - describes the current version of a file without reading
+// it. Returns an empty string if the file cannot be accessed.
+std::string getFileIdentity(const std::string &path) {
+  sys::fs::file_status st;
+  SmallString<128>     realPath;
+
+  if (sys::fs::status(path, st) || sys::fs::real_path(path, realPath)) {
+    return "";
+  }
+
+  return fmt::format("path={};dev={};ino={};size={};mtime={}",
+                     realPath.str().str(),
+                     st.getUniqueID().getDevice(),
+                     st.getUniqueID().getFile(),
+                     st.getSize(),
+                     st.getLastModificationTime().time_since_epoch().count());
+}
+
+// getLibraryScanPath - returns the path of the gadget scan of a library
+// within dir, and sets key to the key identifying the scan
+std::string getLibraryScanPath(const std::string &dir,
+                               const std::string &scanKey,
+                               const std::string &libPath,
+                               std::string       &key) {
+  SmallString<128> absPath(libPath);
+  sys::fs::make_absolute(absPath);
+  key = fmt::format("{};path={}", scanKey, absPath.str().str());
+
+  SmallString<128> scanPath(dir);
+  sys::path::append(scanPath, hashKey("scan-", key));
+  return scanPath.str().str();
+}
+
+// writeAtomically - writes a file through a unique temporary file, which is
+// renamed only once it is complete.
+void writeAtomically(const std::string                 &path,
+                     function_ref<void(CacheWriter &W)> writer) {
+  StringRef dir = sys::path::parent_path(path);
+  if (auto ec = sys::fs::create_directories(dir)) {
+    dbg_fmt("[!] Cannot create cache directory {}: {}\n",
+            dir.str(),
+            ec.message());
+    return;
+  }
+
+  int              fd;
+  SmallString<128> tmpPath;
+  if (auto ec = sys::fs::createUniqueFile(path + "-%%%%%%.tmp", fd, tmpPath)) {
+    dbg_fmt("[!] Cannot write cache file {}: {}\n", path, ec.message());
+    return;
+  }
+
+  {
+    raw_fd_ostream os(fd, /* shouldClose */ true);
+    CacheWriter    W(os);
+
+    writer(W);
+
+    os.close();
+    if (os.has_error()) {
+      dbg_fmt("[!] Cannot write cache file {}\n", tmpPath.str().str());
+      os.clear_error();
+      sys::fs::remove(tmpPath);
+      return;
+    }
+  }
+
+  if (auto ec = sys::fs::rename(tmpPath, path)) {
+    dbg_fmt("[!] Cannot write cache file {}: {}\n", path, ec.message());
+    sys::fs::remove(tmpPath);
+  }
+}
+
+} // namespace
+
+GadgetCache::GadgetCache(const GlobalConfig             &config,
+                         const std::vector<std::string> &librarySHA1s) {
+  scanKey = fmt::format("format={};llvm={};segment={}",
+                        GADGET_CACHE_VERSION,
+                        LLVM_VERSION_STRING,
+                        config.searchSegmentForGadget);
+  key = fmt::format("{};multiver={}", scanKey, config.avoidMultiversionSymbol);
+  for (auto &sha1 : librarySHA1s) {
+    key += ";sha1=" + sha1;
+  }
+  for (auto &lib : config.linkedLibraries) {
+    key += ";linked=" + lib;
+  }
+
+  if (!config.gadgetCacheEnabled) {
+    return;
+  }
+
+  SmallString<128> cacheDir;
+  if (!config.gadgetCacheDir.empty()) {
+    cacheDir = config.gadgetCacheDir;
+  } else if (sys::path::cache_directory(cacheDir)) {
+    sys::path::append(cacheDir, "ropfuscator");
+  } else {
+    // no suitable default location
+    return;
+  }
+  dir = cacheDir.str().str();
+
+  // the key is hashed to obtain a file name of bounded length
+  sys::path::append(cacheDir, hashKey("gadgets-", key));
+  path = cacheDir.str().str();
+}
+
+bool GadgetCache::load(BinaryAutopsy &BA) const {
+  if (!enabled()) {
+    return false;
+  }
+
+  auto buffer = MemoryBuffer::getFile(path);
+  if (!buffer) {
+    return false;
+  }
+
+  CacheReader R((*buffer)->getBuffer());
+
+  if (!R.readMagic(CACHE_MAGIC) || R.read<uint32_t>() != GADGET_CACHE_VERSION ||
+      R.readString() != key) {
+    dbg_fmt("[!] Ignoring stale or invalid gadget cache {}\n", path);
+    return false;
+  }
+
+  // everything is read in temporaries first, so that BA is not modified in
+  // case the cache file turns out to be truncated
+  std::vector<Section> sections, segments;
+  std::vector<Symbol>  symbols;
+  GadgetStore          gadgetStore;
+  XchgPath             edges;
+
+  std::map<GadgetType, std::vector<const Microgadget *>> primitives;
+
+  readSections(R, sections);
+  readSections(R, segments);
+
+  size_t numSymbols = R.readCount();
+  for (size_t i = 0; i < numSymbols && !R.failed(); i++) {
+    std::string label   = R.readString();
+    std::string version = R.readString();
+    uint64_t    address = R.read<uint64_t>();
+    unsigned    library = R.read<uint32_t>();
+    symbols.emplace_back(label, version, address, library);
+  }
+
+  size_t numGadgets = R.readCount();
+  for (size_t i = 0; i < numGadgets && !R.failed(); i++) {
+    unsigned       type    = R.read<uint8_t>();
+    unsigned short reg1    = R.read<uint16_t>();
+    unsigned short reg2    = R.read<uint16_t>();
+    unsigned       library = R.read<uint32_t>();
+
+    GadgetEffects effects;
+    effects.regsWritten   = R.read<uint8_t>();
+    effects.regsRead      = R.read<uint8_t>();
+    effects.stackSlots    = R.read<uint8_t>();
+    effects.clobbersFlags = R.read<uint8_t>();
+    effects.readsFlags    = R.read<uint8_t>();
+    effects.readsMemory   = R.read<uint8_t>();
+    effects.writesMemory  = R.read<uint8_t>();
+
+    std::vector<MCInst> instr;
+    size_t              numInstr = R.readCount();
+    for (size_t j = 0; j < numInstr && !R.failed(); j++) {
+      instr.push_back(readInstr(R));
+    }
+
+    std::vector<uint64_t> addresses;
+    size_t                numAddresses = R.readCount();
+    for (size_t j = 0; j < numAddresses && !R.failed(); j++) {
+      addresses.push_back(R.read<uint64_t>());
+    }
+
+    if (R.failed()) {
+      break;
+    }
+    if (type >= N_GADGET_TYPES || instr.empty() || addresses.empty() ||
+        effects.stackSlots >= instr.size()) {
+      dbg_fmt("[!] Ignoring invalid gadget cache {}\n", path);
+      return false;
+    }
+
+    Microgadget *gadget = gadgetStore.create(instr, addresses, library);
+    gadget->Type        = static_cast<GadgetType>(type);
+    gadget->reg1        = reg1;
+    gadget->reg2        = reg2;
+    gadget->Effects     = effects;
+    primitives[gadget->Type].push_back(gadget);
+  }
+
+  size_t numEdges = R.readCount();
+  for (size_t i = 0; i < numEdges && !R.failed(); i++) {
+    int reg1 = R.read<uint16_t>();
+    int reg2 = R.read<uint16_t>();
+    if (reg1 >= N_REGS || reg2 >= N_REGS) {
+      dbg_fmt("[!] Ignoring invalid gadget cache {}\n", path);
+      return false;
+    }
+    edges.emplace_back(reg1, reg2);
+  }
+
+  if (R.failed()) {
+    dbg_fmt("[!] Ignoring truncated gadget cache {}\n", path);
+    return false;
+  }
+
+  BA.Sections         = std::move(sections);
+  BA.Segments         = std::move(segments);
+  BA.Symbols          = std::move(symbols);
+  BA.gadgetStore      = std::move(gadgetStore);
+  BA.GadgetPrimitives = std::move(primitives);
+  BA.xgraph           = XchgGraph();
+  for (auto &edge : edges) {
+    BA.xgraph.addEdge(edge.first, edge.second);
+  }
+
+  return true;
+}
+
+void GadgetCache::save(const BinaryAutopsy &BA) const {
+  if (!enabled()) {
+    return;
+  }
+
+  writeAtomically(path, [&](CacheWriter &W) {
+    W.writeMagic(CACHE_MAGIC);
+    W.write<uint32_t>(GADGET_CACHE_VERSION);
+    W.writeString(key);
+
+    writeSections(W, BA.Sections);
+    writeSections(W, BA.Segments);
+
+    W.write<uint32_t>(BA.Symbols.size());
+    for (auto &sym : BA.Symbols) {
+      W.writeString(sym.Label);
+      W.writeString(sym.Version);
+      W.write<uint64_t>(sym.Address);
+      W.write<uint32_t>(sym.Library);
+    }
+
+    size_t numGadgets = 0;
+    for (auto &kv : BA.GadgetPrimitives) {
+      numGadgets += kv.second.size();
+    }
+
+    W.write<uint32_t>(numGadgets);
+    for (auto &kv : BA.GadgetPrimitives) {
+      for (auto &gadget : kv.second) {
+        W.write<uint8_t>(static_cast<uint8_t>(gadget->Type));
+        W.write<uint16_t>(gadget->reg1);
+        W.write<uint16_t>(gadget->reg2);
+        W.write<uint32_t>(gadget->Library);
+        W.write<uint8_t>(gadget->Effects.regsWritten);
+        W.write<uint8_t>(gadget->Effects.regsRead);
+        W.write<uint8_t>(gadget->Effects.stackSlots);
+        W.write<uint8_t>(gadget->Effects.clobbersFlags);
+        W.write<uint8_t>(gadget->Effects.readsFlags);
+        W.write<uint8_t>(gadget->Effects.readsMemory);
+        W.write<uint8_t>(gadget->Effects.writesMemory);
+        W.write<uint32_t>(gadget->getInstr().size());
+        for (auto &inst : gadget->getInstr()) {
+          writeInstr(W, inst);
+        }
+        W.write<uint32_t>(gadget->getAddresses().size());
+        for (uint64_t addr : gadget->getAddresses()) {
+          W.write<uint64_t>(addr);
+        }
+      }
+    }
+
+    const XchgPath &edges = BA.xgraph.getEdges();
+    W.write<uint32_t>(edges.size());
+    for (auto &edge : edges) {
+      W.write<uint16_t>(edge.first);
+      W.write<uint16_t>(edge.second);
+    }
+  });
+}
+
+bool GadgetCache::loadSymbolIndex(const std::string     &libPath,
+                                  std::vector<uint64_t> &index) const {
+  if (!enabled()) {
+    return false;
+  }
+
+  std::string identity = getFileIdentity(libPath);
+  if (identity.empty()) {
+    return false;
+  }
+
+  SmallString<128> indexPath(dir);
+  sys::path::append(indexPath, hashKey("symbols-", identity));
+
+  auto buffer = MemoryBuffer::getFile(indexPath);
+  if (!buffer) {
+    return false;
+  }
+
+  CacheReader R((*buffer)->getBuffer());
+
+  if (!R.readMagic(SYMBOL_INDEX_MAGIC) ||
+      R.read<uint32_t>() != GADGET_CACHE_VERSION ||
+      R.readString() != identity) {
+    return false;
+  }
+
+  std::vector<uint64_t> hashes;
+  size_t                count = R.readCount();
+  hashes.reserve(count);
+  for (size_t i = 0; i < count && !R.failed(); i++) {
+    hashes.push_back(R.read<uint64_t>());
+  }
+
+  if (R.failed() || !std::is_sorted(hashes.begin(), hashes.end())) {
+    return false;
+  }
+
+  index = std::move(hashes);
+  return true;
+}
+
+void GadgetCache::saveSymbolIndex(const std::string           &libPath,
+                                  const std::vector<uint64_t> &index) const {
+  if (!enabled()) {
+    return;
+  }
+
+  std::string identity = getFileIdentity(libPath);
+  if (identity.empty()) {
+    return;
+  }
+
+  SmallString<128> indexPath(dir);
+  sys::path::append(indexPath, hashKey("symbols-", identity));
+
+  writeAtomically(indexPath.str().str(), [&](CacheWriter &W) {
+    W.writeMagic(SYMBOL_INDEX_MAGIC);
+    W.write<uint32_t>(GADGET_CACHE_VERSION);
+    W.writeString(identity);
+    W.write<uint32_t>(index.size());
+    for (uint64_t hash : index) {
+      W.write<uint64_t>(hash);
+    }
+  });
+}
+
+bool GadgetCache::loadLibraryScan(const std::string &libPath,
+                                  LibraryScan       &scan) const {
+  if (!enabled()) {
+    return false;
+  }
+
+  std::string libKey;
+  std::string scanPath = getLibraryScanPath(dir, scanKey, libPath, libKey);
+
+  auto buffer = MemoryBuffer::getFile(scanPath);
+  if (!buffer) {
+    return false;
+  }
+
+  CacheReader R((*buffer)->getBuffer());
+
+  if (!R.readMagic(LIBRARY_SCAN_MAGIC) ||
+      R.read<uint32_t>() != GADGET_CACHE_VERSION ||
+      R.readString() != libKey) {
+    return false;
+  }
+
+  LibraryScan result;
+
+  size_t numRegions = R.readCount();
+  for (size_t i = 0; i < numRegions && !R.failed(); i++) {
+    result.regions.emplace_back();
+    size_t numBlocks = R.readCount();
+    for (size_t j = 0; j < numBlocks && !R.failed(); j++) {
+      CodeBlock block;
+      block.begin = R.read<uint64_t>();
+      block.end   = R.read<uint64_t>();
+      block.hash  = R.read<uint64_t>();
+      if (block.end <= block.begin) {
+        return false;
+      }
+      result.regions.back().push_back(block);
+    }
+  }
+
+  size_t numGadgets = R.readCount();
+  for (size_t i = 0; i < numGadgets && !R.failed(); i++) {
+    std::vector<MCInst> instr;
+    size_t              numInstr = R.readCount();
+    for (size_t j = 0; j < numInstr && !R.failed(); j++) {
+      instr.push_back(readInstr(R));
+    }
+
+    ScannedGadget gadget;
+    gadget.Instr = std::move(instr);
+
+    size_t numAddresses = R.readCount();
+    for (size_t j = 0; j < numAddresses && !R.failed(); j++) {
+      gadget.addresses.push_back(R.read<uint64_t>());
+      gadget.sites.push_back(R.read<uint64_t>());
+    }
+
+    if (R.failed()) {
+      break;
+    }
+    if (gadget.Instr.empty() || gadget.addresses.empty()) {
+      return false;
+    }
+    // the gadget ends at its site, within the scanned window
+    for (size_t j = 0; j < gadget.addresses.size(); j++) {
+      if (gadget.sites[j] < gadget.addresses[j] ||
+          gadget.sites[j] - gadget.addresses[j] >= MAXDEPTH_MULTI) {
+        return false;
+      }
+    }
+
+    result.gadgets.push_back(std::move(gadget));
+  }
+
+  if (R.failed()) {
+    return false;
+  }
+
+  scan = std::move(result);
+  return true;
+}
+
+void GadgetCache::saveLibraryScan(const std::string &libPath,
+                                  const LibraryScan &scan) const {
+  if (!enabled()) {
+    return;
+  }
+
+  std::string libKey;
+  std::string scanPath = getLibraryScanPath(dir, scanKey, libPath, libKey);
+
+  writeAtomically(scanPath, [&](CacheWriter &W) {
+    W.writeMagic(LIBRARY_SCAN_MAGIC);
+    W.write<uint32_t>(GADGET_CACHE_VERSION);
+    W.writeString(libKey);
+
+    W.write<uint32_t>(scan.regions.size());
+    for (auto &blocks : scan.regions) {
+      W.write<uint32_t>(blocks.size());
+      for (auto &block : blocks) {
+        W.write<uint64_t>(block.begin);
+        W.write<uint64_t>(block.end);
+        W.write<uint64_t>(block.hash);
+      }
+    }
+
+    W.write<uint32_t>(scan.gadgets.size());
+    for (auto &gadget : scan.gadgets) {
+      W.write<uint32_t>(gadget.Instr.size());
+      for (auto &inst : gadget.Instr) {
+        writeInstr(W, inst);
+      }
+      W.write<uint32_t>(gadget.addresses.size());
+      for (size_t j = 0; j < gadget.addresses.size(); j++) {
+        W.write<uint64_t>(gadget.addresses[j]);
+        W.write<uint64_t>(gadget.sites[j]);
+      }
+    }
+  });
+}
+
+} // namespace ropf
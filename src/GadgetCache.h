@@ -0,0 +1,95 @@
+// ==============================================================================
+//   GADGET CACHE
+//   part of the ROPfuscator project
+// ==============================================================================
+// This module keeps the results of BinaryAutopsy on disk, so that the gadget
+// library is not analysed from scratch on every compiler invocation.
+//
+// Each cache file is identified by a key derived from the SHA1 hashes of the
+// gadget libraries, the cache format version, the LLVM version (opcode and
+// register numbers are not stable across LLVM releases) and every
+// configuration option that affects the analysis. The file stores sections,
+// segments, dynamic symbols (before the module-specific filtering), the
+// classified microgadgets and the edges of the exchange graph.
+//
+// The same directory also holds the symbol name indexes of the linked
+// libraries (see BinaryAutopsy::analyseUsedSymbols()) and the raw gadget scan
+// of each gadget library, identified by its path rather than by its hash: when
+// the library is updated, only the blocks of code that changed need to be
+// scanned again (see BinaryAutopsy::dumpGadgets()).
+//
+// Cache files are written to a temporary file and then renamed, so that
+// concurrent compilations never observe a partially written cache.
+
+#ifndef GADGETCACHE_H
+#define GADGETCACHE_H
+
+#include "ROPfuscatorConfig.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace ropf {
+
+// Cache file format version. It must be bumped whenever the layout of the
+// cache or the output of the binary analysis changes.
+#define GADGET_CACHE_VERSION 6
+
+// forward declaration
+class BinaryAutopsy;
+struct LibraryScan;
+
+class GadgetCache {
+  // key - textual description of everything the cached analysis depends on
+  std::string key;
+
+  // scanKey - the part of key the raw gadget scans depend on
+  std::string scanKey;
+
+  // dir - cache directory (empty if the cache is disabled)
+  std::string dir;
+
+  // path - cache file path (empty if the cache is disabled)
+  std::string path;
+
+public:
+  // librarySHA1s - hashes of the gadget libraries, in the order used by
+  // BinaryAutopsy
+  GadgetCache(const GlobalConfig             &config,
+              const std::vector<std::string> &librarySHA1s);
+
+  bool enabled() const { return !path.empty(); }
+
+  // load - fills the analysis results of BA from the cache file. Returns false
+  // if the cache file does not exist or is invalid; in that case BA is left
+  // untouched.
+  bool load(BinaryAutopsy &BA) const;
+
+  // save - writes the analysis results of BA to the cache file.
+  void save(const BinaryAutopsy &BA) const;
+
+  std::string getPath() const { return path; }
+
+  // loadSymbolIndex - reads the symbol name index of a linked library. The
+  // index is identified by the path, size and modification time of the
+  // library, so that it can be validated without reading the library itself.
+  bool loadSymbolIndex(const std::string     &libPath,
+                       std::vector<uint64_t> &index) const;
+
+  // saveSymbolIndex - writes the symbol name index of a linked library.
+  void saveSymbolIndex(const std::string           &libPath,
+                       const std::vector<uint64_t> &index) const;
+
+  // loadLibraryScan - reads the last gadget scan of the library at libPath,
+  // whatever its version. Returns false if there is none or it is invalid.
+  bool loadLibraryScan(const std::string &libPath, LibraryScan &scan) const;
+
+  // saveLibraryScan - writes the gadget scan of the library at libPath,
+  // replacing the one of its previous version.
+  void saveLibraryScan(const std::string &libPath,
+                       const LibraryScan &scan) const;
+};
+
+} // namespace ropf
+
+#endif
@@ -0,0 +1,505 @@
+// ==============================================================================
+//   GADGET SCANNER
+//   part of the ROPfuscator project
+// ==============================================================================
+
+#include "GadgetScanner.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/xxhash.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define ROPF_SCANNER_X86
+#endif
+
+namespace ropf {
+
+namespace {
+
+const uint8_t RET_OPCODE    = 0xc3;
+const uint8_t JMP_OPCODE    = 0xff;
+// ModRM byte of "jmp reg": mod = 11, reg = 100 (/4), any r/m
+const uint8_t JMP_MODRM     = 0xe0;
+const uint8_t JMP_MODRM_MSK = 0xf8;
+
+// size limits of the blocks made by splitCodeBlocks(); a boundary is placed
+// where the low BLOCK_MASK bits of the rolling hash are zero, i.e. every
+// 4 KiB on average
+const uint64_t MIN_BLOCK_SIZE = 1024;
+const uint64_t MAX_BLOCK_SIZE = 16 * 1024;
+const uint64_t BLOCK_MASK     = 0xfff;
+
+using ScanFunction = void (*)(const uint8_t *,
+                              uint64_t,
+                              uint64_t,
+                              uint64_t,
+                              std::vector<uint64_t> &,
+                              std::vector<uint64_t> &);
+
+// scanScalar - checks the positions in [pos, end) one byte at a time
+void scanScalar(const uint8_t         *buf,
+                uint64_t               pos,
+                uint64_t               end,
+                uint64_t               limit,
+                std::vector<uint64_t> &rets,
+                std::vector<uint64_t> &jmps) {
+  for (; pos < end; pos++) {
+    if (buf[pos] == RET_OPCODE) {
+      rets.push_back(pos);
+    } else if (buf[pos] == JMP_OPCODE && pos + 1 < limit &&
+               (buf[pos + 1] & JMP_MODRM_MSK) == JMP_MODRM) {
+      jmps.push_back(pos);
+    }
+  }
+}
+
+// pushBits - appends base + i for each bit i set in mask, in ascending order
+inline void pushBits(uint64_t base, uint32_t mask, std::vector<uint64_t> &out) {
+  while (mask) {
+    out.push_back(base + __builtin_ctz(mask));
+    mask &= mask - 1;
+  }
+}
+
+#ifdef ROPF_SCANNER_X86
+
+// The vector loops compare a block of bytes and the same block shifted by one
+// byte (the ModRM of a JMP), so each block needs one byte of lookahead.
+
+__attribute__((target("sse2"))) void
+scanSSE2(const uint8_t         *buf,
+         uint64_t               pos,
+         uint64_t               end,
+         uint64_t               limit,
+         std::vector<uint64_t> &rets,
+         std::vector<uint64_t> &jmps) {
+  const __m128i ret      = _mm_set1_epi8((char)RET_OPCODE);
+  const __m128i jmp      = _mm_set1_epi8((char)JMP_OPCODE);
+  const __m128i modrm    = _mm_set1_epi8((char)JMP_MODRM);
+  const __m128i modrmMsk = _mm_set1_epi8((char)JMP_MODRM_MSK);
+
+  for (; pos + 16 <= end && pos + 17 <= limit; pos += 16) {
+    __m128i cur  = _mm_loadu_si128((const __m128i *)(buf + pos));
+    __m128i next = _mm_loadu_si128((const __m128i *)(buf + pos + 1));
+
+    __m128i isRet = _mm_cmpeq_epi8(cur, ret);
+    __m128i isJmp = _mm_and_si128(
+        _mm_cmpeq_epi8(cur, jmp),
+        _mm_cmpeq_epi8(_mm_and_si128(next, modrmMsk), modrm));
+
+    uint32_t retMask = _mm_movemask_epi8(isRet);
+    uint32_t jmpMask = _mm_movemask_epi8(isJmp);
+
+    if (retMask | jmpMask) {
+      pushBits(pos, retMask, rets);
+      pushBits(pos, jmpMask, jmps);
+    }
+  }
+
+  scanScalar(buf, pos, end, limit, rets, jmps);
+}
+
+__attribute__((target("avx2"))) void
+scanAVX2(const uint8_t         *buf,
+         uint64_t               pos,
+         uint64_t               end,
+         uint64_t               limit,
+         std::vector<uint64_t> &rets,
+         std::vector<uint64_t> &jmps) {
+  const __m256i ret      = _mm256_set1_epi8((char)RET_OPCODE);
+  const __m256i jmp      = _mm256_set1_epi8((char)JMP_OPCODE);
+  const __m256i modrm    = _mm256_set1_epi8((char)JMP_MODRM);
+  const __m256i modrmMsk = _mm256_set1_epi8((char)JMP_MODRM_MSK);
+
+  for (; pos + 32 <= end && pos + 33 <= limit; pos += 32) {
+    __m256i cur  = _mm256_loadu_si256((const __m256i *)(buf + pos));
+    __m256i next = _mm256_loadu_si256((const __m256i *)(buf + pos + 1));
+
+    __m256i isRet = _mm256_cmpeq_epi8(cur, ret);
+    __m256i isJmp = _mm256_and_si256(
+        _mm256_cmpeq_epi8(cur, jmp),
+        _mm256_cmpeq_epi8(_mm256_and_si256(next, modrmMsk), modrm));
+
+    uint32_t retMask = _mm256_movemask_epi8(isRet);
+    uint32_t jmpMask = _mm256_movemask_epi8(isJmp);
+
+    if (retMask | jmpMask) {
+      pushBits(pos, retMask, rets);
+      pushBits(pos, jmpMask, jmps);
+    }
+  }
+
+  scanSSE2(buf, pos, end, limit, rets, jmps);
+}
+
+#endif
+
+// getScanFunction - returns the given implementation, or nullptr if the host
+// does not support it
+ScanFunction getScanFunction(ScanImpl impl) {
+#ifdef ROPF_SCANNER_X86
+  __builtin_cpu_init();
+  if (impl == ScanImpl::AVX2) {
+    return __builtin_cpu_supports("avx2") ? scanAVX2 : nullptr;
+  }
+  if (impl == ScanImpl::SSE2) {
+    return __builtin_cpu_supports("sse2") ? scanSSE2 : nullptr;
+  }
+#endif
+  return impl == ScanImpl::SCALAR ? scanScalar : nullptr;
+}
+
+// selectScanFunction - returns the fastest implementation supported by the
+// host
+ScanFunction selectScanFunction() {
+  for (ScanImpl impl : {ScanImpl::AVX2, ScanImpl::SSE2}) {
+    if (ScanFunction scan = getScanFunction(impl)) {
+      return scan;
+    }
+  }
+  return scanScalar;
+}
+
+// Length decoding of x86-32 instructions. Each entry of the opcode tables
+// tells whether the opcode is followed by a ModRM byte and which kind of
+// immediate it has. Only the common opcodes are handled: the others are left
+// to the disassembler.
+enum : uint8_t {
+  LEN_NONE    = 0x0, // no immediate
+  LEN_IB      = 0x1, // 8-bit immediate
+  LEN_IW      = 0x2, // 16-bit immediate
+  LEN_IZ      = 0x3, // 16/32-bit immediate, depending on the operand size
+  LEN_MOFFS   = 0x4, // 16/32-bit offset, depending on the address size
+  LEN_FAR     = 0x5, // 16/32-bit offset followed by a 16-bit segment
+  LEN_ENTER   = 0x6, // 16-bit immediate followed by an 8-bit one
+  LEN_GRP3    = 0x7, // immediate only for TEST (ModRM reg 0 and 1)
+  LEN_PREFIX  = 0x8, // legacy prefix
+  LEN_ESCAPE  = 0x9, // two-byte opcode
+  LEN_UNKNOWN = 0xf, // not handled
+  LEN_IMM     = 0x0f,
+  LEN_MODRM   = 0x10,
+};
+
+#define N  LEN_NONE
+#define B  LEN_IB
+#define W  LEN_IW
+#define Z  LEN_IZ
+#define A  LEN_MOFFS
+#define F  LEN_FAR
+#define E  LEN_ENTER
+#define P  LEN_PREFIX
+#define X  LEN_ESCAPE
+#define U  LEN_UNKNOWN
+#define M  LEN_MODRM
+#define MB (LEN_MODRM | LEN_IB)
+#define MZ (LEN_MODRM | LEN_IZ)
+#define MG (LEN_MODRM | LEN_GRP3)
+
+// clang-format off
+const uint8_t ONE_BYTE_OPCODES[256] = {
+  // 0   1   2   3   4   5   6   7   8   9   a   b   c   d   e   f
+     M,  M,  M,  M,  B,  Z,  N,  N,  M,  M,  M,  M,  B,  Z,  N,  X, // 0
+     M,  M,  M,  M,  B,  Z,  N,  N,  M,  M,  M,  M,  B,  Z,  N,  N, // 1
+     M,  M,  M,  M,  B,  Z,  P,  N,  M,  M,  M,  M,  B,  Z,  P,  N, // 2
+     M,  M,  M,  M,  B,  Z,  P,  N,  M,  M,  M,  M,  B,  Z,  P,  N, // 3
+     N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N, // 4
+     N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N, // 5
+     N,  N,  U,  M,  P,  P,  P,  P,  Z, MZ,  B, MB,  N,  N,  N,  N, // 6
+     B,  B,  B,  B,  B,  B,  B,  B,  B,  B,  B,  B,  B,  B,  B,  B, // 7
+    MB, MZ,  U, MB,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  U, // 8
+     N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  F,  N,  N,  N,  N,  N, // 9
+     A,  A,  A,  A,  N,  N,  N,  N,  B,  Z,  N,  N,  N,  N,  N,  N, // a
+     B,  B,  B,  B,  B,  B,  B,  B,  Z,  Z,  Z,  Z,  Z,  Z,  Z,  Z, // b
+    MB, MB,  W,  N,  U,  U, MB, MZ,  E,  N,  W,  N,  N,  B,  N,  N, // c
+     M,  M,  M,  M,  B,  B,  U,  N,  M,  M,  M,  M,  M,  M,  M,  M, // d
+     B,  B,  B,  B,  B,  B,  B,  B,  Z,  Z,  F,  B,  N,  N,  N,  N, // e
+     P,  U,  P,  P,  N,  N, MG, MG,  N,  N,  N,  N,  N,  N,  M,  M, // f
+};
+// clang-format on
+
+// getTwoByteOpcode - returns the table entry of the two-byte opcode 0f op
+uint8_t getTwoByteOpcode(uint8_t op) {
+  if ((op & 0xf0) == 0x40 || (op & 0xf0) == 0x90) {
+    // CMOVcc, SETcc
+    return M;
+  }
+  if ((op & 0xf0) == 0x80) {
+    // Jcc rel16/32
+    return Z;
+  }
+  if ((op & 0xf8) == 0xc8) {
+    // BSWAP
+    return N;
+  }
+
+  switch (op) {
+  case 0x0b: // UD2
+  case 0x31: // RDTSC
+  case 0xa0: // PUSH FS
+  case 0xa1: // POP FS
+  case 0xa2: // CPUID
+  case 0xa8: // PUSH GS
+  case 0xa9: // POP GS
+    return N;
+  case 0x1f: // NOP r/m
+  case 0xa3: // BT
+  case 0xa5: // SHLD CL
+  case 0xab: // BTS
+  case 0xad: // SHRD CL
+  case 0xaf: // IMUL
+  case 0xb0: // CMPXCHG
+  case 0xb1:
+  case 0xb3: // BTR
+  case 0xb6: // MOVZX
+  case 0xb7:
+  case 0xbb: // BTC
+  case 0xbc: // BSF
+  case 0xbd: // BSR
+  case 0xbe: // MOVSX
+  case 0xbf:
+  case 0xc0: // XADD
+  case 0xc1:
+    return M;
+  case 0xa4: // SHLD imm8
+  case 0xac: // SHRD imm8
+  case 0xba: // BT* imm8
+    return MB;
+  default:
+    return U;
+  }
+}
+
+#undef N
+#undef B
+#undef W
+#undef Z
+#undef A
+#undef F
+#undef E
+#undef P
+#undef X
+#undef U
+#undef M
+#undef MB
+#undef MZ
+#undef MG
+
+bool isPrefix(uint8_t byte) { return ONE_BYTE_OPCODES[byte] == LEN_PREFIX; }
+
+// isRet - tells whether the bytes in [pos, end) of buf may be decoded as a
+// RET, possibly with prefixes
+bool isRet(const uint8_t *buf, uint64_t pos, uint64_t end) {
+  while (pos < end && isPrefix(buf[pos])) {
+    pos++;
+  }
+  return pos < end && buf[pos] == RET_OPCODE;
+}
+
+} // namespace
+
+uint64_t getInstrLength(const uint8_t *buf, uint64_t pos, uint64_t end) {
+  uint64_t start      = pos;
+  bool     opSize16   = false;
+  bool     addrSize16 = false;
+  bool     repeat     = false;
+  uint8_t  entry;
+
+  for (;; pos++) {
+    if (pos >= end) {
+      return INSTR_TOO_LONG;
+    }
+    entry = ONE_BYTE_OPCODES[buf[pos]];
+    if (entry != LEN_PREFIX) {
+      break;
+    }
+    opSize16   = opSize16 || buf[pos] == 0x66;
+    addrSize16 = addrSize16 || buf[pos] == 0x67;
+    repeat     = repeat || buf[pos] == 0xf2 || buf[pos] == 0xf3;
+  }
+
+  uint8_t opcode = buf[pos++];
+  if (entry == LEN_ESCAPE) {
+    if (pos >= end) {
+      return INSTR_TOO_LONG;
+    }
+    opcode = buf[pos++];
+    entry  = getTwoByteOpcode(opcode);
+
+    // the disassembler may take 0x66 as part of the opcode, rather than as
+    // operand size, when a REP prefix is present too
+    if (opSize16 && repeat) {
+      return 0;
+    }
+  }
+  if ((entry & LEN_IMM) == LEN_UNKNOWN) {
+    return 0;
+  }
+
+  uint8_t reg = 0;
+  if (entry & LEN_MODRM) {
+    if (pos >= end) {
+      return INSTR_TOO_LONG;
+    }
+    uint8_t modrm = buf[pos++];
+    uint8_t mod   = modrm >> 6;
+    uint8_t rm    = modrm & 7;
+    reg           = (modrm >> 3) & 7;
+
+    if (mod != 3 && addrSize16) {
+      pos += mod == 1 ? 1 : (mod == 2 || rm == 6) ? 2 : 0;
+    } else if (mod != 3) {
+      if (rm == 4) {
+        // SIB byte, with a 32-bit displacement if there is no base
+        if (pos >= end) {
+          return INSTR_TOO_LONG;
+        }
+        if (mod == 0 && (buf[pos] & 7) == 5) {
+          pos += 4;
+        }
+        pos++;
+      }
+      pos += mod == 1 ? 1 : (mod == 2 || rm == 5) ? 4 : 0;
+    }
+  }
+
+  switch (entry & LEN_IMM) {
+  case LEN_IB:
+    pos += 1;
+    break;
+  case LEN_IW:
+    pos += 2;
+    break;
+  case LEN_IZ:
+    pos += opSize16 ? 2 : 4;
+    break;
+  case LEN_MOFFS:
+    pos += addrSize16 ? 2 : 4;
+    break;
+  case LEN_FAR:
+    pos += opSize16 ? 4 : 6;
+    break;
+  case LEN_ENTER:
+    pos += 3;
+    break;
+  case LEN_GRP3:
+    if (reg < 2) {
+      pos += !(opcode & 1) ? 1 : opSize16 ? 2 : 4;
+    }
+    break;
+  }
+
+  return pos <= end ? pos - start : INSTR_TOO_LONG;
+}
+
+void findGadgetSites(const uint8_t         *buf,
+                     uint64_t               begin,
+                     uint64_t               end,
+                     uint64_t               limit,
+                     std::vector<uint64_t> &rets,
+                     std::vector<uint64_t> &jmps) {
+  static const ScanFunction scan = selectScanFunction();
+
+  scan(buf, begin, end, limit, rets, jmps);
+}
+
+bool isScanImplSupported(ScanImpl impl) {
+  return getScanFunction(impl) != nullptr;
+}
+
+void findGadgetSites(ScanImpl               impl,
+                     const uint8_t         *buf,
+                     uint64_t               begin,
+                     uint64_t               end,
+                     uint64_t               limit,
+                     std::vector<uint64_t> &rets,
+                     std::vector<uint64_t> &jmps) {
+  getScanFunction(impl)(buf, begin, end, limit, rets, jmps);
+}
+
+namespace {
+
+// GearTable - pseudo-random values of each byte, used by the rolling hash of
+// splitCodeBlocks(). They are generated with a fixed seed, since the
+// boundaries must be the same across runs.
+struct GearTable {
+  uint64_t values[256];
+
+  GearTable() {
+    // splitmix64
+    uint64_t state = 0x9e3779b97f4a7c15;
+    for (auto &value : values) {
+      uint64_t z = (state += 0x9e3779b97f4a7c15);
+      z          = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+      z          = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+      value      = z ^ (z >> 31);
+    }
+  }
+};
+
+} // namespace
+
+bool mayBeRetGadget(const uint8_t *buf, uint64_t begin, uint64_t end) {
+  // the disassembler decodes a prefix alone if the instruction after it is
+  // not valid with it
+  if (isPrefix(buf[begin]) && isRet(buf, begin + 1, end)) {
+    return true;
+  }
+
+  uint64_t length = getInstrLength(buf, begin, end);
+  if (length == 0) {
+    // not handled: let the disassembler decide
+    return true;
+  }
+  if (length == INSTR_TOO_LONG || begin + length >= end) {
+    // the first instruction leaves no room for the RET
+    return false;
+  }
+
+  // the second instruction must be a RET
+  return isRet(buf, begin + length, end);
+}
+
+bool mayBeRetSequence(const uint8_t *buf, uint64_t begin, uint64_t end) {
+  if (begin >= end - 1) {
+    // the last instruction must end right before the RET
+    return begin == end - 1;
+  }
+
+  uint64_t length = getInstrLength(buf, begin, end);
+  if (length == 0) {
+    // not handled: let the disassembler decide
+    return true;
+  }
+  if (length != INSTR_TOO_LONG && mayBeRetSequence(buf, begin + length, end)) {
+    return true;
+  }
+
+  // the instruction may also be decoded as a prefix alone, followed by the
+  // rest of it
+  return isPrefix(buf[begin]) && mayBeRetSequence(buf, begin + 1, end);
+}
+
+void splitCodeBlocks(const uint8_t          *buf,
+                     uint64_t                begin,
+                     uint64_t                end,
+                     std::vector<CodeBlock> &blocks) {
+  static const GearTable gear;
+
+  uint64_t start = begin;
+  uint64_t hash  = 0;
+
+  for (uint64_t pos = begin; pos < end; pos++) {
+    // each byte is shifted out of the hash after 64 steps
+    hash = (hash << 1) + gear.values[buf[pos]];
+
+    uint64_t size = pos + 1 - start;
+    if ((size >= MIN_BLOCK_SIZE && (hash & BLOCK_MASK) == 0) ||
+        size >= MAX_BLOCK_SIZE || pos + 1 == end) {
+      llvm::ArrayRef<uint8_t> bytes(buf + start, size);
+      blocks.push_back({start, pos + 1, llvm::xxHash64(bytes)});
+      start = pos + 1;
+    }
+  }
+}
+
+} // namespace ropf
@@ -0,0 +1,96 @@
+// ==============================================================================
+//   GADGET SCANNER
+//   part of the ROPfuscator project
+// ==============================================================================
+// This module finds the positions of a code region that may end a gadget
+// (RET, 0xc3) or start an indirect jump gadget (JMP reg, 0xff 0xe0-0xe7).
+// Only these candidates are then decoded by BinaryAutopsy::dumpGadgets().
+// A lightweight x86-32 length decoder also rejects most of the windows before
+// a RET that cannot form a gadget, without invoking the disassembler.
+//
+// Both kinds of candidates are found in a single pass. On x86 hosts the pass is
+// vectorised with SSE2 or AVX2, selected at run time; other hosts use a scalar
+// loop with the same results.
+//
+// Code regions can also be split in blocks delimited by their content, which
+// let an updated library be analysed again only where its code has changed
+// (see BinaryAutopsy::dumpGadgets()).
+
+#ifndef GADGETSCANNER_H
+#define GADGETSCANNER_H
+
+#include <cstdint>
+#include <vector>
+
+namespace ropf {
+
+// findGadgetSites - appends to rets and jmps, in ascending order, the
+// positions in [begin, end) of buf holding a RET and a JMP reg respectively.
+// Bytes of buf up to limit (excluded) may be read, so a JMP reg is found at
+// position p only if p + 1 < limit.
+void findGadgetSites(const uint8_t         *buf,
+                     uint64_t               begin,
+                     uint64_t               end,
+                     uint64_t               limit,
+                     std::vector<uint64_t> &rets,
+                     std::vector<uint64_t> &jmps);
+
+// ScanImpl - implementations of findGadgetSites(). The fastest one supported
+// by the host is used; they are exposed so that they can be tested and
+// measured against each other.
+enum class ScanImpl { SCALAR, SSE2, AVX2 };
+
+// isScanImplSupported - tells whether the host can run the given
+// implementation
+bool isScanImplSupported(ScanImpl impl);
+
+// findGadgetSites - same as above, with the given implementation, which must
+// be supported by the host
+void findGadgetSites(ScanImpl               impl,
+                     const uint8_t         *buf,
+                     uint64_t               begin,
+                     uint64_t               end,
+                     uint64_t               limit,
+                     std::vector<uint64_t> &rets,
+                     std::vector<uint64_t> &jmps);
+
+// INSTR_TOO_LONG - length returned by getInstrLength() if the instruction does
+// not fit in the available bytes
+const uint64_t INSTR_TOO_LONG = UINT64_MAX;
+
+// getInstrLength - returns the length of the x86-32 instruction at pos of buf,
+// reading bytes up to end (excluded), using tables of the one-byte and common
+// two-byte opcodes. Returns 0 if the opcode is not handled, and INSTR_TOO_LONG
+// if the instruction does not end before end.
+uint64_t getInstrLength(const uint8_t *buf, uint64_t pos, uint64_t end);
+
+// mayBeRetGadget - checks, using a table-driven length decoder, whether the
+// bytes in [begin, end) of buf may hold an instruction followed by a RET.
+// Returns false only if the disassembler would certainly not find such a pair
+// in the same bytes, so that the window can be skipped without decoding it.
+bool mayBeRetGadget(const uint8_t *buf, uint64_t begin, uint64_t end);
+
+// mayBeRetSequence - checks, like mayBeRetGadget(), whether the bytes in
+// [begin, end) of buf may hold a sequence of instructions followed by the RET
+// at end - 1. The sequences in which the disassembler would see a standalone
+// prefix (e.g. LOCK right before the RET) are accepted as well.
+bool mayBeRetSequence(const uint8_t *buf, uint64_t begin, uint64_t end);
+
+// CodeBlock - a block of a code region, identified by the hash of its bytes
+struct CodeBlock {
+  uint64_t begin, end;
+  uint64_t hash;
+};
+
+// splitCodeBlocks - splits [begin, end) of buf into blocks of about 4 KiB and
+// appends them to blocks, in order. Boundaries are chosen with a rolling hash
+// of the preceding bytes rather than at fixed offsets, so that they move
+// together with the code when bytes are inserted or removed before them.
+void splitCodeBlocks(const uint8_t          *buf,
+                     uint64_t                begin,
+                     uint64_t                end,
+                     std::vector<CodeBlock> &blocks);
+
+} // namespace ropf
+
+#endif
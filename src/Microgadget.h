@@ -1,12 +1,18 @@
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/MC/MCInst.h"
+#include "llvm/Support/Allocator.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <vector>
 
 #ifndef MICROGADGET_H
 #define MICROGADGET_H
 
 namespace ropf {
 
-enum class GadgetType {
+enum class GadgetType : uint8_t {
   UNDEFINED,
   MOV,
   XCHG,
@@ -25,11 +31,77 @@ enum class GadgetType {
   OR_1,
   XOR,
   XOR_1,
+  INC,
+  DEC,
+  NEG,
+  NOT,
   CMOVE,
   CMOVB,
+  MULTI_MOV,
 };
 
-// Microgadget - represents a single x86 instruction that precedes a RET.
+// number of gadget types; MULTI_MOV must be the last one
+const size_t N_GADGET_TYPES = static_cast<size_t>(GadgetType::MULTI_MOV) + 1;
+
+// getGadgetTypeName - returns a printable name of the given gadget type
+inline const char *getGadgetTypeName(GadgetType type) {
+  switch (type) {
+  case GadgetType::UNDEFINED: return "UNDEFINED";
+  case GadgetType::MOV: return "MOV";
+  case GadgetType::XCHG: return "XCHG";
+  case GadgetType::COPY: return "COPY";
+  case GadgetType::LOAD: return "LOAD";
+  case GadgetType::LOAD_1: return "LOAD_1";
+  case GadgetType::STORE: return "STORE";
+  case GadgetType::JMP: return "JMP";
+  case GadgetType::ADD: return "ADD";
+  case GadgetType::ADD_1: return "ADD_1";
+  case GadgetType::SUB: return "SUB";
+  case GadgetType::SUB_1: return "SUB_1";
+  case GadgetType::AND: return "AND";
+  case GadgetType::AND_1: return "AND_1";
+  case GadgetType::OR: return "OR";
+  case GadgetType::OR_1: return "OR_1";
+  case GadgetType::XOR: return "XOR";
+  case GadgetType::XOR_1: return "XOR_1";
+  case GadgetType::INC: return "INC";
+  case GadgetType::DEC: return "DEC";
+  case GadgetType::NEG: return "NEG";
+  case GadgetType::NOT: return "NOT";
+  case GadgetType::CMOVE: return "CMOVE";
+  case GadgetType::CMOVB: return "CMOVB";
+  case GadgetType::MULTI_MOV: return "MULTI_MOV";
+  }
+  return "UNKNOWN";
+}
+
+// GadgetEffects - summary of the effects of a gadget, besides transferring
+// control to the next element of the chain.
+struct GadgetEffects {
+  // regsWritten - 32-bit general purpose registers written by the gadget, as
+  // a mask indexed by their encoding (EAX = 0, ECX = 1, ..., EDI = 7)
+  uint8_t regsWritten;
+
+  // regsRead - registers read by the gadget, with the same encoding
+  uint8_t regsRead;
+
+  // stackSlots - number of 32-bit chain elements consumed by the gadget
+  // before the RET (i.e., the number of POP instructions)
+  uint8_t stackSlots;
+
+  bool clobbersFlags;
+  bool readsFlags;
+  bool readsMemory;
+  bool writesMemory;
+
+  GadgetEffects()
+      : regsWritten(0), regsRead(0), stackSlots(0), clobbersFlags(false),
+        readsFlags(false), readsMemory(false), writesMemory(false) {}
+};
+
+// Microgadget - represents a short sequence of x86 instructions (usually a
+// single one) that precedes a RET. Its instructions and addresses are owned by
+// the GadgetStore, and its fields are laid out to fit in 40 bytes.
 struct Microgadget {
   // Type - gives basic semantic information about the instruction
   GadgetType Type;
@@ -37,23 +109,105 @@ struct Microgadget {
   unsigned short reg1;
   unsigned short reg2;
 
-  // Instr - LLVM MCInst data structure of disassembled gadget
-  const std::vector<llvm::MCInst> Instr;
+  // Library - index of the gadget library containing the addresses
+  unsigned short Library;
+
+  // Effects - what the instructions of the gadget do, see GadgetEffects
+  GadgetEffects Effects;
+
+  // Constructor - instr and addresses must outlive the gadget (see
+  // GadgetStore)
+  Microgadget(llvm::ArrayRef<llvm::MCInst> instr,
+              llvm::ArrayRef<uint64_t>     addresses,
+              unsigned                     library)
+      : Type(GadgetType::UNDEFINED), reg1(0), reg2(0), Library(library),
+        Effects(), instr(instr.data()), addrs(addresses.data()),
+        instrCount(instr.size()), addrCount(addresses.size()) {}
 
-  // gadget address(es)
-  std::vector<uint64_t> addresses;
+  // getInstr - returns the LLVM MCInst data structures of the disassembled
+  // gadget, RET included
+  llvm::ArrayRef<llvm::MCInst> getInstr() const {
+    return llvm::ArrayRef<llvm::MCInst>(instr, instrCount);
+  }
+
+  // getAddresses - returns the gadget address(es)
+  llvm::ArrayRef<uint64_t> getAddresses() const {
+    return llvm::ArrayRef<uint64_t>(addrs, addrCount);
+  }
 
-  // debug
-  std::string asmInstr;
+  // getAsmInstr - returns the instructions before the RET in Intel syntax. It
+  // is only needed for debug output, so it is formatted on each use; equal
+  // strings are interned rather than kept by each gadget.
+  const std::string &getAsmInstr() const;
+
+private:
+  const llvm::MCInst *instr;
+  const uint64_t     *addrs;
+  uint32_t            instrCount;
+  uint32_t            addrCount;
+};
+
+// GadgetStore - owns the microgadgets of the gadget libraries, which live as
+// long as the analysis. Gadgets are allocated in chunks, and their
+// instructions and addresses are pooled in contiguous slabs, rather than
+// taking several small heap allocations each.
+class GadgetStore {
+  llvm::SpecificBumpPtrAllocator<Microgadget> gadgets;
+
+  // pool - instructions and addresses of the gadgets
+  llvm::BumpPtrAllocator pool;
+
+  // instrArrays - instruction arrays allocated in pool, to be destroyed
+  std::vector<llvm::ArrayRef<llvm::MCInst>> instrArrays;
+
+public:
+  GadgetStore()                    = default;
+  GadgetStore(const GadgetStore &) = delete;
+  ~GadgetStore() { clear(); }
+
+  // operator= - destroys the gadgets of this store and takes the ones of other
+  GadgetStore &operator=(GadgetStore &&other) {
+    clear();
+    gadgets     = std::move(other.gadgets);
+    pool        = std::move(other.pool);
+    instrArrays = std::move(other.instrArrays);
+    other.instrArrays.clear();
+    return *this;
+  }
+
+  // create - returns a new gadget made of a copy of the given instructions
+  // and addresses
+  Microgadget *create(llvm::ArrayRef<llvm::MCInst> instr,
+                      llvm::ArrayRef<uint64_t>     addresses,
+                      unsigned                     library) {
+    llvm::MCInst *instrCopy = pool.Allocate<llvm::MCInst>(instr.size());
+    uint64_t     *addrCopy  = pool.Allocate<uint64_t>(addresses.size());
+    std::uninitialized_copy(instr.begin(), instr.end(), instrCopy);
+    std::uninitialized_copy(addresses.begin(), addresses.end(), addrCopy);
+    instrArrays.emplace_back(instrCopy, instr.size());
+
+    return new (gadgets.Allocate())
+        Microgadget(llvm::ArrayRef<llvm::MCInst>(instrCopy, instr.size()),
+                    llvm::ArrayRef<uint64_t>(addrCopy, addresses.size()),
+                    library);
+  }
+
+  // copy - returns a new gadget sharing the instructions and the addresses of
+  // the given one
+  Microgadget *copy(const Microgadget &gadget) {
+    return new (gadgets.Allocate()) Microgadget(gadget);
+  }
 
-  // Constructor
-  Microgadget(const llvm::MCInst *instr,
-              int                 count,
-              uint64_t            address,
-              std::string         asmInstr)
-      : Type(GadgetType::UNDEFINED), reg1(0), reg2(0),
-        Instr(instr, instr + count), addresses(), asmInstr(asmInstr) {
-    addresses.push_back(address);
+  // clear - destroys every gadget of the store
+  void clear() {
+    for (auto instr : instrArrays) {
+      for (const llvm::MCInst &inst : instr) {
+        inst.~MCInst();
+      }
+    }
+    instrArrays.clear();
+    gadgets.DestroyAll();
+    pool.Reset();
   }
 };
 
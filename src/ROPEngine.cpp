@@ -41,6 +41,7 @@ class ROPChainBuilder {
   const std::vector<unsigned int> &scratchRegs;
   std::vector<VirtualInstr>        vchain;
   size_t                           numScratchRegs;
+  bool                             deferReorder;
 
 public:
   bool normalInstrFlag, jumpInstrFlag, conditionalJumpInstrFlag;
@@ -63,11 +64,14 @@ public:
     return *this;
   }
 
+  // deferReorder - if true, a reorder() at the end of the chain is left to
+  // the caller (see ROPEngine::restoreRegisters())
   explicit ROPChainBuilder(const BinaryAutopsy             &BA,
-                           const std::vector<unsigned int> &scratchRegs)
+                           const std::vector<unsigned int> &scratchRegs,
+                           bool                             deferReorder)
       : BA(BA), scratchRegs(scratchRegs), vchain(), numScratchRegs(0),
-        normalInstrFlag(false), jumpInstrFlag(false),
-        conditionalJumpInstrFlag(false) {}
+        deferReorder(deferReorder), normalInstrFlag(false),
+        jumpInstrFlag(false), conditionalJumpInstrFlag(false) {}
 
   ROPChainStatus build(XchgState &state, ROPChain &result) const {
     std::vector<int> regList;
@@ -101,11 +105,16 @@ private:
       return ROPChainStatus::ERR_NO_GADGETS_AVAILABLE;
     }
 
-    std::vector<ROPChain> chains;
-    XchgState             state0(state);
+    std::vector<ROPChain>     chains;
+    XchgState                 state0(state);
+    std::vector<unsigned int> freeRegs = getFreeRegs(regList);
 
     for (const VirtualInstr &vi : vchain) {
       if (vi.isReorder()) {
+        if (deferReorder && &vi == &vchain.back()) {
+          continue;
+        }
+
         ROPChain chain = BA.undoXchgs(state0);
         chains.push_back(chain);
       } else if (vi.isImmediate()) {
@@ -119,7 +128,8 @@ private:
         int reg2 = vi.reg2 >= 0 ? vi.reg2 : regList[-vi.reg2 - 1];
 
         if (!isNoop(vi.type, reg1, reg2)) {
-          ROPChain chain = BA.findGadgetPrimitive(state0, vi.type, reg1, reg2);
+          ROPChain chain =
+              BA.findGadgetPrimitive(state0, vi.type, reg1, reg2, freeRegs);
 
           if (!chain.valid()) {
             return ROPChainStatus::ERR_NO_GADGETS_AVAILABLE;
@@ -151,6 +161,31 @@ private:
     return ROPChainStatus::OK;
   }
 
+  // getFreeRegs - returns the scratch registers that are not referenced by the
+  // chain, whose value can be overwritten to move the operands into place
+  std::vector<unsigned int>
+  getFreeRegs(const std::vector<int> &regList) const {
+    std::vector<unsigned int> freeRegs;
+
+    for (unsigned int r : scratchRegs) {
+      bool used = std::find(regList.begin(), regList.end(), (int)r) !=
+                  regList.end();
+
+      for (const VirtualInstr &vi : vchain) {
+        if (!vi.isReorder() && !vi.isImmediate() &&
+            ((int)r == vi.reg1 || (int)r == vi.reg2)) {
+          used = true;
+        }
+      }
+
+      if (!used) {
+        freeRegs.push_back(r);
+      }
+    }
+
+    return freeRegs;
+  }
+
   static bool isNoop(GadgetType type, int reg1, int reg2) {
     if (type == GadgetType::COPY && reg1 == reg2) {
       return true;
@@ -239,7 +274,12 @@ void ROPChain::merge(const ROPChain &other) {
   }
 }
 
-ROPEngine::ROPEngine(const BinaryAutopsy &BA) : BA(BA) {}
+ROPEngine::ROPEngine(const BinaryAutopsy &BA, bool deferXchgRestore)
+    : BA(BA), deferXchgRestore(deferXchgRestore) {}
+
+ROPChain ROPEngine::restoreRegisters(XchgState &state) const {
+  return BA.undoXchgs(state);
+}
 
 bool ROPEngine::convertOperandToChainPushImm(const MachineOperand &operand,
                                              ChainElem            &result) {
@@ -293,6 +333,16 @@ ROPEngine::handleArithmeticRI(MachineInstr              *MI,
     imm         = MI->getOperand(2).getImm();
     break;
   }
+  case X86::OR32ri8:
+  case X86::OR32ri: {
+    if (!MI->getOperand(2).isImm()) {
+      return ROPChainStatus::ERR_UNSUPPORTED;
+    }
+
+    gadget_type = GadgetType::OR;
+    imm         = MI->getOperand(2).getImm();
+    break;
+  }
   case X86::INC32r: {
     gadget_type = GadgetType::ADD;
     imm         = 1;
@@ -307,7 +357,7 @@ ROPEngine::handleArithmeticRI(MachineInstr              *MI,
   }
 
   Register        dest_reg = MI->getOperand(0).getReg();
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
 
   builder.append(GadgetType::MOV, SCRATCH_1)
       .append(ChainElem::fromImmediate(imm));
@@ -318,6 +368,29 @@ ROPEngine::handleArithmeticRI(MachineInstr              *MI,
   return builder.build(state, chain);
 }
 
+ROPChainStatus
+ROPEngine::handleArithmeticR(MachineInstr              *MI,
+                             std::vector<unsigned int> &scratchRegs) {
+  GadgetType gadget_type;
+
+  switch (MI->getOpcode()) {
+  case X86::INC32r: gadget_type = GadgetType::INC; break;
+  case X86::DEC32r: gadget_type = GadgetType::DEC; break;
+  case X86::NEG32r: gadget_type = GadgetType::NEG; break;
+  case X86::NOT32r: gadget_type = GadgetType::NOT; break;
+  default: return ROPChainStatus::ERR_UNSUPPORTED;
+  }
+
+  Register        dst = MI->getOperand(0).getReg();
+  ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
+
+  builder.append(gadget_type, dst);
+  builder.reorder();
+  builder.normalInstrFlag = true;
+
+  return builder.build(state, chain);
+}
+
 ROPChainStatus
 ROPEngine::handleArithmeticRR(MachineInstr              *MI,
                               std::vector<unsigned int> &scratchRegs) {
@@ -343,10 +416,13 @@ ROPEngine::handleArithmeticRR(MachineInstr              *MI,
   case X86::AND32rr:
     gadget_type = (src1 == src2) ? GadgetType::AND_1 : GadgetType::AND;
     break;
+  case X86::OR32rr:
+    gadget_type = (src1 == src2) ? GadgetType::OR_1 : GadgetType::OR;
+    break;
   default: return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
 
   builder.append(gadget_type, dst, src2);
   builder.reorder();
@@ -364,6 +440,7 @@ ROPEngine::handleArithmeticRM(MachineInstr              *MI,
   case X86::ADD32rm: gadget_type = GadgetType::ADD; break;
   case X86::SUB32rm: gadget_type = GadgetType::SUB; break;
   case X86::AND32rm: gadget_type = GadgetType::AND; break;
+  case X86::OR32rm: gadget_type = GadgetType::OR; break;
   default: return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
@@ -387,7 +464,7 @@ ROPEngine::handleArithmeticRM(MachineInstr              *MI,
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
 
   builder.append(GadgetType::MOV, SCRATCH_1).append(disp_elem);
   if (src != X86::NoRegister) {
@@ -414,7 +491,7 @@ ROPEngine::handleXor32RR(MachineInstr              *MI,
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
 
   builder.append(GadgetType::XOR_1, dst);
   builder.reorder();
@@ -445,7 +522,7 @@ ROPChainStatus ROPEngine::handleLea32r(MachineInstr              *MI,
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
 
   if (src == X86::NoRegister) {
     // lea dst, [disp]
@@ -499,7 +576,7 @@ ROPEngine::handleMov32rm(MachineInstr              *MI,
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
 
   builder.append(GadgetType::MOV, SCRATCH_1).append(disp_elem);
   if (src != X86::NoRegister) {
@@ -550,7 +627,7 @@ ROPEngine::handleMov32mr(MachineInstr              *MI,
       return ROPChainStatus::ERR_UNSUPPORTED;
     }
 
-    ROPChainBuilder builder(BA, scratchRegs);
+    ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
     ChainElem       esp_elem = ChainElem::createStackPointerPush();
 
     disp_elem =
@@ -565,7 +642,7 @@ ROPEngine::handleMov32mr(MachineInstr              *MI,
     return builder.build(state, chain);
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
 
   builder.append(GadgetType::MOV, SCRATCH_1).append(disp_elem);
   if (dst != X86::NoRegister) {
@@ -613,7 +690,7 @@ ROPEngine::handleMov32mi(MachineInstr              *MI,
       return ROPChainStatus::ERR_UNSUPPORTED;
     }
 
-    ROPChainBuilder builder(BA, scratchRegs);
+    ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
     ChainElem       esp_elem = ChainElem::createStackPointerPush();
 
     disp_elem =
@@ -629,7 +706,7 @@ ROPEngine::handleMov32mi(MachineInstr              *MI,
     return builder.build(state, chain);
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
 
   builder.append(GadgetType::MOV, SCRATCH_2).append(imm_elem);
   builder.append(GadgetType::MOV, SCRATCH_1).append(disp_elem);
@@ -654,7 +731,7 @@ ROPEngine::handleMov32rr(MachineInstr              *MI,
   Register dst = MI->getOperand(0).getReg();
   Register src = MI->getOperand(1).getReg();
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
 
   builder.append(GadgetType::COPY, dst, src);
   builder.reorder();
@@ -678,7 +755,7 @@ ROPEngine::handleMov32ri(MachineInstr              *MI,
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
 
   builder.append(GadgetType::MOV, dst).append(imm_elem);
   builder.reorder();
@@ -713,7 +790,7 @@ ROPEngine::handleCmp32mi(MachineInstr              *MI,
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
 
   builder.append(GadgetType::MOV, SCRATCH_2).append(imm_elem);
   builder.append(GadgetType::MOV, SCRATCH_1).append(disp_elem);
@@ -739,7 +816,7 @@ ROPEngine::handleCmp32rr(MachineInstr              *MI,
   Register reg1 = MI->getOperand(0).getReg();
   Register reg2 = MI->getOperand(1).getReg();
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
 
   builder.append(GadgetType::COPY, SCRATCH_1, reg1);
   builder.append(GadgetType::SUB, SCRATCH_1, reg2);
@@ -764,7 +841,7 @@ ROPEngine::handleCmp32ri(MachineInstr              *MI,
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
 
   builder.append(GadgetType::MOV, SCRATCH_2).append(imm_elem);
   builder.append(GadgetType::COPY, SCRATCH_1, reg);
@@ -800,7 +877,7 @@ ROPEngine::handleCmp32rm(MachineInstr              *MI,
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
 
   builder.append(GadgetType::MOV, SCRATCH_1).append(disp_elem);
   if (src != X86::NoRegister) {
@@ -888,7 +965,7 @@ ROPChainStatus ROPEngine::handleJcc1(MachineInstr              *MI,
   }
 #endif
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
 
   builder.append(GadgetType::MOV, reverse ? SCRATCH_1 : SCRATCH_2)
       .append(ChainElem::fromJmpTarget(MI->getOperand(0).getMBB()));
@@ -914,7 +991,7 @@ ROPChainStatus ROPEngine::handleCall(MachineInstr              *MI,
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
 
   builder.append(callee_elem);
   builder.append(ChainElem::createJmpFallthrough());
@@ -939,7 +1016,7 @@ ROPEngine::handleCallReg(MachineInstr              *MI,
   }
 
   Register        reg = MI->getOperand(0).getReg();
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, deferXchgRestore);
 
   builder.append(GadgetType::JMP, reg);
   builder.append(ChainElem::createJmpFallthrough());
@@ -973,6 +1050,15 @@ ROPChainStatus ROPEngine::ropify(MachineInstr              &MI,
   ROPChainStatus status;
   FlagSaveMode   flagSave;
 
+  chain.clear();
+
+  // calls and unconditional jumps leave the chain, so the registers exchanged
+  // by the previous instructions must be restored before them (conditional
+  // jumps restore them before their JMP gadget)
+  if (MI.isCall() || MI.isUnconditionalBranch()) {
+    chain.append(BA.undoXchgs(state));
+  }
+
   switch (MI.getOpcode()) {
   case X86::ADD32ri8:
   case X86::ADD32ri:
@@ -980,15 +1066,31 @@ ROPChainStatus ROPEngine::ropify(MachineInstr              &MI,
   case X86::SUB32ri:
   case X86::AND32ri8:
   case X86::AND32ri:
+  case X86::OR32ri8:
+  case X86::OR32ri: {
+    status   = handleArithmeticRI(&MI, scratchRegs);
+    flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
+    break;
+  }
   case X86::INC32r:
   case X86::DEC32r: {
-    status   = handleArithmeticRI(&MI, scratchRegs);
+    // inc/dec gadgets are preferred, since they do not need a scratch register
+    status = handleArithmeticR(&MI, scratchRegs);
+    if (status != ROPChainStatus::OK) {
+      status = handleArithmeticRI(&MI, scratchRegs);
+    }
     flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
     break;
   }
+  case X86::NEG32r:
+  case X86::NOT32r:
+    status   = handleArithmeticR(&MI, scratchRegs);
+    flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
+    break;
   case X86::ADD32rr:
   case X86::SUB32rr:
   case X86::AND32rr:
+  case X86::OR32rr:
   case X86::ADD32rr_DB:
     status   = handleArithmeticRR(&MI, scratchRegs);
     flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
@@ -996,6 +1098,7 @@ ROPChainStatus ROPEngine::ropify(MachineInstr              &MI,
   case X86::ADD32rm:
   case X86::SUB32rm:
   case X86::AND32rm:
+  case X86::OR32rm:
     status   = handleArithmeticRM(&MI, scratchRegs);
     flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
     break;
@@ -1072,9 +1175,21 @@ ROPChainStatus ROPEngine::ropify(MachineInstr              &MI,
   }
 
   if (status == ROPChainStatus::OK) {
+    // if the instruction does not modify the flags and neither do the gadgets
+    // (e.g. only pop, mov, xchg, load and store), the flags only need to be
+    // preserved while the chain is being pushed
+    if (flagSave == FlagSaveMode::SAVE_AFTER_EXEC && !chain.clobbersFlags()) {
+      flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
+    }
     chain.flagSave = shouldFlagSaved ? flagSave : FlagSaveMode::NOT_SAVED;
     chain.removeDuplicates();
     resultChain = std::move(chain);
+
+    // nothing is executed after the chain of a jump or a call, so the
+    // registers they exchanged are never restored
+    if (MI.isBranch() || MI.isCall()) {
+      state = XchgState();
+    }
   }
 
   return status;
@@ -1108,4 +1223,133 @@ void ROPChain::removeDuplicates() {
   } while (duplicates);
 }
 
+bool ROPChain::clobbersFlags() const {
+  return std::any_of(begin(), end(), [](const ChainElem &elem) {
+    return elem.type == ChainElem::Type::GADGET &&
+           elem.microgadget->Effects.clobbersFlags;
+  });
+}
+
+void ROPChain::mergePopGadgets(const BinaryAutopsy &BA) {
+  // isPopAt - checks whether the chain has a "pop REG" gadget at index i,
+  // followed by its value
+  auto isPopAt = [this](size_t i) {
+    return i + 1 < chain.size() && chain[i].type == ChainElem::Type::GADGET &&
+           chain[i].microgadget->Type == GadgetType::MOV &&
+           chain[i + 1].type != ChainElem::Type::GADGET;
+  };
+
+  size_t successorIdx = successor ? successor - chain.data() : chain.size();
+  size_t out          = 0;
+
+  // the chain is compacted in place, since it can only shrink
+  for (size_t in = 0; in < chain.size();) {
+    unsigned int       regs[MAXINSTRS];
+    size_t             count = 0;
+    const Microgadget *found = nullptr;
+
+    while (count < MAXINSTRS && isPopAt(in + 2 * count)) {
+      regs[count] = chain[in + 2 * count].microgadget->reg1;
+      count++;
+    }
+
+    // prefer the gadget popping the longest run
+    while (count >= 2 && !(found = BA.findMultiPopGadget(regs, count))) {
+      count--;
+    }
+
+    if (!found) {
+      if (in == successorIdx) {
+        successorIdx = out;
+      }
+      chain[out++] = chain[in++];
+      continue;
+    }
+
+    chain[out++] = ChainElem::fromGadget(found);
+    for (size_t i = 0; i < count; i++, in += 2) {
+      if (in + 1 == successorIdx) {
+        successorIdx = out;
+      }
+      chain[out++] = chain[in + 1];
+    }
+  }
+
+  chain.erase(chain.begin() + out, chain.end());
+  if (successor) {
+    successor = &chain[successorIdx];
+  }
+}
+
+// ------------------------------------------------------------------------
+// ROP Chain Merger
+// ------------------------------------------------------------------------
+
+ROPChainMerger::ROPChainMerger(ROPEngine &engine, InsertFn insert)
+    : engine(engine), insert(insert), lastMI(nullptr) {}
+
+ROPChainStatus ROPChainMerger::add(MachineInstr              &MI,
+                                   std::vector<unsigned int> &scratchRegs,
+                                   bool                       shouldFlagSaved) {
+  // registers left exchanged by the current chain
+  XchgState      chainState = engine.getXchgState();
+  ROPChain       result;
+  ROPChainStatus status =
+      engine.ropify(MI, scratchRegs, shouldFlagSaved, result);
+
+  // a chain that is not merged must not depend on the registers exchanged
+  // by the previous instructions: restore them and translate it again
+  if (status == ROPChainStatus::OK && chainState.hasExchanges() &&
+      !chain.canMerge(result)) {
+    flush(chainState);
+    engine.setXchgState(chainState);
+    status = engine.ropify(MI, scratchRegs, shouldFlagSaved, result);
+  }
+
+  bool isJump = result.hasConditionalJump || result.hasUnconditionalJump;
+  if (isJump && result.flagSave == FlagSaveMode::SAVE_AFTER_EXEC) {
+    // when flag should be saved after resume, jmp instruction cannot be
+    // ROPified
+    status = ROPChainStatus::ERR_UNSUPPORTED;
+  }
+
+  if (status != ROPChainStatus::OK) {
+    flush(chainState);
+    engine.setXchgState(chainState);
+    return status;
+  }
+
+  if (chain.canMerge(result)) {
+    chain.merge(result);
+  } else {
+    // the engine keeps the state left by result, which starts a new chain
+    flush(chainState);
+    chain = std::move(result);
+  }
+  lastMI = &MI;
+
+  return status;
+}
+
+void ROPChainMerger::flush() {
+  XchgState state = engine.getXchgState();
+
+  flush(state);
+  engine.setXchgState(state);
+}
+
+void ROPChainMerger::flush(XchgState &state) {
+  if (!chain.valid()) {
+    return;
+  }
+
+  ROPChain restore = engine.restoreRegisters(state);
+  if (restore.valid()) {
+    chain.merge(restore);
+  }
+
+  insert(chain, *lastMI);
+  chain.clear();
+}
+
 } // namespace ropf
@@ -15,6 +15,7 @@
 #include "ChainElem.h"
 #include "LivenessAnalysis.h"
 #include "XchgGraph.h"
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/CodeGen/MachineInstr.h"
 #include <string>
 #include <tuple>
@@ -86,6 +87,16 @@ public:
   // effects.
   void removeDuplicates();
 
+  // Checks whether any gadget of the chain may modify the flags, according
+  // to the effect summaries of the gadgets.
+  bool clobbersFlags() const;
+
+  // Replaces runs of "pop REG" gadgets, each followed by its value, with a
+  // single gadget popping all of them (e.g. "pop eax; pop ebx; ret"), if the
+  // gadget libraries provide one. The values stay in the same order, so the
+  // registers get the same values with fewer RETs.
+  void mergePopGadgets(const BinaryAutopsy &BA);
+
   ROPChain() { clear(); }
 };
 
@@ -109,7 +120,10 @@ class ROPEngine {
   ROPChain             chain;
   XchgState            state;
   const BinaryAutopsy &BA;
+  bool                 deferXchgRestore;
 
+  ROPChainStatus handleArithmeticR(llvm::MachineInstr *,
+                                   std::vector<unsigned int> &scratchRegs);
   ROPChainStatus handleArithmeticRI(llvm::MachineInstr *,
                                     std::vector<unsigned int> &scratchRegs);
   ROPChainStatus handleArithmeticRR(llvm::MachineInstr *,
@@ -150,8 +164,21 @@ class ROPEngine {
                                     ChainElem                  &result);
 
 public:
-  // Constructor
-  ROPEngine(const BinaryAutopsy &BA);
+  // Constructor. If deferXchgRestore is true, the registers exchanged to
+  // translate an instruction are left exchanged at the end of its chain, and
+  // the following instructions are translated against the same exchanges, so
+  // that the chains of adjacent instructions can be merged without restoring
+  // the registers in between. In that case, the registers must be restored at
+  // the end of every merged chain (see ROPChainMerger).
+  ROPEngine(const BinaryAutopsy &BA, bool deferXchgRestore = false);
+
+  // restoreRegisters - returns the chain bringing every register exchanged in
+  // state back to its own physical register, and resets state.
+  ROPChain restoreRegisters(XchgState &state) const;
+
+  const XchgState &getXchgState() const { return state; }
+
+  void setXchgState(const XchgState &xchgState) { state = xchgState; }
 
   ROPChainStatus ropify(llvm::MachineInstr        &MI,
                         std::vector<unsigned int> &scratchRegs,
@@ -161,6 +188,38 @@ public:
   void mergeChains(ROPChain &chain1, const ROPChain &chain2);
 };
 
+// ROPChainMerger - merges the chains of consecutive instructions of a basic
+// block, translated by the given engine. Each merged chain is completed with
+// the exchanges restoring the registers it left exchanged, and passed to
+// insert together with its last instruction.
+class ROPChainMerger {
+public:
+  typedef llvm::function_ref<void(ROPChain &, llvm::MachineInstr &)> InsertFn;
+
+  // Constructor. insert must outlive the merger.
+  ROPChainMerger(ROPEngine &engine, InsertFn insert);
+
+  // add - translates MI and merges its chain into the current one, or inserts
+  // the current chain and starts a new one from it. If MI cannot be
+  // translated, the current chain is inserted and the status is returned.
+  ROPChainStatus add(llvm::MachineInstr        &MI,
+                     std::vector<unsigned int> &scratchRegs,
+                     bool                       shouldFlagSaved);
+
+  // flush - inserts the current chain, if any
+  void flush();
+
+private:
+  ROPEngine          &engine;
+  InsertFn            insert;
+  ROPChain            chain;  // merged chain
+  llvm::MachineInstr *lastMI; // last instruction of chain
+
+  // flush - inserts the current chain, restoring the registers exchanged in
+  // state, which must be the state left by its last instruction
+  void flush(XchgState &state);
+};
+
 } // namespace ropf
 
 #endif
@@ -135,6 +135,12 @@ void parseFunctionOptions(const toml::Value    &config,
               CONFIG_OPAQUE_GADGET_ADDRESSES_ENABLED,
               funcParam.opaqueGadgetAddressesEnabled);
 
+  // Deferred restore of exchanged registers enabled
+  parseOption(config,
+              tomlSect,
+              CONFIG_DEFERRED_XCHG_RESTORE_ENABLED,
+              funcParam.deferredXchgRestoreEnabled);
+
   /* =========================
    * STRINGS PARSING
    */
@@ -224,6 +230,21 @@ void parseFunctionOptions(const toml::Value    &config,
       funcParam.opaqueBranchTargetsPercentage = branches_obfuscation_percentage;
     }
   }
+
+  // gadget address locality
+  int gadget_address_locality;
+  if (parseOption(config,
+                  tomlSect,
+                  CONFIG_GADGET_ADDRESS_LOCALITY,
+                  gadget_address_locality)) {
+    if (gadget_address_locality < 0 || gadget_address_locality > 100) {
+      dbg_fmt("Ignoring gadget address locality \"{}\". It should be a "
+              "value between 0 and 100.\n",
+              gadget_address_locality);
+    } else {
+      funcParam.gadgetAddressLocality = gadget_address_locality;
+    }
+  }
 }
 
 } // namespace
@@ -292,6 +313,12 @@ void ROPfuscatorConfig::loadFromFile(const std::string &filename) {
                 CONFIG_LINKED_LIBS,
                 globalConfig.linkedLibraries);
 
+    // extra gadget libraries
+    parseOption(*general_section,
+                CONFIG_GENERAL_SECTION,
+                CONFIG_EXTRA_GADGET_LIBS,
+                globalConfig.extraGadgetLibraries);
+
     // Avoid multiversion symbols
     parseOption(*general_section,
                 CONFIG_GENERAL_SECTION,
@@ -333,6 +360,48 @@ void ROPfuscatorConfig::loadFromFile(const std::string &filename) {
                 CONFIG_GENERAL_SECTION,
                 CONFIG_WRITE_INSTR_STAT,
                 globalConfig.writeInstrStat);
+
+    // Gadget cache
+    parseOption(*general_section,
+                CONFIG_GENERAL_SECTION,
+                CONFIG_GADGET_CACHE,
+                globalConfig.gadgetCacheEnabled);
+
+    // Gadget cache directory
+    parseOption(*general_section,
+                CONFIG_GENERAL_SECTION,
+                CONFIG_GADGET_CACHE_DIR,
+                globalConfig.gadgetCacheDir);
+
+    // gadget scan threads
+    int gadget_scan_threads;
+    if (parseOption(*general_section,
+                    CONFIG_GENERAL_SECTION,
+                    CONFIG_GADGET_SCAN_THREADS,
+                    gadget_scan_threads)) {
+      if (gadget_scan_threads < 0) {
+        dbg_fmt("Ignoring gadget scan threads \"{}\". It should be a "
+                "non-negative number.\n",
+                gadget_scan_threads);
+      } else {
+        globalConfig.gadgetScanThreads = gadget_scan_threads;
+      }
+    }
+
+    // anchor symbols limit
+    int anchor_symbols_limit;
+    if (parseOption(*general_section,
+                    CONFIG_GENERAL_SECTION,
+                    CONFIG_ANCHOR_SYMBOLS,
+                    anchor_symbols_limit)) {
+      if (anchor_symbols_limit < 0) {
+        dbg_fmt("Ignoring anchor symbols limit \"{}\". It should be a "
+                "non-negative number.\n",
+                anchor_symbols_limit);
+      } else {
+        globalConfig.anchorSymbolsLimit = anchor_symbols_limit;
+      }
+    }
   }
 
   // =====================================
@@ -26,11 +26,16 @@ namespace ropf {
 #define CONFIG_CUSTOM_LIB_PATH     "custom_library_path"
 #define CONFIG_LIB_SHA1            "library_hash_sha1"
 #define CONFIG_LINKED_LIBS         "linked_libraries"
+#define CONFIG_EXTRA_GADGET_LIBS   "extra_gadget_libraries"
 #define CONFIG_SHOW_PROGRESS       "show_progress"
 #define CONFIG_PRINT_INSTR_STAT    "print_instr_stat"
 #define CONFIG_USE_CHAIN_LABEL     "use_chain_label"
 #define CONFIG_RNG_SEED            "rng_seed"
 #define CONFIG_WRITE_INSTR_STAT    "write_instr_stat"
+#define CONFIG_GADGET_CACHE        "gadget_cache_enabled"
+#define CONFIG_GADGET_CACHE_DIR    "gadget_cache_dir"
+#define CONFIG_GADGET_SCAN_THREADS "gadget_scan_threads"
+#define CONFIG_ANCHOR_SYMBOLS      "anchor_symbols_limit"
 
 // =========================
 // Functions-specific options
@@ -65,6 +70,12 @@ namespace ropf {
 // opaque stack values
 #define CONFIG_OPAQUE_STACK_VALUES_ENABLED "opaque_saved_stack_values_enabled"
 
+// gadget address selection
+#define CONFIG_GADGET_ADDRESS_LOCALITY "gadget_address_locality"
+
+// register exchanges
+#define CONFIG_DEFERRED_XCHG_RESTORE_ENABLED "deferred_xchg_restore_enabled"
+
 //===========================
 
 /// obfuscation configuration parameter for each function
@@ -91,6 +102,12 @@ struct ObfuscationParameter {
   bool         opaqueGadgetAddressesEnabled;
   /// percentage of total addresses to obfuscate for this function
   unsigned int gadgetAddressesObfuscationPercentage;
+  /// percentage of gadget addresses chosen among the cache lines and pages
+  /// already used by the function, rather than among all the addresses
+  unsigned int gadgetAddressLocality;
+  /// true if the registers exchanged by an instruction are restored only at
+  /// the end of the merged chain, rather than at the end of the instruction
+  bool         deferredXchgRestoreEnabled;
   /// opaque constant algorithm for this function
   std::string  opaqueConstantsAlgorithm;
   /// opaque predicate input generation algorithm for this function
@@ -103,7 +120,8 @@ struct ObfuscationParameter {
         contextualOpaquePredicatesEnabled(true),
         opaqueBranchTargetsEnabled(true), opaqueBranchTargetsPercentage(100),
         opaqueSavedStackValuesEnabled(true), opaqueGadgetAddressesEnabled(true),
-        gadgetAddressesObfuscationPercentage(100),
+        gadgetAddressesObfuscationPercentage(100), gadgetAddressLocality(0),
+        deferredXchgRestoreEnabled(false),
         opaqueConstantsAlgorithm(OPAQUE_CONSTANT_ALGORITHM_MOV),
         opaqueInputGenAlgorithm(OPAQUE_RANDOM_ALGORITHM_ADDREG) {}
 };
@@ -118,6 +136,10 @@ struct GlobalConfig {
   // [BinaryAutopsy] other library paths linked at run-time
   // If set, the symbol names in these libraries are put in avoid-list in gadget
   std::vector<std::string> linkedLibraries;
+  // [BinaryAutopsy] additional library paths where the gadgets are extracted.
+  // Their gadgets are merged with the ones of libraryPath, and each gadget is
+  // referenced through a symbol of its own library.
+  std::vector<std::string> extraGadgetLibraries;
   // true if obfuscation is enabled, false if obfuscation is disabled globally
   bool                     obfuscationEnabled;
   // [BinaryAutopsy] If set to true, find gadget in code segment instead of code
@@ -137,13 +159,26 @@ struct GlobalConfig {
   size_t                   rng_seed;
   // if enabled, write instruction obfuscation statistics to file
   bool                     writeInstrStat;
+  // [BinaryAutopsy] If set to true, the results of the library analysis are
+  // cached on disk and reused by the following compilations
+  bool                     gadgetCacheEnabled;
+  // [BinaryAutopsy] directory of the gadget cache (empty: user cache directory)
+  std::string              gadgetCacheDir;
+  // [BinaryAutopsy] number of threads scanning the libraries for gadgets
+  // (0: one per hardware thread)
+  unsigned int             gadgetScanThreads;
+  // maximum number of distinct symbols of each gadget library used as anchors
+  // of the gadget addresses in the module (0: no limit); experimental, its
+  // effect on load time has not been measured
+  unsigned int             anchorSymbolsLimit;
 
   GlobalConfig()
       : libraryPath(), librarySHA1(), linkedLibraries(),
-        obfuscationEnabled(true), searchSegmentForGadget(true),
-        avoidMultiversionSymbol(false), showProgress(false),
-        printInstrStat(false), useChainLabel(false), rng_seed(0),
-        writeInstrStat(false) {}
+        extraGadgetLibraries(), obfuscationEnabled(true),
+        searchSegmentForGadget(true), avoidMultiversionSymbol(false),
+        showProgress(false), printInstrStat(false), useChainLabel(false),
+        rng_seed(0), writeInstrStat(false), gadgetCacheEnabled(true),
+        gadgetCacheDir(), gadgetScanThreads(0), anchorSymbolsLimit(0) {}
 };
 
 struct ROPfuscatorConfig {
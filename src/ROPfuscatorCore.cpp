@@ -21,6 +21,7 @@
 #include "X86RegisterInfo.h"
 #include "X86Subtarget.h"
 #include "X86TargetMachine.h"
+#include "llvm/ADT/Triple.h"
 #include "llvm/CodeGen/MachineFunction.h"
 #include "llvm/CodeGen/MachineInstr.h"
 #include "llvm/Support/CommandLine.h"
@@ -245,6 +246,17 @@ void putLabelInMBB(MachineBasicBlock &MBB, X86AssembleHelper::Label label) {
   as.putLabel(label);
 }
 
+// sizes (log2) of the cache lines and pages considered when selecting gadget
+// addresses
+const unsigned CACHE_LINE_BITS = 6;
+const unsigned PAGE_BITS       = 12;
+
+// getAddressBlock - identifies the block of 2^bits bytes of a gadget library
+// holding the given address
+uint64_t getAddressBlock(unsigned library, uint64_t address, unsigned bits) {
+  return (uint64_t)library << 48 | address >> bits;
+}
+
 } // namespace
 
 class ChainElementSelector {
@@ -350,6 +362,29 @@ ROPfuscatorCore::ROPfuscatorCore(llvm::Module            &module,
     }
   }
 
+  GlobalConfig &globalConfig = this->config.globalConfig;
+  if (globalConfig.linkedLibraries.empty()) {
+    for (std::string libname : {"libgcc_s.so.1",
+                                "libpthread.so.0",
+                                "libm.so.6",
+                                "libstdc++.so.6"}) {
+      std::string path = findLibraryPath(libname);
+      if (!path.empty()) {
+        globalConfig.linkedLibraries.push_back(path);
+        dbg_fmt("[*] Avoiding gadgets from: {}\n", path);
+      }
+    }
+  }
+
+  // The library analysis does not depend on the functions being obfuscated,
+  // so it runs in background while the module is being compiled and it is
+  // waited for by the first obfuscated function. Only 32-bit modules are
+  // obfuscated.
+  if (Triple(module.getTargetTriple()).getArch() == Triple::x86) {
+    pendingAnalysis =
+        BinaryAutopsy::startAnalysis(globalConfig, module.getTargetTriple());
+  }
+
   gadgetAddressSelector =
       new ChainElementSelector(0, {ChainElem::Type::GADGET});
   immediateSelector = new ChainElementSelector(
@@ -361,6 +396,9 @@ ROPfuscatorCore::ROPfuscatorCore(llvm::Module            &module,
 }
 
 ROPfuscatorCore::~ROPfuscatorCore() {
+  // the background analysis must not outlive config
+  BinaryAutopsy::waitForAnalysis(pendingAnalysis);
+
   if (config.globalConfig.writeInstrStat) {
     auto logfile = fmt::format("{}-{}",
                                ROPFUSCATOR_OBFUSCATION_STATISTICS_FILE_HEAD,
@@ -405,6 +443,68 @@ ROPfuscatorCore::~ROPfuscatorCore() {
   assert(module_total_instructions == processed_instructions);
 }
 
+uint64_t
+ROPfuscatorCore::selectGadgetAddress(const Microgadget          &gadget,
+                                     const ObfuscationParameter &param) {
+  ArrayRef<uint64_t>    addresses = gadget.getAddresses();
+  std::vector<uint64_t> candidates;
+
+  // findUsed - puts in candidates the addresses on the blocks (cache lines or
+  // pages) already used, and returns true if there are any
+  auto findUsed = [&](const std::unordered_set<uint64_t> &used,
+                      unsigned                            bits) {
+    candidates.clear();
+    for (uint64_t address : addresses) {
+      if (used.count(getAddressBlock(gadget.Library, address, bits))) {
+        candidates.push_back(address);
+      }
+    }
+    return !candidates.empty();
+  };
+
+  if (param.gadgetAddressLocality > 0 &&
+      math::Random::range32(0, 99) < param.gadgetAddressLocality &&
+      (findUsed(usedGadgetLines, CACHE_LINE_BITS) ||
+       findUsed(usedGadgetPages, PAGE_BITS))) {
+    addresses = candidates;
+  }
+
+  // pick address randomly
+  std::vector<uint64_t> chosen;
+  std::sample(addresses.begin(),
+              addresses.end(),
+              std::back_inserter(chosen),
+              1,
+              math::Random::engine());
+
+  usedGadgetLines.insert(
+      getAddressBlock(gadget.Library, chosen[0], CACHE_LINE_BITS));
+  usedGadgetPages.insert(getAddressBlock(gadget.Library, chosen[0], PAGE_BITS));
+  return chosen[0];
+}
+
+const Symbol *ROPfuscatorCore::getAnchorSymbol(unsigned library) {
+  unsigned limit = config.globalConfig.anchorSymbolsLimit;
+  if (limit == 0) {
+    return BA->getRandomSymbol(library);
+  }
+
+  if (anchorSymbols.size() <= library) {
+    anchorSymbols.resize(library + 1);
+  }
+  auto &anchors = anchorSymbols[library];
+
+  if (anchors.size() < limit) {
+    const Symbol *sym = BA->getRandomSymbol(library);
+    if (std::find(anchors.begin(), anchors.end(), sym) == anchors.end()) {
+      anchors.push_back(sym);
+    }
+    return sym;
+  }
+
+  return anchors[math::Random::range32(0, anchors.size() - 1)];
+}
+
 void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
                                      MachineBasicBlock          &MBB,
                                      MachineInstr               &MI,
@@ -419,6 +519,9 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
   std::vector<unsigned>       gadgetsIdxToObfuscate, immediatesIdxToObfuscate,
       branchIdxToObfuscate;
 
+  // use the gadgets popping several registers at once, if any
+  chain.mergePopGadgets(*BA);
+
   total_chain_elems += chain.size();
 
   // stack layout:
@@ -536,18 +639,13 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
     }
 
     case ChainElem::Type::GADGET: {
-      // Get a random symbol to reference this gadget in memory
-      const Symbol                *sym       = BA->getRandomSymbol();
-      // Choose a random address in the gadget
-      const std::vector<uint64_t> &addresses = elem.microgadget->addresses;
-      std::vector<uint32_t>        offsets;
+      // Get a random symbol of the gadget library to reference this gadget
+      // in memory
+      const Symbol *sym = getAnchorSymbol(elem.microgadget->Library);
 
-      // pick address randomly
-      std::sample(addresses.begin(),
-                  addresses.end(),
-                  std::back_inserter(offsets),
-                  1,
-                  math::Random::engine());
+      // Choose a random address in the gadget
+      std::vector<uint32_t> offsets = {
+          (uint32_t)selectGadgetAddress(*elem.microgadget, param)};
 
       for (auto &offset : offsets) {
         offset -= sym->Address;
@@ -701,15 +799,19 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
   StackState             stackState;
 
   // compute clobbered registers
+  bool opaqueConstantsUsed = false;
   if (param.opaquePredicatesEnabled) {
     for (auto &push : pushchain) {
       if (auto &op = push->opaqueConstant) {
         auto clobbered = op->getClobberedRegs();
         savedRegs.insert(clobbered.begin(), clobbered.end());
+        opaqueConstantsUsed = true;
       }
     }
   }
-  if (chain.flagSave == FlagSaveMode::SAVE_BEFORE_EXEC) {
+  // the flags are modified before the chain is executed only by the
+  // computation of the opaque constants
+  if (chain.flagSave == FlagSaveMode::SAVE_BEFORE_EXEC && opaqueConstantsUsed) {
     savedRegs.insert(X86::EFLAGS);
   } else {
     savedRegs.erase(X86::EFLAGS);
@@ -834,19 +936,7 @@ void ROPfuscatorCore::obfuscateFunction(MachineFunction &MF) {
 
   // create a new singleton instance of Binary Autopsy
   if (BA == nullptr) {
-    if (config.globalConfig.linkedLibraries.empty()) {
-      for (std::string libname : {"libgcc_s.so.1",
-                                  "libpthread.so.0",
-                                  "libm.so.6",
-                                  "libstdc++.so.6"}) {
-        std::string path = findLibraryPath(libname);
-        if (!path.empty()) {
-          config.globalConfig.linkedLibraries.push_back(path);
-          dbg_fmt("[*] Avoiding gadgets from: {}\n", path);
-        }
-      }
-    }
-
+    BinaryAutopsy::waitForAnalysis(pendingAnalysis);
     BA = BinaryAutopsy::getInstance(config.globalConfig, MF);
   }
 
@@ -869,6 +959,10 @@ void ROPfuscatorCore::obfuscateFunction(MachineFunction &MF) {
   // ASM labels for each ROP chain
   int chainID = 0;
 
+  // gadget addresses are grouped within each function
+  usedGadgetLines.clear();
+  usedGadgetPages.clear();
+
   gadgetAddressSelector->setPercentage(
       param.gadgetAddressesObfuscationPercentage);
   immediateSelector->setPercentage(param.opaqueImmediateOperandsPercentage);
@@ -883,8 +977,13 @@ void ROPfuscatorCore::obfuscateFunction(MachineFunction &MF) {
     // safely clobbered to compute temporary data
     ScratchRegMap MBBScratchRegs = performLivenessAnalysis(MBB);
 
-    ROPChain      chain0; // merged chain
-    MachineInstr *prevMI = nullptr;
+    ROPEngine engine(*BA, param.deferredXchgRestoreEnabled);
+
+    auto insertChain = [&](ROPChain &chain, MachineInstr &lastMI) {
+      insertROPChain(chain, MBB, lastMI, chainID++, param);
+    };
+    ROPChainMerger merger(engine, insertChain);
+
     for (auto it = MBB.begin(), it_end = MBB.end(); it != it_end; ++it) {
       MachineInstr &MI = *it;
 
@@ -922,16 +1021,7 @@ void ROPfuscatorCore::obfuscateFunction(MachineFunction &MF) {
       //   adc ecx, edx  # true,  true
       //   adc ecx, 1    # true,  true
 
-      ROPChain       result;
-      ROPChainStatus status =
-          ROPEngine(*BA).ropify(MI, MIScratchRegs, shouldFlagSaved, result);
-
-      bool isJump = result.hasConditionalJump || result.hasUnconditionalJump;
-      if (isJump && result.flagSave == FlagSaveMode::SAVE_AFTER_EXEC) {
-        // when flag should be saved after resume, jmp instruction cannot be
-        // ROPified
-        status = ROPChainStatus::ERR_UNSUPPORTED;
-      }
+      ROPChainStatus status = merger.add(MI, MIScratchRegs, shouldFlagSaved);
 
       instr_stat[MI.getOpcode()][status]++;
 
@@ -940,37 +1030,18 @@ void ROPfuscatorCore::obfuscateFunction(MachineFunction &MF) {
                         dbg_fmt("{}\t✗ Unsupported instruction{}\n",
                                 COLOR_RED,
                                 COLOR_RESET));
-
-        if (chain0.valid()) {
-          insertROPChain(chain0, MBB, *prevMI, chainID++, param);
-          chain0.clear();
-        }
         continue;
       }
       // add current instruction in the To-Delete list
       instrToDelete.push_back(&MI);
 
-      if (chain0.canMerge(result)) {
-        chain0.merge(result);
-      } else {
-        if (chain0.valid()) {
-          insertROPChain(chain0, MBB, *prevMI, chainID++, param);
-          chain0.clear();
-        }
-        chain0 = std::move(result);
-      }
-      prevMI = &MI;
-
       DEBUG_WITH_TYPE(PROCESSED_INSTR,
                       dbg_fmt("{}\t✓ Replaced{}\n", COLOR_GREEN, COLOR_RESET));
 
       obfuscated++;
     }
 
-    if (chain0.valid()) {
-      insertROPChain(chain0, MBB, *prevMI, chainID++, param);
-      chain0.clear();
-    }
+    merger.flush();
 
     // delete old vanilla instructions only after we finished to iterate through
     // the basic block
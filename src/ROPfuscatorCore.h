@@ -11,10 +11,13 @@
 
 #define ROPFUSCATOR_OBFUSCATION_STATISTICS_FILE_HEAD                           \
   "ropfuscator_obfuscation_stats"
+#include <future>
 #include <map>
+#include <unordered_set>
 
 #include "ChainElem.h"
 #include "ROPfuscatorConfig.h"
+#include "llvm/Support/Error.h"
 
 // forward declaration
 namespace llvm {
@@ -47,6 +50,10 @@ private:
   ChainElementSelector     *branchTargetSelector;
   std::string               sourceFileName;
 
+  // pendingAnalysis - the library analysis running in background (see
+  // BinaryAutopsy::startAnalysis())
+  std::future<llvm::Expected<BinaryAutopsy *>> pendingAnalysis;
+
   struct ROPChainStatEntry;
   std::map<unsigned, ROPChainStatEntry> instr_stat;
   size_t                                total_chain_elems         = 0;
@@ -56,6 +63,14 @@ private:
   size_t                                total_func_count          = 0;
   size_t                                curr_func_count           = 0;
 
+  // usedGadgetLines, usedGadgetPages - cache lines and pages of the gadget
+  // addresses used so far in the current function
+  std::unordered_set<uint64_t> usedGadgetLines, usedGadgetPages;
+
+  // anchorSymbols - for each gadget library, the symbols used so far in the
+  // module as anchors of the gadget addresses
+  std::vector<std::vector<const Symbol *>> anchorSymbols;
+
   // Randomly reduces the number of specific type(s) of chain elements to the
   // specified percentage. The indices of the chain elements are saved into
   // outVector.
@@ -64,6 +79,19 @@ private:
                                        std::vector<ChainElem::Type> elemTypes,
                                        std::vector<unsigned>       &outVector);
 
+  // selectGadgetAddress - picks a random address of the gadget. As set by
+  // param.gadgetAddressLocality, the addresses on cache lines or pages that
+  // the function already uses may be preferred, to reduce iTLB and
+  // instruction cache misses when the chains run.
+  uint64_t selectGadgetAddress(const Microgadget          &gadget,
+                               const ObfuscationParameter &param);
+
+  // getAnchorSymbol - returns a random symbol of the gadget library to
+  // reference a gadget. Once the module uses as many symbols of the library as
+  // allowed by config.globalConfig.anchorSymbolsLimit, only those are chosen,
+  // to bound the number of symbols the dynamic linker has to resolve.
+  const Symbol *getAnchorSymbol(unsigned library);
+
   void insertROPChain(ROPChain                   &chain,
                       llvm::MachineBasicBlock    &MBB,
                       llvm::MachineInstr         &MI,
@@ -14,9 +14,15 @@ struct Section {
   // Length - Size of the section.
   uint64_t Address, Length;
 
+  // Library - index of the gadget library the section belongs to
+  unsigned Library;
+
   // Constructor
-  Section(std::string label, uint64_t address, uint64_t length)
-      : Label(label), Address(address), Length(length) {}
+  Section(std::string label,
+          uint64_t    address,
+          uint64_t    length,
+          unsigned    library = 0)
+      : Label(label), Address(address), Length(length), Library(library) {}
 };
 
 } // namespace ropf
@@ -22,11 +22,19 @@ struct Symbol {
   // a gadget in memory we'll use this as base address.
   uint64_t Address;
 
+  // Library - index of the gadget library defining the symbol. Gadgets must
+  // be referenced through a symbol of their own library.
+  unsigned Library;
+
   mutable bool isUsed;
 
   // Constructor
-  Symbol(std::string label, std::string version, uint64_t address)
-      : Label(label), Version(version), Address(address), isUsed(false) {}
+  Symbol(std::string label,
+         std::string version,
+         uint64_t    address,
+         unsigned    library = 0)
+      : Label(label), Version(version), Address(address), Library(library),
+        isUsed(false) {}
 
   // SymVerDirective - it is just an inline asm directive we need to place to
   // force the static linker to pick the right symbol version during the
@@ -1,26 +1,205 @@
 #include "Utils.h"
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
 #include <string>
 #include <system_error>
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Path.h"
 
-std::string findLibraryPath(const std::string &libfile) {
+namespace {
+
+const char LD_SO_CACHE[] = "/etc/ld.so.cache";
+
+// old format ("ld.so-1.7.0"): header, entries, string table
+const char   LD_SO_CACHE_MAGIC_OLD[] = "ld.so-1.7.0";
+const size_t LD_SO_CACHE_HEADER_OLD  = 16;
+const size_t LD_SO_CACHE_ENTRY_OLD   = 12;
+// new format ("glibc-ld.so.cache1.1"): header, entries, string table. String
+// offsets are relative to the beginning of the header.
+const char   LD_SO_CACHE_MAGIC_NEW[] = "glibc-ld.so.cache1.1";
+const size_t LD_SO_CACHE_HEADER_NEW  = 48;
+const size_t LD_SO_CACHE_ENTRY_NEW   = 24;
+
+// entry flags: only 32-bit libc6 libraries are of interest, i.e. the ones
+// without architecture-specific bits (x86-64, x32, ...)
+const int32_t LD_SO_CACHE_TYPE_MASK = 0x00ff;
+const int32_t LD_SO_CACHE_ARCH_MASK = 0xff00;
+const int32_t LD_SO_CACHE_ELF_LIBC6 = 0x0003;
+
+uint32_t readU32(llvm::StringRef data, size_t offset) {
+  uint32_t value;
+  memcpy(&value, data.data() + offset, sizeof(value));
+  return value;
+}
+
+uint64_t readU64(llvm::StringRef data, size_t offset) {
+  uint64_t value;
+  memcpy(&value, data.data() + offset, sizeof(value));
+  return value;
+}
+
+// readCacheString - reads a NUL-terminated string at the given offset, or
+// returns an empty string if it is out of bounds.
+llvm::StringRef readCacheString(llvm::StringRef data, size_t offset) {
+  if (offset >= data.size()) {
+    return "";
+  }
+  llvm::StringRef str = data.substr(offset);
+  size_t          end = str.find('\0');
+  return end == llvm::StringRef::npos ? "" : str.substr(0, end);
+}
+
+bool isI386Entry(int32_t flags) {
+  return (flags & LD_SO_CACHE_TYPE_MASK) == LD_SO_CACHE_ELF_LIBC6 &&
+         (flags & LD_SO_CACHE_ARCH_MASK) == 0;
+}
+
+// parseNewCache - parses the entries of a cache in the new format, starting
+// at offset base. Returns false if the data is not in the new format.
+bool parseNewCache(llvm::StringRef               data,
+                   size_t                        base,
+                   llvm::StringMap<std::string> &libs) {
+  llvm::StringRef cache = data.substr(base);
+  if (cache.size() < LD_SO_CACHE_HEADER_NEW ||
+      !cache.startswith(LD_SO_CACHE_MAGIC_NEW)) {
+    return false;
+  }
+
+  uint64_t nlibs = readU32(cache, 20);
+  if (nlibs > (cache.size() - LD_SO_CACHE_HEADER_NEW) / LD_SO_CACHE_ENTRY_NEW) {
+    return false;
+  }
+
+  for (uint64_t i = 0; i < nlibs; i++) {
+    size_t  entry = LD_SO_CACHE_HEADER_NEW + i * LD_SO_CACHE_ENTRY_NEW;
+    int32_t flags = static_cast<int32_t>(readU32(cache, entry));
+
+    // entries with hwcap bits refer to optimised variants in subdirectories
+    if (!isI386Entry(flags) || readU64(cache, entry + 16) != 0) {
+      continue;
+    }
+
+    llvm::StringRef key   = readCacheString(cache, readU32(cache, entry + 4));
+    llvm::StringRef value = readCacheString(cache, readU32(cache, entry + 8));
+    if (!key.empty() && !value.empty()) {
+      // the first entry has the highest priority
+      libs.try_emplace(key, value.str());
+    }
+  }
+
+  return true;
+}
+
+// parseOldCache - parses the entries of a cache in the old format. Returns
+// false if the data is not in the old format.
+bool parseOldCache(llvm::StringRef data, llvm::StringMap<std::string> &libs) {
+  if (data.size() < LD_SO_CACHE_HEADER_OLD ||
+      !data.startswith(LD_SO_CACHE_MAGIC_OLD)) {
+    return false;
+  }
+
+  uint64_t nlibs = readU32(data, 12);
+  if (nlibs > (data.size() - LD_SO_CACHE_HEADER_OLD) / LD_SO_CACHE_ENTRY_OLD) {
+    return false;
+  }
+
+  // the old format is usually followed by a cache in the new format, which
+  // is preferred since it is the one actually used by the dynamic loader
+  size_t strings = LD_SO_CACHE_HEADER_OLD + nlibs * LD_SO_CACHE_ENTRY_OLD;
+  size_t aligned = (strings + 7) & ~static_cast<size_t>(7);
+  if (parseNewCache(data, aligned, libs)) {
+    return true;
+  }
+
+  llvm::StringRef stringTable = data.substr(strings);
+  for (uint64_t i = 0; i < nlibs; i++) {
+    size_t  entry = LD_SO_CACHE_HEADER_OLD + i * LD_SO_CACHE_ENTRY_OLD;
+    int32_t flags = static_cast<int32_t>(readU32(data, entry));
+
+    if (!isI386Entry(flags)) {
+      continue;
+    }
+
+    llvm::StringRef key =
+        readCacheString(stringTable, readU32(data, entry + 4));
+    llvm::StringRef value =
+        readCacheString(stringTable, readU32(data, entry + 8));
+    if (!key.empty() && !value.empty()) {
+      libs.try_emplace(key, value.str());
+    }
+  }
+
+  return true;
+}
+
+// getLdSoCache - returns the 32-bit libraries listed in the dynamic loader
+// cache, mapping each soname to its path.
+const llvm::StringMap<std::string> &getLdSoCache() {
+  static llvm::StringMap<std::string> libs;
+  static std::once_flag               parsed;
+
+  std::call_once(parsed, [] {
+    auto buffer = llvm::MemoryBuffer::getFile(LD_SO_CACHE,
+                                              /* FileSize */ -1,
+                                              /* RequiresNullTerminator */
+                                              false);
+    if (!buffer) {
+      return;
+    }
+
+    llvm::StringRef data = (*buffer)->getBuffer();
+    if (!parseNewCache(data, 0, libs)) {
+      parseOldCache(data, libs);
+    }
+  });
+
+  return libs;
+}
+
+bool isRegularFile(const llvm::Twine &path) {
+  llvm::sys::fs::file_status st;
+  return !llvm::sys::fs::status(path, st) &&
+         st.type() == llvm::sys::fs::file_type::regular_file;
+}
+
+std::string resolveLibraryPath(const std::string &libfile) {
+  auto &ldSoCache = getLdSoCache();
+  auto  it        = ldSoCache.find(libfile);
+  if (it != ldSoCache.end() && isRegularFile(it->second)) {
+    return it->second;
+  }
+
+  // fallback: look for the library in the well-known folders
   for (auto &dir : SYSTEM_LIB_FOLDERS) {
-    // searching for libc in regular files only
-    std::error_code ec;
-
-    for (auto dir_it  = llvm::sys::fs::directory_iterator(dir, ec),
-              dir_end = llvm::sys::fs::directory_iterator();
-         !ec && dir_it != dir_end;
-         dir_it.increment(ec)) {
-      auto st = dir_it->status();
-      if (st && st->type() == llvm::sys::fs::file_type::regular_file &&
-          llvm::sys::path::filename(dir_it->path()) == libfile) {
-        std::string libraryPath = dir_it->path();
-        return libraryPath;
-      }
+    llvm::SmallString<128> path(dir);
+    llvm::sys::path::append(path, libfile);
+    if (isRegularFile(path)) {
+      return path.str().str();
     }
   }
 
   return "";
 }
+
+} // namespace
+
+std::string findLibraryPath(const std::string &libfile) {
+  // results are memoized, since the same libraries are looked up for every
+  // obfuscated module
+  static std::map<std::string, std::string> resolved;
+  static std::mutex                         resolvedMutex;
+
+  std::lock_guard<std::mutex> lock(resolvedMutex);
+
+  auto it = resolved.find(libfile);
+  if (it == resolved.end()) {
+    it = resolved.emplace(libfile, resolveLibraryPath(libfile)).first;
+  }
+  return it->second;
+}
@@ -1,12 +1,53 @@
 #include "XchgGraph.h"
 #include "Debug.h"
-#include <limits.h>
-#include <list>
+#include <algorithm>
+#include <climits>
 
 using namespace std;
 
 namespace ropf {
 
+unsigned rankPermutation(const uint8_t *perm, int n) {
+  unsigned rank = 0;
+
+  for (int i = 0; i < n; i++) {
+    unsigned smaller = 0;
+
+    for (int j = i + 1; j < n; j++) {
+      if (perm[j] < perm[i]) {
+        smaller++;
+      }
+    }
+
+    rank = rank * (n - i) + smaller;
+  }
+
+  return rank;
+}
+
+void unrankPermutation(unsigned rank, int n, uint8_t *perm) {
+  uint8_t digits[MAX_SWAP_NODES];
+  bool    used[MAX_SWAP_NODES] = {false};
+
+  for (int i = n - 1; i >= 0; i--) {
+    digits[i] = rank % (n - i);
+    rank /= n - i;
+  }
+
+  for (int i = 0; i < n; i++) {
+    int k = 0;
+
+    for (int left = digits[i]; used[k] || left > 0; k++) {
+      if (!used[k]) {
+        left--;
+      }
+    }
+
+    used[k] = true;
+    perm[i] = k;
+  }
+}
+
 XchgState::XchgState() {
   // sets up each logical register in the proper physical register.
   for (int i = 0; i < N_REGS; i++) {
@@ -18,75 +59,174 @@ void XchgState::exchange(int reg1, int reg2) {
   std::swap(PhysReg[reg1], PhysReg[reg2]);
 }
 
+bool XchgState::hasExchanges() const {
+  for (int i = 0; i < N_REGS; i++) {
+    if (PhysReg[i] != i) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+XchgGraph::XchgGraph() { buildPaths(); }
+
 void XchgGraph::addEdge(int reg1, int reg2) {
   adj[reg1].push_back(reg2);
   adj[reg2].push_back(reg1);
+  edges.emplace_back(reg1, reg2);
+  buildPaths();
 }
 
-bool XchgGraph::checkPath(int  src,
-                          int  dest,
-                          int  pred[],
-                          int  dist[],
-                          bool visited[]) const {
-  list<int> queue;
-
-  for (int i = 0; i < N_REGS; i++) {
-    visited[i] = false;
-    dist[i]    = INT_MAX;
-    pred[i]    = -1;
+void XchgGraph::finalize() {
+  if (swapNodes.size() <= MAX_SWAP_NODES) {
+    buildSwapDistance();
   }
+}
+
+void XchgGraph::buildPaths() {
+  short queue[N_REGS];
+  short numComponents = 0;
+
+  swapNodes.clear();
+  swapEdges.clear();
+  swapDistance.clear();
 
-  if (src == dest) {
-    return true;
+  for (int src = 0; src < N_REGS; src++) {
+    component[src] = -1;
+    if (!adj[src].empty()) {
+      swapNodes.push_back(src);
+    }
+    for (int dest = 0; dest < N_REGS; dest++) {
+      pathPred[src][dest] = -1;
+    }
   }
 
-  visited[src] = true;
-  dist[src]    = 0;
-  queue.push_back(src);
+  for (int src = 0; src < N_REGS; src++) {
+    if (adj[src].empty()) {
+      continue;
+    }
+
+    // the nodes reached from the first node of each component form it
+    bool newComponent = component[src] == -1;
+    if (newComponent) {
+      component[src] = numComponents++;
+    }
 
-  while (!queue.empty()) {
-    int u = queue.front();
+    // Breadth First Search from src, recording the predecessors
+    short *pred  = pathPred[src];
+    int    first = 0, last = 0;
 
-    queue.pop_front();
+    queue[last++] = src;
+    pred[src]     = src;
 
-    for (unsigned int i = 0; i < adj[u].size(); i++) {
-      if (!visited[adj[u][i]]) {
-        visited[adj[u][i]] = true;
-        dist[adj[u][i]]    = dist[u] + 1;
-        pred[adj[u][i]]    = u;
-        queue.push_back(adj[u][i]);
+    while (first < last) {
+      int u = queue[first++];
 
-        if (adj[u][i] == dest) {
-          return true;
+      for (int v : adj[u]) {
+        if (pred[v] == -1) {
+          pred[v]       = u;
+          queue[last++] = v;
+          if (newComponent) {
+            component[v] = component[src];
+          }
         }
       }
     }
+
+    // the source has no predecessor
+    pred[src] = -1;
   }
 
-  return false;
+  for (auto &edge : edges) {
+    int a = lower_bound(swapNodes.begin(), swapNodes.end(), edge.first) -
+            swapNodes.begin();
+    int b = lower_bound(swapNodes.begin(), swapNodes.end(), edge.second) -
+            swapNodes.begin();
+
+    auto swapEdge = make_pair(min(a, b), max(a, b));
+    if (a != b && find(swapEdges.begin(), swapEdges.end(), swapEdge) ==
+                      swapEdges.end()) {
+      swapEdges.push_back(swapEdge);
+    }
+  }
+}
+
+void XchgGraph::buildSwapDistance() {
+  int              n           = swapNodes.size();
+  unsigned         numPerms    = 1;
+  vector<unsigned> queue;
+  uint8_t          perm[MAX_SWAP_NODES];
+
+  for (int i = 2; i <= n; i++) {
+    numPerms *= i;
+  }
+
+  // every exchange is its own inverse, so the distance from the identity to a
+  // permutation is also the distance back from it
+  swapDistance.assign(numPerms, UINT8_MAX);
+  swapDistance[0] = 0;
+  queue.reserve(numPerms);
+  queue.push_back(0);
+
+  for (size_t first = 0; first < queue.size(); first++) {
+    unsigned rank = queue[first];
+
+    unrankPermutation(rank, n, perm);
+
+    for (auto &edge : swapEdges) {
+      std::swap(perm[edge.first], perm[edge.second]);
+
+      unsigned next = rankPermutation(perm, n);
+      if (swapDistance[next] == UINT8_MAX) {
+        swapDistance[next] = swapDistance[rank] + 1;
+        queue.push_back(next);
+      }
+
+      std::swap(perm[edge.first], perm[edge.second]);
+    }
+  }
+}
+
+bool XchgGraph::checkPath(int src, int dest) const {
+  return src == dest ||
+         (component[src] != -1 && component[src] == component[dest]);
+}
+
+int XchgGraph::getDistance(int src, int dest) const {
+  if (!checkPath(src, dest)) {
+    return -1;
+  }
+
+  int distance = 0;
+
+  for (int crawl = dest; crawl != src; crawl = pathPred[src][crawl]) {
+    distance++;
+  }
+
+  return distance;
 }
 
 XchgPath XchgGraph::getPath(XchgState &state, int src, int dest) const {
   XchgPath    result;
   vector<int> path;
-  int         pred[N_REGS], dist[N_REGS], crawl;
-  bool        visited[N_REGS];
+  int         crawl;
 
   // dbg_fmt("[getPath] Trying to exchange {} with {}\n", src, dest);
   // src = state.searchLogicalReg(src);
   // dest = state.searchLogicalReg(dest);
   // dbg_fmt("[getPath] Exchanging {} with {}\n", src, dest);
 
-  if (!checkPath(src, dest, pred, dist, visited)) {
+  if (!checkPath(src, dest)) {
     return result;
   }
 
   crawl = dest;
   path.push_back(crawl);
 
-  while (pred[crawl] != -1) {
-    path.push_back(pred[crawl]);
-    crawl = pred[crawl];
+  while (crawl != src) {
+    crawl = pathPred[src][crawl];
+    path.push_back(crawl);
   }
 
   for (int i = path.size() - 1, j = path.size() - 2; j >= 0; i--, j--) {
@@ -130,31 +270,56 @@ XchgPath XchgGraph::fixPath(XchgState &state, XchgPath path) const {
 
 XchgPath XchgGraph::reorderRegisters(XchgState &state) const {
   XchgPath result;
-
-  result.insert(result.end(),
-                state.xchgStack.rbegin(),
-                state.xchgStack.rend()); //, tmp;
+  int      n = swapNodes.size();
+  uint8_t  perm[MAX_SWAP_NODES];
+  unsigned rank = UINT_MAX;
 
   DEBUG_WITH_TYPE(XCHG_CHAIN, dbg_fmt("Exchanging back...\n"));
 
-  for (int i = 0; i < N_REGS; i++) {
-    if (state.PhysReg[i] != i) {
-      // // finds the real location of the two registers
-      // src = searchLogicalReg(src, src);
-      // dest = searchLogicalReg(dest, dest);
+  // perm[i] is the index of the logical register held by swapNodes[i]
+  if (!swapDistance.empty() && !state.xchgStack.empty()) {
+    for (int i = 0; i < n; i++) {
+      perm[i] = lower_bound(swapNodes.begin(),
+                            swapNodes.end(),
+                            state.PhysReg[swapNodes[i]]) -
+                swapNodes.begin();
+    }
 
-      short int PReg = state.searchLogicalReg(i, i);
+    rank = rankPermutation(perm, n);
+  }
 
-      DEBUG_WITH_TYPE(
-          XCHG_CHAIN,
-          dbg_fmt("Exchanging logical register {} with {}\n", i, PReg));
+  if (rank != UINT_MAX && swapDistance[rank] != UINT8_MAX) {
+    // at each step, take any exchange that gets one step closer to the
+    // identity
+    while (swapDistance[rank] > 0) {
+      for (auto &edge : swapEdges) {
+        std::swap(perm[edge.first], perm[edge.second]);
+
+        unsigned next = rankPermutation(perm, n);
+        if (swapDistance[next] + 1 == swapDistance[rank]) {
+          result.emplace_back(swapNodes[edge.first], swapNodes[edge.second]);
+          rank = next;
+          break;
+        }
 
-      getPath(state, PReg, i);
-      // result.insert(result.end(), tmp.begin(), tmp.end());
-      // printAll();
+        std::swap(perm[edge.first], perm[edge.second]);
+      }
     }
+  } else {
+    // too many registers to search, or the graph has not been finalized:
+    // replay all the exchanges backwards
+    result.insert(result.end(),
+                  state.xchgStack.rbegin(),
+                  state.xchgStack.rend());
   }
-  state.xchgStack.clear();
+
+  DEBUG_WITH_TYPE(XCHG_CHAIN,
+                  dbg_fmt("{} exchanges instead of {}\n",
+                          result.size(),
+                          state.xchgStack.size()));
+
+  // every logical register is back in its physical register
+  state = XchgState();
 
   return result;
 }
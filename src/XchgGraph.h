@@ -27,6 +27,7 @@
 #ifndef XCHGGRAPH_H
 #define XCHGGRAPH_H
 
+#include <cstdint>
 #include <utility>
 #include <vector>
 
@@ -34,8 +35,19 @@ namespace ropf {
 
 #define N_REGS 100
 
+// MAX_SWAP_NODES - maximum number of exchangeable registers for which the
+// shortest sequence of exchanges restoring them is searched (8! permutations)
+#define MAX_SWAP_NODES 8
+
 typedef std::vector<std::pair<int, int>> XchgPath;
 
+// rankPermutation - returns the position of perm among the permutations of n
+// elements in lexicographic order (the identity has rank 0).
+unsigned rankPermutation(const uint8_t *perm, int n);
+
+// unrankPermutation - inverse of rankPermutation().
+void unrankPermutation(unsigned rank, int n, uint8_t *perm);
+
 class XchgState {
   XchgPath xchgStack;
 
@@ -58,6 +70,10 @@ public:
 
   void exchange(int reg1, int reg2);
 
+  // hasExchanges - tells whether any logical register is not held in its own
+  // physical register.
+  bool hasExchanges() const;
+
   void printAll() const;
 };
 
@@ -65,6 +81,38 @@ class XchgGraph {
   // adj[] - adjacency list
   std::vector<int> adj[N_REGS];
 
+  // edges - every edge in insertion order (adjacency lists can be rebuilt
+  // from it)
+  XchgPath edges;
+
+  // component - connected component of each register, or -1 if the register
+  // has no edges
+  short component[N_REGS];
+
+  // pathPred - pathPred[src][dest] is the register preceding dest on the
+  // path from src found by a breadth first search, or -1 if there is none
+  short pathPred[N_REGS][N_REGS];
+
+  // swapNodes - the registers with at least one edge, in ascending order
+  std::vector<int> swapNodes;
+
+  // swapEdges - the distinct edges, as pairs of indexes into swapNodes
+  std::vector<std::pair<int, int>> swapEdges;
+
+  // swapDistance - minimum number of exchanges needed to bring back each
+  // permutation of swapNodes to the identity, indexed by the rank of the
+  // permutation (UINT8_MAX if it is not possible). It is filled by finalize().
+  std::vector<uint8_t> swapDistance;
+
+  // buildPaths - fills component, pathPred, swapNodes and swapEdges from the
+  // adjacency lists. The graph only has a few nodes and is built once, so
+  // everything is computed again whenever an edge is added.
+  void buildPaths();
+
+  // buildSwapDistance - fills swapDistance with a breadth first search over
+  // the permutations of swapNodes, starting from the identity.
+  void buildSwapDistance();
+
   // fixPath - given a straight path between the two registers to exchange, this
   // function elaborates the full path in order to avoid having other
   // intermediate registers scrambled through the whole path.
@@ -79,15 +127,25 @@ class XchgGraph {
   XchgPath fixPath(XchgState &state, XchgPath path) const;
 
 public:
+  XchgGraph();
+
   // addEdge - adds a new edge between Op0 and Op1.
   void addEdge(int reg1, int reg2);
 
-  // checkPath - Breadth First Search algorithm implementation. It simply
-  // returns tells whether two nodes are mutually reachable. If the two optional
-  // output parameters are given, it is possible to compute the actual path
-  // (this is done by getPath()).
-  bool
-  checkPath(int src, int dest, int pred[], int dist[], bool visited[]) const;
+  // finalize - precomputes the shortest exchange sequences used by
+  // reorderRegisters(). It has to be called once all the edges have been
+  // added; until then, reorderRegisters() replays the exchanges backwards.
+  void finalize();
+
+  const XchgPath &getEdges() const { return edges; }
+
+  // checkPath - tells whether two nodes are mutually reachable, in constant
+  // time.
+  bool checkPath(int src, int dest) const;
+
+  // getDistance - returns the number of edges of the shortest path between
+  // src and dest, or -1 if they are not mutually reachable.
+  int getDistance(int src, int dest) const;
 
   // getPath - returns the entire path from src to dest, edge by edge. The path
   // is specified as a vector of pairs, which one of them contains source and
@@ -96,7 +154,8 @@ public:
 
   // reorderRegisters - exchanges back all the logical registers, so that each
   // of them is in the correct physical register (e.g., PhysReg[X86_REG_EAX] =
-  // X86_REG_EAX). Returns the proper exchange path.
+  // X86_REG_EAX). Returns the proper exchange path, which is the shortest one
+  // allowed by the graph if it has at most MAX_SWAP_NODES registers.
   XchgPath reorderRegisters(XchgState &state) const;
 };
 
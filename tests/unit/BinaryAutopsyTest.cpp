@@ -0,0 +1,93 @@
+// ==============================================================================
+//   BINARY AUTOPSY TESTS
+//   part of the ROPfuscator project
+// ==============================================================================
+
+#include "BinAutopsy.h"
+#include "TestLibrary.h"
+#include "gtest/gtest.h"
+
+using namespace ropf;
+using namespace ropf::test;
+
+namespace {
+
+// ret - a library with a single gadget
+const uint8_t RET[] = {0x58, 0xc3}; // pop eax; ret
+
+const char MISSING_LIBRARY[] = "/nonexistent/libropf-test.so";
+
+class BinaryAutopsyTest : public ::testing::Test {
+protected:
+  TestTarget target;
+
+  // getError - returns the message of the error of the analysis of config,
+  // or an empty string if it succeeds
+  std::string getError(const GlobalConfig &config) {
+    auto BA = target.create(config);
+    return BA ? "" : toString(BA.takeError());
+  }
+};
+
+} // namespace
+
+TEST_F(BinaryAutopsyTest, AnalysesValidLibrary) {
+  TestLibrary  library(RET);
+  GlobalConfig config = testConfig(library);
+
+  EXPECT_EQ(getError(config), "");
+}
+
+TEST_F(BinaryAutopsyTest, ReturnsErrorForMissingLibrary) {
+  GlobalConfig config;
+  config.libraryPath        = MISSING_LIBRARY;
+  config.gadgetCacheEnabled = false;
+
+  EXPECT_NE(getError(config).find("does not exist or is invalid"),
+            std::string::npos);
+}
+
+TEST_F(BinaryAutopsyTest, ReturnsErrorForInvalidLibrary) {
+  TestLibrary  library(RET);
+  GlobalConfig config = testConfig(library);
+  {
+    std::error_code      ec;
+    llvm::raw_fd_ostream os(library.getPath(), ec);
+    os << "not an ELF file";
+  }
+
+  EXPECT_NE(getError(config).find("ELF file error"), std::string::npos);
+}
+
+TEST_F(BinaryAutopsyTest, ReturnsErrorForMissingLinkedLibrary) {
+  TestLibrary  library(RET);
+  GlobalConfig config    = testConfig(library);
+  config.linkedLibraries = {MISSING_LIBRARY};
+
+  EXPECT_NE(getError(config).find("does not exist or is invalid"),
+            std::string::npos);
+}
+
+TEST_F(BinaryAutopsyTest, ReturnsErrorForSHA1Mismatch) {
+  TestLibrary  library(RET);
+  GlobalConfig config = testConfig(library);
+  config.librarySHA1  = std::string(40, '0');
+
+  EXPECT_NE(getError(config).find("SHA1 mismatch"), std::string::npos);
+}
+
+TEST_F(BinaryAutopsyTest, ReportsBackgroundErrorOnWait) {
+  GlobalConfig config;
+  config.libraryPath        = MISSING_LIBRARY;
+  config.gadgetCacheEnabled = false;
+
+  // the error is reported, and the compiler exits, on the waiting thread
+  EXPECT_EXIT(
+      {
+        auto pending =
+            BinaryAutopsy::startAnalysis(config, "i386-unknown-linux-gnu");
+        BinaryAutopsy::waitForAnalysis(pending);
+      },
+      ::testing::ExitedWithCode(1),
+      "does not exist or is invalid");
+}
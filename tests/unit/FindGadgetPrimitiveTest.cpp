@@ -0,0 +1,148 @@
+// ==============================================================================
+//   GADGET PRIMITIVE SEARCH TESTS
+//   part of the ROPfuscator project
+// ==============================================================================
+
+#include "BinAutopsy.h"
+#include "TestLibrary.h"
+#include "gtest/gtest.h"
+#include <tuple>
+
+using namespace ropf;
+using namespace ropf::test;
+using llvm::X86::EAX;
+using llvm::X86::ECX;
+using llvm::X86::EDI;
+using llvm::X86::EDX;
+using llvm::X86::ESI;
+
+namespace {
+
+// ChainGadget - type and operands of a gadget of a chain
+typedef std::tuple<GadgetType, unsigned int, unsigned int> ChainGadget;
+
+std::vector<ChainGadget> getChainGadgets(const ROPChain &chain) {
+  std::vector<ChainGadget> result;
+
+  for (auto &elem : chain) {
+    EXPECT_EQ(elem.type, ChainElem::Type::GADGET);
+    if (elem.type == ChainElem::Type::GADGET) {
+      auto *gadget = elem.microgadget;
+      result.emplace_back(gadget->Type, gadget->reg1, gadget->reg2);
+    }
+  }
+  return result;
+}
+
+// add ecx, esi needs the first operand exchanged and the second one copied
+const uint8_t EXCHANGE_AND_COPY[] = {
+    0x91, 0xc3,       // xchg eax, ecx; ret
+    0x89, 0xd6, 0xc3, // mov esi, edx; ret
+    0x01, 0xf1, 0xc3, // add ecx, esi; ret
+};
+
+// add edi, edx needs the first operand copied in and out
+const uint8_t COPY_IN_OUT[] = {
+    0x89, 0xc7, 0xc3, // mov edi, eax; ret
+    0x01, 0xd7, 0xc3, // add edi, edx; ret
+    0x89, 0xf8, 0xc3, // mov eax, edi; ret
+};
+
+// add ecx, edx can be reached with one exchange, add esi, edx with two copies
+const uint8_t EXCHANGE_OR_COPY[] = {
+    0x89, 0xc6, 0xc3, // mov esi, eax; ret
+    0x01, 0xd6, 0xc3, // add esi, edx; ret
+    0x89, 0xf0, 0xc3, // mov eax, esi; ret
+    0x91, 0xc3,       // xchg eax, ecx; ret
+    0x01, 0xd1, 0xc3, // add ecx, edx; ret
+};
+
+class FindGadgetPrimitiveTest : public ::testing::Test {
+protected:
+  TestTarget target;
+};
+
+} // namespace
+
+TEST_F(FindGadgetPrimitiveTest, ExchangesAndCopiesOperands) {
+  TestLibrary  library(EXCHANGE_AND_COPY);
+  GlobalConfig config = testConfig(library);
+  auto         BA     = target.analyse(config);
+  XchgState    state;
+
+  ROPChain chain =
+      BA->findGadgetPrimitive(state, GadgetType::ADD, EAX, EDX, {ESI});
+
+  std::vector<ChainGadget> expected = {
+      ChainGadget(GadgetType::XCHG, EAX, ECX),
+      ChainGadget(GadgetType::COPY, ESI, EDX),
+      ChainGadget(GadgetType::ADD, ECX, ESI),
+  };
+  EXPECT_EQ(getChainGadgets(chain), expected);
+
+  // the first operand is left in ecx until the exchange is undone
+  EXPECT_EQ(BA->getEffectiveReg(state, EAX), ECX);
+  EXPECT_EQ(BA->getEffectiveReg(state, ECX), EAX);
+  EXPECT_EQ(BA->getEffectiveReg(state, EDX), EDX);
+  EXPECT_EQ(BA->getEffectiveReg(state, ESI), ESI);
+
+  ROPChain undo = BA->undoXchgs(state);
+
+  expected = {ChainGadget(GadgetType::XCHG, EAX, ECX)};
+  EXPECT_EQ(getChainGadgets(undo), expected);
+  EXPECT_FALSE(state.hasExchanges());
+  EXPECT_EQ(BA->getEffectiveReg(state, EAX), EAX);
+  EXPECT_EQ(BA->getEffectiveReg(state, ECX), ECX);
+}
+
+TEST_F(FindGadgetPrimitiveTest, CopiesNeedFreeRegisters) {
+  TestLibrary  library(EXCHANGE_AND_COPY);
+  GlobalConfig config = testConfig(library);
+  auto         BA     = target.analyse(config);
+
+  for (auto &freeRegs : std::vector<std::vector<unsigned int>>{{}, {EDI}}) {
+    XchgState state;
+
+    EXPECT_EQ(
+        BA->findGadgetPrimitive(state, GadgetType::ADD, EAX, EDX, freeRegs)
+            .size(),
+        0u);
+    EXPECT_FALSE(state.hasExchanges());
+  }
+}
+
+TEST_F(FindGadgetPrimitiveTest, CopiesFirstOperandInAndOut) {
+  TestLibrary  library(COPY_IN_OUT);
+  GlobalConfig config = testConfig(library);
+  auto         BA     = target.analyse(config);
+  XchgState    state;
+
+  ROPChain chain =
+      BA->findGadgetPrimitive(state, GadgetType::ADD, EAX, EDX, {EDI});
+
+  std::vector<ChainGadget> expected = {
+      ChainGadget(GadgetType::COPY, EDI, EAX),
+      ChainGadget(GadgetType::ADD, EDI, EDX),
+      ChainGadget(GadgetType::COPY, EAX, EDI),
+  };
+  EXPECT_EQ(getChainGadgets(chain), expected);
+  EXPECT_FALSE(state.hasExchanges());
+  EXPECT_EQ(BA->undoXchgs(state).size(), 0u);
+}
+
+TEST_F(FindGadgetPrimitiveTest, BuildsCheapestTransfer) {
+  TestLibrary  library(EXCHANGE_OR_COPY);
+  GlobalConfig config = testConfig(library);
+  auto         BA     = target.analyse(config);
+  XchgState    state;
+
+  ROPChain chain =
+      BA->findGadgetPrimitive(state, GadgetType::ADD, EAX, EDX, {ESI});
+
+  std::vector<ChainGadget> expected = {
+      ChainGadget(GadgetType::XCHG, EAX, ECX),
+      ChainGadget(GadgetType::ADD, ECX, EDX),
+  };
+  EXPECT_EQ(getChainGadgets(chain), expected);
+  EXPECT_EQ(BA->getEffectiveReg(state, EAX), ECX);
+}
@@ -0,0 +1,395 @@
+// ==============================================================================
+//   GADGET CACHE TESTS
+//   part of the ROPfuscator project
+// ==============================================================================
+
+#include "BinAutopsy.h"
+#include "GadgetCache.h"
+#include "TestLibrary.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "gtest/gtest.h"
+#include <random>
+
+using namespace llvm;
+using namespace ropf;
+using namespace ropf::test;
+
+namespace {
+
+// GADGETS - a library with gadgets of several types, exchanges included
+const uint8_t GADGETS[] = {
+    0x58, 0xc3,       // pop eax; ret
+    0x5a, 0x59, 0xc3, // pop edx; pop ecx; ret
+    0x91, 0xc3,       // xchg eax, ecx; ret
+    0x87, 0xd3, 0xc3, // xchg ebx, edx; ret
+    0x89, 0xc6, 0xc3, // mov esi, eax; ret
+    0x01, 0xd1, 0xc3, // add ecx, edx; ret
+    0x8b, 0x03, 0xc3, // mov eax, [ebx]; ret
+    0x89, 0x0a, 0xc3, // mov [edx], ecx; ret
+    0xff, 0xe0,       // jmp eax
+    0x58, 0xc3,       // pop eax; ret (again)
+};
+
+// OTHER_GADGETS - a library with different gadgets
+const uint8_t OTHER_GADGETS[] = {
+    0x5b, 0xc3,       // pop ebx; ret
+    0x29, 0xc8, 0xc3, // sub eax, ecx; ret
+};
+
+const TestSymbol SYMBOLS[] = {{"first_function", 0}, {"second_function", 7}};
+
+// describeGadgets - returns a description of every field of the gadgets of
+// BA, in the order of GadgetPrimitives
+std::vector<std::string> describeGadgets(const BinaryAutopsy &BA) {
+  std::vector<std::string> result;
+
+  for (auto &kv : BA.GadgetPrimitives) {
+    for (auto *gadget : kv.second) {
+      std::string        s;
+      raw_string_ostream os(s);
+      auto              &effects = gadget->Effects;
+
+      os << getGadgetTypeName(gadget->Type) << " " << gadget->reg1 << " "
+         << gadget->reg2 << " lib=" << gadget->Library
+         << " written=" << (unsigned)effects.regsWritten
+         << " read=" << (unsigned)effects.regsRead
+         << " slots=" << (unsigned)effects.stackSlots
+         << " flags=" << effects.clobbersFlags << effects.readsFlags
+         << " memory=" << effects.readsMemory << effects.writesMemory << " [";
+      for (auto &instr : gadget->getInstr()) {
+        os << " " << instr.getOpcode() << "(";
+        for (auto &op : instr) {
+          if (op.isReg()) {
+            os << "r" << op.getReg() << ",";
+          } else if (op.isImm()) {
+            os << op.getImm() << ",";
+          }
+        }
+        os << ")";
+      }
+      os << " ] at";
+      for (uint64_t address : gadget->getAddresses()) {
+        os << " " << address;
+      }
+      result.push_back(os.str());
+    }
+  }
+  return result;
+}
+
+std::vector<std::string> describeSymbols(const BinaryAutopsy &BA) {
+  std::vector<std::string> result;
+
+  for (auto &sym : BA.Symbols) {
+    result.push_back(sym.Label + "@" + sym.Version + " " +
+                     std::to_string(sym.Address) + " lib=" +
+                     std::to_string(sym.Library));
+  }
+  return result;
+}
+
+std::vector<std::string>
+describeSections(const std::vector<Section> &sections) {
+  std::vector<std::string> result;
+
+  for (auto &s : sections) {
+    result.push_back(s.Label + " " + std::to_string(s.Address) + " " +
+                     std::to_string(s.Length) + " lib=" +
+                     std::to_string(s.Library));
+  }
+  return result;
+}
+
+// Snapshot - the analysis results of a BinaryAutopsy stored in the cache
+struct Snapshot {
+  std::vector<std::string> gadgets, symbols, sections, segments;
+  XchgPath                 edges;
+
+  Snapshot(const BinaryAutopsy &BA)
+      : gadgets(describeGadgets(BA)), symbols(describeSymbols(BA)),
+        sections(describeSections(BA.Sections)),
+        segments(describeSections(BA.Segments)),
+        edges(BA.xgraph.getEdges()) {}
+};
+
+void expectSameAnalysis(const Snapshot &expected, const Snapshot &actual) {
+  EXPECT_EQ(actual.gadgets, expected.gadgets);
+  EXPECT_EQ(actual.symbols, expected.symbols);
+  EXPECT_EQ(actual.sections, expected.sections);
+  EXPECT_EQ(actual.segments, expected.segments);
+  EXPECT_EQ(actual.edges, expected.edges);
+}
+
+// SNIPPETS - gadgets mixed with random bytes by randomCode()
+const std::vector<std::vector<uint8_t>> SNIPPETS = {
+    {0x58, 0xc3},             // pop eax; ret
+    {0x5a, 0x59, 0xc3},       // pop edx; pop ecx; ret
+    {0x91, 0xc3},             // xchg eax, ecx; ret
+    {0x89, 0xc6, 0xc3},       // mov esi, eax; ret
+    {0x01, 0xd1, 0xc3},       // add ecx, edx; ret
+    {0x8b, 0x03, 0xc3},       // mov eax, [ebx]; ret
+    {0xff, 0xe2},             // jmp edx
+    {0x8d, 0x76, 0x00, 0xc3}, // lea esi, [esi]; ret
+};
+
+// randomCode - returns size bytes of gadgets and random bytes
+std::vector<uint8_t> randomCode(std::mt19937 &rng, size_t size) {
+  std::vector<uint8_t> code;
+
+  while (code.size() < size) {
+    if (rng() % 2) {
+      auto &snippet = SNIPPETS[rng() % SNIPPETS.size()];
+      code.insert(code.end(), snippet.begin(), snippet.end());
+    } else {
+      for (unsigned i = rng() % 8; i > 0; i--) {
+        code.push_back(rng());
+      }
+    }
+  }
+  code.resize(size);
+  return code;
+}
+
+void writeFile(const std::string &path, StringRef data) {
+  std::error_code ec;
+  raw_fd_ostream  os(path, ec);
+  ASSERT_FALSE(ec) << path << ": " << ec.message();
+  os << data;
+}
+
+class GadgetCacheTest : public ::testing::Test {
+protected:
+  TestTarget       target;
+  SmallString<128> cacheDir;
+
+  void SetUp() override {
+    ASSERT_FALSE(sys::fs::createUniqueDirectory("ropf-test-cache", cacheDir));
+  }
+
+  void TearDown() override { sys::fs::remove_directories(cacheDir); }
+
+  // getLibraryScanPath - returns the path of the only library scan in
+  // cacheDir
+  std::string getLibraryScanPath() {
+    std::error_code ec;
+    std::string     path;
+
+    for (sys::fs::directory_iterator it(cacheDir, ec), end; it != end && !ec;
+         it.increment(ec)) {
+      if (sys::path::filename(it->path()).startswith("scan-")) {
+        EXPECT_TRUE(path.empty()) << "several library scans";
+        path = it->path();
+      }
+    }
+    EXPECT_FALSE(path.empty()) << "no library scan";
+    return path;
+  }
+
+  // cacheConfig - configuration analysing only the given library, with the
+  // gadget cache in cacheDir
+  GlobalConfig cacheConfig(const TestLibrary &library) {
+    GlobalConfig config       = testConfig(library);
+    config.gadgetCacheEnabled = true;
+    config.gadgetCacheDir     = cacheDir.str().str();
+    return config;
+  }
+};
+
+} // namespace
+
+TEST_F(GadgetCacheTest, SaveLoadRoundTrip) {
+  TestLibrary  library(GADGETS, SYMBOLS);
+  GlobalConfig config = cacheConfig(library);
+  auto         BA     = target.analyse(config);
+
+  Snapshot saved(*BA);
+  ASSERT_FALSE(saved.gadgets.empty());
+  ASSERT_FALSE(saved.edges.empty());
+
+  // the analysis has been saved, and is loaded into another one
+  GadgetCache  cache(config, {library.getSHA1()});
+  TestLibrary  other(OTHER_GADGETS);
+  GlobalConfig otherConfig = testConfig(other);
+  auto         otherBA     = target.analyse(otherConfig);
+
+  ASSERT_TRUE(sys::fs::exists(cache.getPath()));
+  ASSERT_TRUE(cache.load(*otherBA));
+  expectSameAnalysis(saved, Snapshot(*otherBA));
+
+  // and it is loaded by an analysis of the same library
+  expectSameAnalysis(saved, Snapshot(*target.analyse(config)));
+}
+
+TEST_F(GadgetCacheTest, RejectsTruncatedFile) {
+  TestLibrary  library(GADGETS, SYMBOLS);
+  GlobalConfig config = cacheConfig(library);
+  target.analyse(config);
+
+  GadgetCache cache(config, {library.getSHA1()});
+  auto        buffer = MemoryBuffer::getFile(cache.getPath());
+  ASSERT_TRUE(!!buffer);
+  std::string data = (*buffer)->getBuffer().str();
+
+  TestLibrary  other(OTHER_GADGETS);
+  GlobalConfig otherConfig = testConfig(other);
+  auto         otherBA     = target.analyse(otherConfig);
+  Snapshot     before(*otherBA);
+
+  for (size_t size = 0; size < data.size(); size++) {
+    writeFile(cache.getPath(), StringRef(data).take_front(size));
+
+    ASSERT_FALSE(cache.load(*otherBA)) << "size " << size;
+    expectSameAnalysis(before, Snapshot(*otherBA));
+  }
+
+  // the complete file is still accepted
+  writeFile(cache.getPath(), data);
+  EXPECT_TRUE(cache.load(*otherBA));
+}
+
+TEST_F(GadgetCacheTest, RejectsStaleKey) {
+  TestLibrary  library(GADGETS, SYMBOLS);
+  GlobalConfig config = cacheConfig(library);
+  target.analyse(config);
+
+  GadgetCache cache(config, {library.getSHA1()});
+  auto        buffer = MemoryBuffer::getFile(cache.getPath());
+  ASSERT_TRUE(!!buffer);
+
+  TestLibrary  other(OTHER_GADGETS);
+  GlobalConfig otherConfig = testConfig(other);
+  auto         otherBA     = target.analyse(otherConfig);
+  Snapshot     before(*otherBA);
+
+  // the same file, found where the cache of another library or of another
+  // configuration would be
+  GlobalConfig staleConfig            = config;
+  staleConfig.avoidMultiversionSymbol = !config.avoidMultiversionSymbol;
+
+  GadgetCache staleCaches[] = {GadgetCache(config, {other.getSHA1()}),
+                               GadgetCache(staleConfig, {library.getSHA1()})};
+
+  for (auto &stale : staleCaches) {
+    ASSERT_NE(stale.getPath(), cache.getPath());
+    writeFile(stale.getPath(), (*buffer)->getBuffer());
+
+    EXPECT_FALSE(stale.load(*otherBA));
+    expectSameAnalysis(before, Snapshot(*otherBA));
+  }
+}
+
+TEST_F(GadgetCacheTest, LibraryScanRoundTrip) {
+  std::mt19937 rng(1);
+  TestLibrary  library(randomCode(rng, 8 * 1024));
+  GlobalConfig config = cacheConfig(library);
+  target.analyse(config);
+
+  GadgetCache cache(config, {library.getSHA1()});
+  LibraryScan scan;
+  ASSERT_TRUE(cache.loadLibraryScan(library.getPath(), scan));
+  ASSERT_EQ(scan.regions.size(), 1u);
+  ASSERT_FALSE(scan.gadgets.empty());
+
+  // the blocks cover the code
+  auto    &blocks = scan.regions[0];
+  uint64_t text   = TestLibrary::TEXT_ADDRESS;
+  ASSERT_FALSE(blocks.empty());
+  EXPECT_EQ(blocks.front().begin, text);
+  EXPECT_EQ(blocks.back().end, text + 8 * 1024);
+  for (size_t i = 1; i < blocks.size(); i++) {
+    EXPECT_EQ(blocks[i].begin, blocks[i - 1].end);
+  }
+
+  // saving and loading it again gives the same scan
+  cache.saveLibraryScan(library.getPath(), scan);
+  LibraryScan loaded;
+  ASSERT_TRUE(cache.loadLibraryScan(library.getPath(), loaded));
+  ASSERT_EQ(loaded.regions.size(), scan.regions.size());
+  for (size_t i = 0; i < blocks.size(); i++) {
+    EXPECT_EQ(loaded.regions[0][i].begin, blocks[i].begin);
+    EXPECT_EQ(loaded.regions[0][i].end, blocks[i].end);
+    EXPECT_EQ(loaded.regions[0][i].hash, blocks[i].hash);
+  }
+  ASSERT_EQ(loaded.gadgets.size(), scan.gadgets.size());
+  for (size_t i = 0; i < scan.gadgets.size(); i++) {
+    EXPECT_EQ(loaded.gadgets[i].Instr.size(), scan.gadgets[i].Instr.size());
+    EXPECT_EQ(loaded.gadgets[i].addresses, scan.gadgets[i].addresses);
+    EXPECT_EQ(loaded.gadgets[i].sites, scan.gadgets[i].sites);
+  }
+
+  // truncated files are rejected, leaving the result untouched
+  std::string path   = getLibraryScanPath();
+  auto        buffer = MemoryBuffer::getFile(path);
+  ASSERT_TRUE(!!buffer);
+  std::string data = (*buffer)->getBuffer().str();
+
+  for (size_t size = 0; size < data.size(); size += 1 + size / 64) {
+    writeFile(path, StringRef(data).take_front(size));
+
+    ASSERT_FALSE(cache.loadLibraryScan(library.getPath(), loaded))
+        << "size " << size;
+    EXPECT_EQ(loaded.gadgets.size(), scan.gadgets.size());
+  }
+}
+
+TEST_F(GadgetCacheTest, IncrementalScanMatchesFullScan) {
+  const size_t CODE_SIZE = 48 * 1024;
+
+  std::mt19937         rng(1);
+  std::vector<uint8_t> code = randomCode(rng, CODE_SIZE);
+  TestLibrary          library(code);
+  GlobalConfig         config     = cacheConfig(library);
+  GlobalConfig         fullConfig = testConfig(library);
+
+  target.analyse(config);
+
+  // each change is scanned incrementally, starting from the scan of the
+  // previous version of the library
+  std::vector<uint8_t> pop  = {0x58, 0xc3};
+  std::vector<uint8_t> xchg = {0x87, 0xd3, 0xc3};
+
+  for (int change = 0; change < 5; change++) {
+    GadgetCache cache(config, {library.getSHA1()});
+    LibraryScan previous;
+    ASSERT_TRUE(cache.loadLibraryScan(library.getPath(), previous));
+    ASSERT_GT(previous.regions[0].size(), 4u);
+
+    size_t pos = CODE_SIZE / 5 * (change + 1);
+
+    switch (change) {
+    case 0:
+      // a gadget changed in a block
+      std::copy(xchg.begin(), xchg.end(), code.begin() + pos);
+      break;
+    case 1:
+      // bytes inserted, moving the blocks after them
+      code.insert(code.begin() + pos, pop.begin(), pop.end());
+      break;
+    case 2:
+      // bytes removed
+      code.erase(code.begin() + pos, code.begin() + pos + 100);
+      break;
+    case 3:
+      // a change in the first block
+      code[10] ^= 0xff;
+      break;
+    case 4:
+      // RETs at the start of a block, ending gadgets that start in the
+      // previous one
+      pos = previous.regions[0][2].begin - TestLibrary::TEXT_ADDRESS;
+      std::fill(code.begin() + pos, code.begin() + pos + 4, 0xc3);
+      break;
+    }
+    library.write(code);
+
+    Snapshot incremental(*target.analyse(config));
+    Snapshot full(*target.analyse(fullConfig));
+
+    ASSERT_FALSE(full.gadgets.empty());
+    EXPECT_EQ(incremental.gadgets, full.gadgets) << "change " << change;
+    EXPECT_EQ(incremental.edges, full.edges) << "change " << change;
+  }
+}
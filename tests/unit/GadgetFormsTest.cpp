@@ -0,0 +1,220 @@
+// ==============================================================================
+//   GADGET CLASSIFICATION TESTS
+//   part of the ROPfuscator project
+// ==============================================================================
+
+#include "BinAutopsy.h"
+#include "TestLibrary.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <tuple>
+#include <vector>
+
+using namespace ropf;
+using namespace ropf::test;
+using llvm::X86::EAX;
+using llvm::X86::ECX;
+using llvm::X86::EDX;
+using llvm::X86::NoRegister;
+
+namespace {
+
+// FormGadget - type and operands of a gadget
+typedef std::tuple<GadgetType, unsigned int, unsigned int> FormGadget;
+
+// FormTest - code starting with a gadget, and the primitives that gadget must
+// be classified as
+struct FormTest {
+  const char             *name;
+  std::vector<uint8_t>    code;
+  std::vector<FormGadget> expected;
+};
+
+FormGadget form(GadgetType type, unsigned int reg1, unsigned int reg2) {
+  return FormGadget(type, reg1, reg2);
+}
+
+const FormTest FORM_TESTS[] = {
+    // pop ecx; ret
+    {"POP32r", {0x59, 0xc3}, {form(GadgetType::MOV, ECX, NoRegister)}},
+    // pop ecx (8f /0); ret
+    {"POP32rmr", {0x8f, 0xc1, 0xc3}, {form(GadgetType::MOV, ECX, NoRegister)}},
+    // add ecx, edx; ret
+    {"ADD32rr", {0x01, 0xd1, 0xc3}, {form(GadgetType::ADD, ECX, EDX)}},
+    // add ecx, edx (03 /r); ret
+    {"ADD32rr_REV", {0x03, 0xca, 0xc3}, {form(GadgetType::ADD, ECX, EDX)}},
+    // add ecx, ecx; ret
+    {"ADD32rr same", {0x01, 0xc9, 0xc3}, {form(GadgetType::ADD_1, ECX, ECX)}},
+    // sub ecx, edx; ret
+    {"SUB32rr", {0x29, 0xd1, 0xc3}, {form(GadgetType::SUB, ECX, EDX)}},
+    // sub ecx, ecx; ret
+    {"SUB32rr same",
+     {0x29, 0xc9, 0xc3},
+     {form(GadgetType::SUB_1, ECX, ECX), form(GadgetType::XOR_1, ECX, ECX)}},
+    // sub ecx, ecx (2b /r); ret
+    {"SUB32rr_REV same",
+     {0x2b, 0xc9, 0xc3},
+     {form(GadgetType::SUB_1, ECX, ECX), form(GadgetType::XOR_1, ECX, ECX)}},
+    // and ecx, edx; ret
+    {"AND32rr", {0x21, 0xd1, 0xc3}, {form(GadgetType::AND, ECX, EDX)}},
+    // and ecx, ecx; ret
+    {"AND32rr same",
+     {0x21, 0xc9, 0xc3},
+     {form(GadgetType::AND_1, ECX, ECX), form(GadgetType::OR_1, ECX, ECX)}},
+    // and ecx, ecx (23 /r); ret
+    {"AND32rr_REV same",
+     {0x23, 0xc9, 0xc3},
+     {form(GadgetType::AND_1, ECX, ECX), form(GadgetType::OR_1, ECX, ECX)}},
+    // or ecx, edx; ret
+    {"OR32rr", {0x09, 0xd1, 0xc3}, {form(GadgetType::OR, ECX, EDX)}},
+    // or ecx, ecx; ret
+    {"OR32rr same",
+     {0x09, 0xc9, 0xc3},
+     {form(GadgetType::AND_1, ECX, ECX), form(GadgetType::OR_1, ECX, ECX)}},
+    // test ecx, edx; ret: flags only
+    {"TEST32rr", {0x85, 0xd1, 0xc3}, {}},
+    // test ecx, ecx; ret
+    {"TEST32rr same",
+     {0x85, 0xc9, 0xc3},
+     {form(GadgetType::AND_1, ECX, ECX), form(GadgetType::OR_1, ECX, ECX)}},
+    // xor ecx, edx; ret
+    {"XOR32rr", {0x31, 0xd1, 0xc3}, {form(GadgetType::XOR, ECX, EDX)}},
+    // xor ecx, ecx; ret
+    {"XOR32rr same", {0x31, 0xc9, 0xc3}, {form(GadgetType::XOR_1, ECX, ECX)}},
+    // inc ecx; ret
+    {"INC32r", {0x41, 0xc3}, {form(GadgetType::INC, ECX, NoRegister)}},
+    // inc ecx (ff /0); ret
+    {"INC32r_alt",
+     {0xff, 0xc1, 0xc3},
+     {form(GadgetType::INC, ECX, NoRegister)}},
+    // dec ecx; ret
+    {"DEC32r", {0x49, 0xc3}, {form(GadgetType::DEC, ECX, NoRegister)}},
+    // neg ecx; ret
+    {"NEG32r", {0xf7, 0xd9, 0xc3}, {form(GadgetType::NEG, ECX, NoRegister)}},
+    // not ecx; ret
+    {"NOT32r", {0xf7, 0xd1, 0xc3}, {form(GadgetType::NOT, ECX, NoRegister)}},
+    // mov ecx, edx; ret
+    {"MOV32rr", {0x89, 0xd1, 0xc3}, {form(GadgetType::COPY, ECX, EDX)}},
+    // mov ecx, edx (8b /r); ret
+    {"MOV32rr_REV", {0x8b, 0xca, 0xc3}, {form(GadgetType::COPY, ECX, EDX)}},
+    // mov ecx, ecx; ret: no effect
+    {"MOV32rr same", {0x89, 0xc9, 0xc3}, {}},
+    // lea ecx, [edx]; ret
+    {"LEA32r", {0x8d, 0x0a, 0xc3}, {form(GadgetType::COPY, ECX, EDX)}},
+    // lea ecx, [edx + 4]; ret
+    {"LEA32r disp", {0x8d, 0x4a, 0x04, 0xc3}, {}},
+    // lea ecx, [edx + eax]; ret
+    {"LEA32r index", {0x8d, 0x0c, 0x02, 0xc3}, {}},
+    // mov ecx, [edx]; ret
+    {"MOV32rm", {0x8b, 0x0a, 0xc3}, {form(GadgetType::LOAD, ECX, EDX)}},
+    // mov ecx, [ecx]; ret
+    {"MOV32rm same", {0x8b, 0x09, 0xc3}, {form(GadgetType::LOAD_1, ECX, ECX)}},
+    // mov ecx, [edx + 4]; ret
+    {"MOV32rm disp", {0x8b, 0x4a, 0x04, 0xc3}, {}},
+    // mov ecx, fs:[edx]; ret
+    {"MOV32rm segment", {0x64, 0x8b, 0x0a, 0xc3}, {}},
+    // mov [edx], ecx; ret
+    {"MOV32mr", {0x89, 0x0a, 0xc3}, {form(GadgetType::STORE, EDX, ECX)}},
+    // mov [edx], edx; ret
+    {"MOV32mr same", {0x89, 0x12, 0xc3}, {}},
+    // xchg eax, ecx; ret
+    {"XCHG32ar", {0x91, 0xc3}, {form(GadgetType::XCHG, EAX, ECX)}},
+    // xchg ecx, edx; ret
+    {"XCHG32rr", {0x87, 0xd1, 0xc3}, {form(GadgetType::XCHG, EDX, ECX)}},
+    // cmove ecx, edx; ret
+    {"CMOVE32rr",
+     {0x0f, 0x44, 0xca, 0xc3},
+     {form(GadgetType::CMOVE, ECX, EDX)}},
+    // cmovb ecx, edx; ret
+    {"CMOVB32rr",
+     {0x0f, 0x42, 0xca, 0xc3},
+     {form(GadgetType::CMOVB, ECX, EDX)}},
+    // cmovg ecx, edx; ret
+    {"CMOVG32rr", {0x0f, 0x4f, 0xca, 0xc3}, {}},
+    // push ecx; ret
+    {"PUSH32r", {0x51, 0xc3}, {form(GadgetType::JMP, ECX, NoRegister)}},
+    // push ecx (ff /6); ret
+    {"PUSH32rmr", {0xff, 0xf1, 0xc3}, {form(GadgetType::JMP, ECX, NoRegister)}},
+    // jmp ecx
+    {"JMP32r", {0xff, 0xe1}, {form(GadgetType::JMP, ECX, NoRegister)}},
+    // mov ecx, esp; ret
+    {"MOV32rr esp", {0x89, 0xe1, 0xc3}, {}},
+    // add esp, ecx; ret
+    {"ADD32rr esp", {0x01, 0xcc, 0xc3}, {}},
+    // pop edx; pop ecx; ret
+    {"POP32r sequence",
+     {0x5a, 0x59, 0xc3},
+     {form(GadgetType::MULTI_MOV, EDX, ECX)}},
+    // nop; sub ecx, ecx; ret
+    {"SUB32rr same after nop",
+     {0x90, 0x29, 0xc9, 0xc3},
+     {form(GadgetType::SUB_1, ECX, ECX), form(GadgetType::XOR_1, ECX, ECX)}},
+};
+
+// getFormGadgets - returns the gadgets of BA that start at the beginning of
+// the code of the test library
+std::vector<const Microgadget *> getFormGadgets(const BinaryAutopsy &BA) {
+  std::vector<const Microgadget *> result;
+  uint64_t                         text = TestLibrary::TEXT_ADDRESS;
+
+  for (auto &entry : BA.GadgetPrimitives) {
+    for (auto *gadget : entry.second) {
+      llvm::ArrayRef<uint64_t> addresses = gadget->getAddresses();
+      if (std::find(addresses.begin(), addresses.end(), text) !=
+          addresses.end()) {
+        result.push_back(gadget);
+      }
+    }
+  }
+  return result;
+}
+
+class GadgetFormsTest : public ::testing::Test {
+protected:
+  TestTarget target;
+};
+
+} // namespace
+
+TEST_F(GadgetFormsTest, ClassifiesForms) {
+  for (auto &test : FORM_TESTS) {
+    SCOPED_TRACE(test.name);
+
+    TestLibrary  library(test.code);
+    GlobalConfig config = testConfig(library);
+    auto         BA     = target.analyse(config);
+
+    std::vector<FormGadget> actual;
+    for (auto *gadget : getFormGadgets(*BA)) {
+      actual.push_back(form(gadget->Type, gadget->reg1, gadget->reg2));
+    }
+
+    std::vector<FormGadget> expected = test.expected;
+    std::sort(actual.begin(), actual.end());
+    std::sort(expected.begin(), expected.end());
+    EXPECT_EQ(actual, expected);
+  }
+}
+
+TEST_F(GadgetFormsTest, SharesInstructionsOfCopies) {
+  for (auto &test : FORM_TESTS) {
+    if (test.expected.size() < 2) {
+      continue;
+    }
+    SCOPED_TRACE(test.name);
+
+    TestLibrary  library(test.code);
+    GlobalConfig config  = testConfig(library);
+    auto         BA      = target.analyse(config);
+    auto         gadgets = getFormGadgets(*BA);
+
+    ASSERT_EQ(gadgets.size(), test.expected.size());
+    for (size_t i = 1; i < gadgets.size(); i++) {
+      EXPECT_NE(gadgets[i], gadgets[0]);
+      EXPECT_NE(gadgets[i]->Type, gadgets[0]->Type);
+      EXPECT_EQ(gadgets[i]->getInstr().data(), gadgets[0]->getInstr().data());
+      EXPECT_EQ(gadgets[i]->getAddresses().data(),
+                gadgets[0]->getAddresses().data());
+    }
+  }
+}
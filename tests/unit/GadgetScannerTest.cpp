@@ -0,0 +1,340 @@
+// ==============================================================================
+//   GADGET SCANNER TESTS
+//   part of the ROPfuscator project
+// ==============================================================================
+
+#include "BinAutopsy.h"
+#include "GadgetScanner.h"
+#include "TestLibrary.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "gtest/gtest.h"
+#include <random>
+
+// i386 library whose code is checked against the disassembler, set by
+// tests/unit/CMakeLists.txt
+#ifndef ROPF_TEST_LIBRARY
+#define ROPF_TEST_LIBRARY "/lib/i386-linux-gnu/libc.so.6"
+#endif
+
+using namespace llvm;
+using namespace ropf;
+using namespace ropf::test;
+
+namespace {
+
+const ScanImpl SCAN_IMPLS[] = {
+    ScanImpl::SCALAR, ScanImpl::SSE2, ScanImpl::AVX2};
+
+const char *getScanImplName(ScanImpl impl) {
+  switch (impl) {
+  case ScanImpl::SCALAR: return "scalar";
+  case ScanImpl::SSE2: return "SSE2";
+  case ScanImpl::AVX2: return "AVX2";
+  }
+  return "";
+}
+
+// findSitesReference - the positions of RET and JMP reg, found by definition
+void findSitesReference(const std::vector<uint8_t> &buf,
+                        uint64_t                    begin,
+                        uint64_t                    end,
+                        uint64_t                    limit,
+                        std::vector<uint64_t>      &rets,
+                        std::vector<uint64_t>      &jmps) {
+  for (uint64_t pos = begin; pos < end; pos++) {
+    if (buf[pos] == 0xc3) {
+      rets.push_back(pos);
+    }
+    if (buf[pos] == 0xff && pos + 1 < limit && buf[pos + 1] >= 0xe0 &&
+        buf[pos + 1] <= 0xe7) {
+      jmps.push_back(pos);
+    }
+  }
+}
+
+// checkSites - checks every supported implementation against the reference
+void checkSites(const std::vector<uint8_t> &buf,
+                uint64_t                    begin,
+                uint64_t                    end,
+                uint64_t                    limit) {
+  std::vector<uint64_t> expectedRets, expectedJmps;
+  findSitesReference(buf, begin, end, limit, expectedRets, expectedJmps);
+
+  for (ScanImpl impl : SCAN_IMPLS) {
+    if (!isScanImplSupported(impl)) {
+      continue;
+    }
+
+    std::vector<uint64_t> rets, jmps;
+    findGadgetSites(impl, buf.data(), begin, end, limit, rets, jmps);
+
+    ASSERT_EQ(rets, expectedRets) << getScanImplName(impl) << " [" << begin
+                                  << ", " << end << ") limit " << limit;
+    ASSERT_EQ(jmps, expectedJmps) << getScanImplName(impl) << " [" << begin
+                                  << ", " << end << ") limit " << limit;
+  }
+}
+
+// randomCode - random bytes, with RET, JMP and the ModRM bytes of JMP reg
+// much more frequent than in real code
+std::vector<uint8_t> randomCode(std::mt19937 &rng, size_t size) {
+  const uint8_t        frequent[] = {0xc3, 0xff, 0xe0, 0xe3, 0xe7, 0xe8};
+  std::vector<uint8_t> buf(size);
+
+  for (auto &byte : buf) {
+    unsigned r = rng() % 16;
+    byte       = r < 8 ? frequent[r % sizeof(frequent)] : (uint8_t)rng();
+  }
+  return buf;
+}
+
+// randomPrefixedCode - random bytes, with prefixes, escapes, ModRM bytes with
+// SIB and RET much more frequent than in real code
+std::vector<uint8_t> randomPrefixedCode(std::mt19937 &rng, size_t size) {
+  const uint8_t        frequent[] = {0x66, 0x67, 0xf0, 0xf2, 0xf3, 0x26,
+                                     0x0f, 0x0f, 0x04, 0x44, 0x84, 0xc3};
+  std::vector<uint8_t> buf(size);
+
+  for (auto &byte : buf) {
+    unsigned r = rng() % 16;
+    byte       = r < 6 ? frequent[rng() % sizeof(frequent)] : (uint8_t)rng();
+  }
+  return buf;
+}
+
+// isPrefix - tells whether instr is a prefix that the disassembler has decoded
+// alone, since the instruction after it is invalid
+bool isPrefix(const MCInst &instr) {
+  switch (instr.getOpcode()) {
+  case X86::ADDR16_PREFIX:
+  case X86::CS_PREFIX:
+  case X86::DATA16_PREFIX:
+  case X86::DS_PREFIX:
+  case X86::ES_PREFIX:
+  case X86::FS_PREFIX:
+  case X86::GS_PREFIX:
+  case X86::LOCK_PREFIX:
+  case X86::REPNE_PREFIX:
+  case X86::REP_PREFIX:
+  case X86::SS_PREFIX:
+  case X86::XACQUIRE_PREFIX:
+  case X86::XRELEASE_PREFIX:
+    return true;
+  }
+  return false;
+}
+
+class GadgetPrefilterTest : public ::testing::Test {
+protected:
+  TestTarget                      target;
+  std::unique_ptr<MCDisassembler> disasm = target.createDisassembler();
+
+  // decode - decodes the instruction at start of buf, reading bytes up to end
+  // (excluded), like BinaryAutopsy does
+  bool decode(ArrayRef<uint8_t> buf,
+              uint64_t          start,
+              uint64_t          end,
+              MCInst           &instr,
+              uint64_t         &size) {
+    instr = MCInst();
+    return disasm->getInstruction(
+               instr, size, buf.slice(start, end - start), start, nulls()) ==
+           MCDisassembler::Success;
+  }
+
+  // checkLengths - checks that getInstrLength() agrees with the disassembler
+  // at every position of buf, and returns the number of positions compared
+  size_t checkLengths(ArrayRef<uint8_t> buf) {
+    size_t compared = 0;
+
+    for (uint64_t pos = 0; pos < buf.size(); pos++) {
+      uint64_t end    = std::min<uint64_t>(pos + 15, buf.size());
+      uint64_t length = getInstrLength(buf.data(), pos, end);
+      MCInst   instr;
+      uint64_t size;
+
+      if (length == 0 || !decode(buf, pos, end, instr, size) ||
+          isPrefix(instr)) {
+        // not handled by the length decoder, or not an instruction
+        continue;
+      }
+      EXPECT_EQ(length, size)
+          << "at " << pos << ": " << toHex(buf.slice(pos, end - pos));
+      compared++;
+    }
+    return compared;
+  }
+
+  // isGadget - tells whether the window [addr, offset) of buf is an
+  // instruction followed by a RET, as in BinaryAutopsy::dumpGadgets()
+  bool isGadget(ArrayRef<uint8_t> buf, uint64_t addr, uint64_t offset) {
+    MCInst   first, second;
+    uint64_t firstSize, secondSize;
+
+    if (!decode(buf, addr, offset, first, firstSize) ||
+        addr + firstSize >= offset ||
+        !decode(buf, addr + firstSize, offset, second, secondSize)) {
+      return false;
+    }
+
+    unsigned opcode = first.getOpcode();
+    return second.getOpcode() == X86::RETL && opcode != X86::DATA16_PREFIX &&
+           opcode != X86::LOCK_PREFIX && opcode != X86::REP_PREFIX &&
+           opcode != X86::REPNE_PREFIX;
+  }
+
+  // isSequence - tells whether the window [addr, offset) of buf is a sequence
+  // of instructions ending right before the RET at offset - 1, as in
+  // BinaryAutopsy::dumpGadgets()
+  bool isSequence(ArrayRef<uint8_t> buf, uint64_t addr, uint64_t offset) {
+    MCInst   instr;
+    uint64_t size;
+    uint64_t pos   = addr;
+    size_t   count = 0;
+
+    while (pos < offset - 1 && count < MAXINSTRS) {
+      if (!decode(buf, pos, offset, instr, size) ||
+          instr.getOpcode() == X86::RETL) {
+        break;
+      }
+      count++;
+      pos += size;
+    }
+    return pos == offset - 1 && count >= 2 &&
+           decode(buf, pos, offset, instr, size) &&
+           instr.getOpcode() == X86::RETL;
+  }
+
+  // checkPrefilter - checks that mayBeRetGadget() and mayBeRetSequence()
+  // accept every window before the RETs of buf that the disassembler finds to
+  // be a gadget. Returns the number of gadgets found.
+  size_t checkPrefilter(ArrayRef<uint8_t> buf) {
+    std::vector<uint64_t> rets, jmps;
+    size_t                gadgets = 0;
+
+    findGadgetSites(buf.data(), 0, buf.size(), buf.size(), rets, jmps);
+
+    for (uint64_t ret : rets) {
+      uint64_t offset = ret + 1;
+
+      for (uint64_t depth = 1; depth <= MAXDEPTH_MULTI && depth <= offset;
+           depth++) {
+        uint64_t addr = offset - depth;
+
+        if (buf[addr] == 0xf2 || buf[addr] == 0xf3) {
+          // skipped by BinaryAutopsy::dumpGadgets()
+          continue;
+        }
+        if (depth <= MAXDEPTH && isGadget(buf, addr, offset)) {
+          EXPECT_TRUE(mayBeRetGadget(buf.data(), addr, offset))
+              << "at " << addr << ": " << toHex(buf.slice(addr, depth));
+          gadgets++;
+        }
+        if (depth >= 3 && isSequence(buf, addr, offset)) {
+          EXPECT_TRUE(mayBeRetSequence(buf.data(), addr, offset))
+              << "at " << addr << ": " << toHex(buf.slice(addr, depth));
+          gadgets++;
+        }
+      }
+    }
+    return gadgets;
+  }
+};
+
+} // namespace
+
+TEST(GadgetScannerTest, ScalarIsAlwaysSupported) {
+  EXPECT_TRUE(isScanImplSupported(ScanImpl::SCALAR));
+}
+
+TEST(GadgetScannerTest, ImplementationsMatchOnRandomCode) {
+  std::mt19937 rng(1);
+
+  // lengths around and between the multiples of 16 and 32, with every
+  // alignment of the first position
+  for (size_t size = 0; size <= 130; size++) {
+    std::vector<uint8_t> buf = randomCode(rng, size + 1);
+
+    for (uint64_t begin = 0; begin <= std::min<size_t>(size, 3); begin++) {
+      checkSites(buf, begin, size, size);
+      checkSites(buf, begin, size, size + 1);
+    }
+  }
+
+  for (int trial = 0; trial < 20; trial++) {
+    size_t               size  = 4096 + rng() % 64;
+    std::vector<uint8_t> buf   = randomCode(rng, size);
+    uint64_t             begin = rng() % 40;
+    uint64_t             end   = size - rng() % 40;
+
+    checkSites(buf, begin, end, size);
+  }
+}
+
+TEST(GadgetScannerTest, ImplementationsMatchAtLimit) {
+  for (size_t size : {15, 16, 17, 31, 32, 33, 63, 64, 65}) {
+    // a JMP as the last byte before limit: its ModRM is past the limit and
+    // must not be read, even if it would make a JMP reg
+    std::vector<uint8_t> buf(size + 1, 0x90);
+    buf[size - 1] = 0xff;
+    buf[size]     = 0xe0;
+
+    checkSites(buf, 0, size, size);
+
+    std::vector<uint64_t> rets, jmps;
+    findGadgetSites(buf.data(), 0, size, size, rets, jmps);
+    EXPECT_TRUE(jmps.empty()) << "size " << size;
+
+    // with one more byte readable, it is a JMP reg
+    checkSites(buf, 0, size, size + 1);
+    jmps.clear();
+    findGadgetSites(buf.data(), 0, size, size + 1, rets, jmps);
+    EXPECT_EQ(jmps, std::vector<uint64_t>{size - 1}) << "size " << size;
+
+    // a RET as the last byte
+    buf[size - 1] = 0xc3;
+    checkSites(buf, 0, size, size);
+  }
+}
+
+TEST_F(GadgetPrefilterTest, MatchesDisassemblerOnRandomCode) {
+  std::mt19937 rng(1);
+
+  for (int trial = 0; trial < 4; trial++) {
+    std::vector<uint8_t> buf = randomPrefixedCode(rng, 16 * 1024);
+
+    EXPECT_GT(checkLengths(buf), 0u);
+    EXPECT_GT(checkPrefilter(buf), 0u);
+  }
+}
+
+TEST_F(GadgetPrefilterTest, MatchesDisassemblerOnLibrary) {
+  const char *path = ROPF_TEST_LIBRARY;
+
+  if (!sys::fs::exists(path)) {
+    outs() << "skipped: " << path << " not found\n";
+    return;
+  }
+
+  auto binary = object::ObjectFile::createObjectFile(path);
+  ASSERT_TRUE(!!binary) << toString(binary.takeError());
+
+  size_t gadgets = 0;
+
+  for (const object::SectionRef &section : binary->getBinary()->sections()) {
+    Expected<StringRef> contents = section.getContents();
+
+    if (!contents || !section.isText()) {
+      consumeError(contents.takeError());
+      continue;
+    }
+
+    ArrayRef<uint8_t> buf = arrayRefFromStringRef(*contents);
+    EXPECT_GT(checkLengths(buf), buf.size() / 10);
+    gadgets += checkPrefilter(buf);
+  }
+  EXPECT_GT(gadgets, 0u);
+}
@@ -0,0 +1,172 @@
+// ==============================================================================
+//   ROP CHAIN MERGER TESTS
+//   part of the ROPfuscator project
+// ==============================================================================
+
+#include "BinAutopsy.h"
+#include "ROPEngine.h"
+#include "TestLibrary.h"
+#include "gtest/gtest.h"
+#include "llvm/CodeGen/MachineInstrBuilder.h"
+#include <map>
+#include <vector>
+
+using namespace ropf;
+using namespace ropf::test;
+using llvm::X86::EAX;
+using llvm::X86::EDI;
+using llvm::X86::EDX;
+using llvm::X86::ESI;
+
+namespace {
+
+// add eax, edx needs eax exchanged with ecx, mov edi, 42 needs no exchange
+const uint8_t GADGETS[] = {
+    0x5f, 0xc3,       // pop edi; ret
+    0x91, 0xc3,       // xchg eax, ecx; ret
+    0x89, 0xd6, 0xc3, // mov esi, edx; ret
+    0x01, 0xf1, 0xc3, // add ecx, esi; ret
+};
+
+enum class TestInstr { MOV_EDI, ADD_EAX };
+
+// MergerStep - instruction to translate, and whether the flags must be saved
+// around its chain
+struct MergerStep {
+  TestInstr instr;
+  bool      shouldFlagSaved;
+};
+
+// MergerTest - instructions of a basic block and number of chains expected
+// to be inserted for them
+struct MergerTest {
+  const char             *name;
+  std::vector<MergerStep> steps;
+  size_t                  chains;
+};
+
+const MergerTest MERGER_TESTS[] = {
+    // the flags saved by the second chain prevent merging it: it starts a new
+    // chain after exchanging registers, while the first one exchanged none
+    {"exchange after unmerged chain",
+     {{TestInstr::MOV_EDI, false}, {TestInstr::ADD_EAX, true}},
+     2},
+    // the first chain must be closed by its restore before the second one is
+    // translated again from unexchanged registers
+    {"exchange before unmerged chain",
+     {{TestInstr::ADD_EAX, false}, {TestInstr::MOV_EDI, true}},
+     2},
+    {"merged chains",
+     {{TestInstr::ADD_EAX, false},
+      {TestInstr::ADD_EAX, false},
+      {TestInstr::MOV_EDI, false}},
+     1},
+};
+
+// getExchanges - returns the number of XCHG gadgets of chain
+size_t getExchanges(const ROPChain &chain) {
+  size_t count = 0;
+
+  for (auto &elem : chain) {
+    if (elem.type == ChainElem::Type::GADGET &&
+        elem.microgadget->Type == GadgetType::XCHG) {
+      count++;
+    }
+  }
+  return count;
+}
+
+// restoresRegisters - tells whether the XCHG gadgets of chain leave every
+// register in its own physical register
+bool restoresRegisters(const ROPChain &chain) {
+  // physical register -> register it holds, if not itself
+  std::map<unsigned int, unsigned int> held;
+  auto getHeld = [&](unsigned int reg) {
+    auto it = held.find(reg);
+    return it == held.end() ? reg : it->second;
+  };
+
+  for (auto &elem : chain) {
+    if (elem.type == ChainElem::Type::GADGET &&
+        elem.microgadget->Type == GadgetType::XCHG) {
+      unsigned int reg1 = elem.microgadget->reg1;
+      unsigned int reg2 = elem.microgadget->reg2;
+      unsigned int tmp  = getHeld(reg1);
+      held[reg1]        = getHeld(reg2);
+      held[reg2]        = tmp;
+    }
+  }
+
+  for (auto &entry : held) {
+    if (entry.first != entry.second) {
+      return false;
+    }
+  }
+  return true;
+}
+
+class ROPChainMergerTest : public ::testing::Test {
+protected:
+  TestTarget target;
+
+  llvm::MachineInstr &buildInstr(llvm::MachineBasicBlock &MBB,
+                                 TestInstr                instr) {
+    const llvm::TargetInstrInfo *TII =
+        MBB.getParent()->getSubtarget().getInstrInfo();
+    llvm::DebugLoc DL;
+
+    switch (instr) {
+    case TestInstr::MOV_EDI:
+      return *llvm::BuildMI(MBB, MBB.end(), DL, TII->get(llvm::X86::MOV32ri))
+                  .addDef(EDI)
+                  .addImm(42);
+    case TestInstr::ADD_EAX:
+      return *llvm::BuildMI(MBB, MBB.end(), DL, TII->get(llvm::X86::ADD32rr))
+                  .addDef(EAX)
+                  .addReg(EAX)
+                  .addReg(EDX);
+    }
+    llvm_unreachable("unknown test instruction");
+  }
+};
+
+} // namespace
+
+TEST_F(ROPChainMergerTest, RestoresDeferredExchanges) {
+  TestLibrary  library(GADGETS);
+  GlobalConfig config = testConfig(library);
+  auto         BA     = target.analyse(config);
+
+  for (auto &test : MERGER_TESTS) {
+    SCOPED_TRACE(test.name);
+
+    llvm::MachineFunction   &MF  = target.createMachineFunction();
+    llvm::MachineBasicBlock *MBB = MF.CreateMachineBasicBlock();
+    MF.push_back(MBB);
+
+    ROPEngine             engine(*BA, /* deferXchgRestore */ true);
+    std::vector<ROPChain> chains;
+    auto insert = [&](ROPChain &chain, llvm::MachineInstr &) {
+      chains.push_back(chain);
+    };
+    ROPChainMerger merger(engine, insert);
+
+    for (auto &step : test.steps) {
+      std::vector<unsigned int> scratchRegs = {ESI};
+      llvm::MachineInstr       &MI          = buildInstr(*MBB, step.instr);
+
+      ASSERT_EQ(merger.add(MI, scratchRegs, step.shouldFlagSaved),
+                ROPChainStatus::OK);
+    }
+    merger.flush();
+
+    ASSERT_EQ(chains.size(), test.chains);
+    size_t exchanges = 0;
+    for (auto &chain : chains) {
+      EXPECT_TRUE(restoresRegisters(chain));
+      exchanges += getExchanges(chain);
+    }
+    EXPECT_GT(exchanges, 0u);
+    EXPECT_FALSE(engine.getXchgState().hasExchanges());
+  }
+}
@@ -0,0 +1,272 @@
+// ==============================================================================
+//   UNIT TEST HELPERS
+//   part of the ROPfuscator project
+// ==============================================================================
+
+#include "TestLibrary.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/BinaryFormat/ELF.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetOptions.h"
+#include <cstring>
+
+using namespace llvm;
+
+extern "C" void LLVMInitializeX86TargetInfo();
+extern "C" void LLVMInitializeX86Target();
+extern "C" void LLVMInitializeX86TargetMC();
+extern "C" void LLVMInitializeX86Disassembler();
+
+namespace ropf {
+namespace test {
+
+namespace {
+
+// append - appends the bytes of value to data (the host is assumed to be
+// little endian, like i386)
+template <typename T> void append(std::string &data, const T &value) {
+  data.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void align(std::string &data, size_t alignment) {
+  data.resize((data.size() + alignment - 1) / alignment * alignment, '\0');
+}
+
+// buildLibrary - returns the content of an ELF shared library with:
+// - a PT_LOAD R+X segment and a .text section holding code;
+// - a .dynsym section with a global function symbol for each of symbols;
+// - .dynstr and .shstrtab sections.
+std::string buildLibrary(ArrayRef<uint8_t>    code,
+                         ArrayRef<TestSymbol> symbols) {
+  enum { TEXT = 1, DYNSYM, DYNSTR, SHSTRTAB, NUM_SECTIONS };
+
+  std::string data(TestLibrary::TEXT_ADDRESS, '\0');
+  data.append(code.begin(), code.end());
+
+  // .dynsym and .dynstr
+  std::string dynstr(1, '\0');
+  align(data, 4);
+  size_t dynsymOffset = data.size();
+  append(data, ELF::Elf32_Sym());
+
+  for (auto &symbol : symbols) {
+    ELF::Elf32_Sym sym;
+    memset(&sym, 0, sizeof(sym));
+    sym.st_name  = dynstr.size();
+    sym.st_value = TestLibrary::TEXT_ADDRESS + symbol.second;
+    sym.st_size  = 1;
+    sym.st_shndx = TEXT;
+    sym.setBindingAndType(ELF::STB_GLOBAL, ELF::STT_FUNC);
+    append(data, sym);
+
+    dynstr += symbol.first;
+    dynstr += '\0';
+  }
+  size_t dynstrOffset = data.size();
+  data += dynstr;
+
+  // .shstrtab
+  const char shstrtab[]     = "\0.text\0.dynsym\0.dynstr\0.shstrtab";
+  size_t     shstrtabOffset = data.size();
+  data.append(shstrtab, sizeof(shstrtab));
+
+  // section headers
+  auto section = [](uint32_t name,
+                    uint32_t type,
+                    uint32_t flags,
+                    size_t   offset,
+                    size_t   size) {
+    ELF::Elf32_Shdr shdr;
+    memset(&shdr, 0, sizeof(shdr));
+    shdr.sh_name      = name;
+    shdr.sh_type      = type;
+    shdr.sh_flags     = flags;
+    shdr.sh_addr      = (flags & ELF::SHF_ALLOC) ? offset : 0;
+    shdr.sh_offset    = offset;
+    shdr.sh_size      = size;
+    shdr.sh_addralign = 1;
+    return shdr;
+  };
+
+  align(data, 4);
+  size_t shoff = data.size();
+  append(data, ELF::Elf32_Shdr());
+  append(data,
+         section(1,
+                 ELF::SHT_PROGBITS,
+                 ELF::SHF_ALLOC | ELF::SHF_EXECINSTR,
+                 TestLibrary::TEXT_ADDRESS,
+                 code.size()));
+
+  ELF::Elf32_Shdr dynsym = section(7,
+                                   ELF::SHT_DYNSYM,
+                                   ELF::SHF_ALLOC,
+                                   dynsymOffset,
+                                   dynstrOffset - dynsymOffset);
+  dynsym.sh_link         = DYNSTR;
+  dynsym.sh_info         = 1;
+  dynsym.sh_addralign    = 4;
+  dynsym.sh_entsize      = sizeof(ELF::Elf32_Sym);
+  append(data, dynsym);
+
+  append(data,
+         section(15,
+                 ELF::SHT_STRTAB,
+                 ELF::SHF_ALLOC,
+                 dynstrOffset,
+                 dynstr.size()));
+  append(data,
+         section(23, ELF::SHT_STRTAB, 0, shstrtabOffset, sizeof(shstrtab)));
+
+  // ELF and program headers
+  ELF::Elf32_Ehdr ehdr;
+  memset(&ehdr, 0, sizeof(ehdr));
+  memcpy(ehdr.e_ident, ELF::ElfMagic, strlen(ELF::ElfMagic));
+  ehdr.e_ident[ELF::EI_CLASS]   = ELF::ELFCLASS32;
+  ehdr.e_ident[ELF::EI_DATA]    = ELF::ELFDATA2LSB;
+  ehdr.e_ident[ELF::EI_VERSION] = ELF::EV_CURRENT;
+  ehdr.e_type                   = ELF::ET_DYN;
+  ehdr.e_machine                = ELF::EM_386;
+  ehdr.e_version                = ELF::EV_CURRENT;
+  ehdr.e_phoff                  = sizeof(ehdr);
+  ehdr.e_shoff                  = shoff;
+  ehdr.e_ehsize                 = sizeof(ehdr);
+  ehdr.e_phentsize              = sizeof(ELF::Elf32_Phdr);
+  ehdr.e_phnum                  = 1;
+  ehdr.e_shentsize              = sizeof(ELF::Elf32_Shdr);
+  ehdr.e_shnum                  = NUM_SECTIONS;
+  ehdr.e_shstrndx               = SHSTRTAB;
+
+  ELF::Elf32_Phdr phdr;
+  memset(&phdr, 0, sizeof(phdr));
+  phdr.p_type   = ELF::PT_LOAD;
+  phdr.p_offset = TestLibrary::TEXT_ADDRESS;
+  phdr.p_vaddr  = TestLibrary::TEXT_ADDRESS;
+  phdr.p_paddr  = TestLibrary::TEXT_ADDRESS;
+  phdr.p_filesz = code.size();
+  phdr.p_memsz  = code.size();
+  phdr.p_flags  = ELF::PF_R | ELF::PF_X;
+  phdr.p_align  = TestLibrary::TEXT_ADDRESS;
+
+  memcpy(&data[0], &ehdr, sizeof(ehdr));
+  memcpy(&data[sizeof(ehdr)], &phdr, sizeof(phdr));
+
+  return data;
+}
+
+} // namespace
+
+TestLibrary::TestLibrary(ArrayRef<uint8_t> code, ArrayRef<TestSymbol> symbols) {
+  SmallString<128> tmp;
+  int              fd;
+
+  if (std::error_code ec =
+          sys::fs::createTemporaryFile("ropf-test", "so", fd, tmp)) {
+    report_fatal_error(Twine("cannot create a test library: ") + ec.message());
+  }
+  sys::fs::closeFile(fd);
+
+  path = tmp.str().str();
+  write(code, symbols);
+}
+
+TestLibrary::~TestLibrary() { sys::fs::remove(path); }
+
+void TestLibrary::write(ArrayRef<uint8_t> code, ArrayRef<TestSymbol> symbols) {
+  std::error_code ec;
+  raw_fd_ostream  os(path, ec);
+
+  if (ec) {
+    report_fatal_error(Twine("cannot write ") + path + ": " + ec.message());
+  }
+  os << buildLibrary(code, symbols);
+}
+
+std::string TestLibrary::getSHA1() const {
+  auto buffer = MemoryBuffer::getFile(path);
+
+  if (!buffer) {
+    report_fatal_error(Twine("cannot read ") + path + ": " +
+                       buffer.getError().message());
+  }
+
+  SHA1 sha1;
+  sha1.update((*buffer)->getBuffer());
+  return toHex(sha1.final(), /* LowerCase */ true);
+}
+
+TestTarget::TestTarget() {
+  LLVMInitializeX86TargetInfo();
+  LLVMInitializeX86Target();
+  LLVMInitializeX86TargetMC();
+  LLVMInitializeX86Disassembler();
+
+  const std::string triple = "i386-unknown-linux-gnu";
+  std::string       error;
+  const Target     *target = TargetRegistry::lookupTarget(triple, error);
+
+  if (!target) {
+    report_fatal_error(Twine(error));
+  }
+
+  TM.reset(target->createTargetMachine(
+      triple, "generic", "", TargetOptions(), None));
+#if LLVM_VERSION_MAJOR >= 13
+  context.reset(new MCContext(TM->getTargetTriple(),
+                              TM->getMCAsmInfo(),
+                              TM->getMCRegisterInfo(),
+                              TM->getMCSubtargetInfo()));
+#else
+  context.reset(
+      new MCContext(TM->getMCAsmInfo(), TM->getMCRegisterInfo(), nullptr));
+#endif
+  module.reset(new Module("ropf-test", llvmContext));
+}
+
+Expected<std::unique_ptr<BinaryAutopsy>>
+TestTarget::create(const GlobalConfig &config) {
+  return BinaryAutopsy::create(config, *module, *TM, *context);
+}
+
+std::unique_ptr<BinaryAutopsy> TestTarget::analyse(const GlobalConfig &config) {
+  return cantFail(create(config));
+}
+
+std::unique_ptr<MCDisassembler> TestTarget::createDisassembler() {
+  return std::unique_ptr<MCDisassembler>(
+      TM->getTarget().createMCDisassembler(*TM->getMCSubtargetInfo(),
+                                           *context));
+}
+
+MachineFunction &TestTarget::createMachineFunction() {
+  if (!MMI) {
+    auto *LLVMTM = static_cast<const LLVMTargetMachine *>(TM.get());
+    MMI.reset(new MachineModuleInfo(LLVMTM));
+  }
+
+  auto     *type = FunctionType::get(Type::getVoidTy(llvmContext), false);
+  Function *F    = Function::Create(
+      type, GlobalValue::ExternalLinkage, "test_function", *module);
+  IRBuilder<> builder(BasicBlock::Create(llvmContext, "entry", F));
+  builder.CreateRetVoid();
+
+  return MMI->getOrCreateMachineFunction(*F);
+}
+
+GlobalConfig testConfig(const TestLibrary &library) {
+  GlobalConfig config;
+  config.libraryPath        = library.getPath();
+  config.gadgetCacheEnabled = false;
+  return config;
+}
+
+} // namespace test
+} // namespace ropf
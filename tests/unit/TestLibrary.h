@@ -0,0 +1,95 @@
+// ==============================================================================
+//   UNIT TEST HELPERS
+//   part of the ROPfuscator project
+// ==============================================================================
+// Synthetic gadget libraries and the target needed to analyse them, so that
+// the tests do not depend on the libraries installed on the host.
+
+#ifndef TESTLIBRARY_H
+#define TESTLIBRARY_H
+
+#include "BinAutopsy.h"
+#include "ROPfuscatorConfig.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/CodeGen/MachineFunction.h"
+#include "llvm/CodeGen/MachineModuleInfo.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/MC/MCContext.h"
+#include "llvm/MC/MCDisassembler/MCDisassembler.h"
+#include "llvm/Target/TargetMachine.h"
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace ropf {
+namespace test {
+
+// TestSymbol - name and offset in the code of a global function symbol
+typedef std::pair<std::string, uint32_t> TestSymbol;
+
+// TestLibrary - a minimal i386 ELF shared library, written to a temporary
+// file that is removed on destruction. Its only executable section and
+// segment hold the given code, at the same address and file offset
+// (TEXT_ADDRESS).
+class TestLibrary {
+public:
+  static const uint32_t TEXT_ADDRESS = 0x1000;
+
+  TestLibrary(llvm::ArrayRef<uint8_t>    code,
+              llvm::ArrayRef<TestSymbol> symbols = {{"test_function", 0}});
+  TestLibrary(const TestLibrary &) = delete;
+  ~TestLibrary();
+
+  // write - replaces the content of the library, keeping its path
+  void write(llvm::ArrayRef<uint8_t>    code,
+             llvm::ArrayRef<TestSymbol> symbols = {{"test_function", 0}});
+
+  const std::string &getPath() const { return path; }
+
+  // getSHA1 - returns the SHA1 hash of the library, in hexadecimal as in the
+  // configuration and the gadget cache key
+  std::string getSHA1() const;
+
+private:
+  std::string path;
+};
+
+// TestTarget - i386 target machine, MC context and empty module to analyse
+// the test libraries with.
+class TestTarget {
+public:
+  TestTarget();
+
+  // create - runs BinaryAutopsy on the libraries of config, which must
+  // outlive the result
+  llvm::Expected<std::unique_ptr<BinaryAutopsy>>
+  create(const GlobalConfig &config);
+
+  // analyse - same as create(), for libraries that are known to be valid
+  std::unique_ptr<BinaryAutopsy> analyse(const GlobalConfig &config);
+
+  // createDisassembler - returns the i386 disassembler used by BinaryAutopsy
+  std::unique_ptr<llvm::MCDisassembler> createDisassembler();
+
+  // createMachineFunction - returns the empty machine function of a new
+  // function of the module, to build the instructions to translate in
+  llvm::MachineFunction &createMachineFunction();
+
+private:
+  llvm::LLVMContext                        llvmContext;
+  std::unique_ptr<llvm::Module>            module;
+  std::unique_ptr<llvm::TargetMachine>     TM;
+  std::unique_ptr<llvm::MCContext>         context;
+  std::unique_ptr<llvm::MachineModuleInfo> MMI;
+};
+
+// testConfig - configuration analysing only the given library, without gadget
+// cache
+GlobalConfig testConfig(const TestLibrary &library);
+
+} // namespace test
+} // namespace ropf
+
+#endif
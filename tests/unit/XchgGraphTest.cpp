@@ -0,0 +1,188 @@
+// ==============================================================================
+//   XCHG GRAPH TESTS
+//   part of the ROPfuscator project
+// ==============================================================================
+
+#include "XchgGraph.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <numeric>
+#include <random>
+
+using namespace ropf;
+
+namespace {
+
+// applyPath - applies the exchanges of path to regs, where regs[r] is the
+// logical register held by the physical register r
+void applyPath(std::vector<int> &regs, const XchgPath &path) {
+  for (auto &edge : path) {
+    std::swap(regs[edge.first], regs[edge.second]);
+  }
+}
+
+bool isIdentity(const std::vector<int> &regs) {
+  for (size_t r = 0; r < regs.size(); r++) {
+    if (regs[r] != (int)r) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// buildGraph - returns a graph with the given edges, finalized or not
+XchgGraph buildGraph(const XchgPath &edges, bool finalize) {
+  XchgGraph graph;
+
+  for (auto &edge : edges) {
+    graph.addEdge(edge.first, edge.second);
+  }
+  if (finalize) {
+    graph.finalize();
+  }
+
+  return graph;
+}
+
+// scramble - exchanges random pairs of exchangeable registers of graph,
+// tracking the result in regs
+void scramble(const XchgGraph  &graph,
+              XchgState        &state,
+              std::vector<int> &regs,
+              std::mt19937     &rng,
+              int               count) {
+  std::uniform_int_distribution<int> pick(0, N_REGS - 1);
+
+  for (int i = 0; i < count;) {
+    int a = pick(rng), b = pick(rng);
+
+    if (a != b && graph.checkPath(a, b)) {
+      applyPath(regs, graph.getPath(state, a, b));
+      i++;
+    }
+  }
+}
+
+} // namespace
+
+TEST(XchgGraphTest, RankUnrankRoundTrip) {
+  for (int n = 1; n <= MAX_SWAP_NODES; n++) {
+    unsigned numPerms = 1;
+    for (int i = 2; i <= n; i++) {
+      numPerms *= i;
+    }
+
+    uint8_t prev[MAX_SWAP_NODES], perm[MAX_SWAP_NODES];
+
+    for (unsigned rank = 0; rank < numPerms; rank++) {
+      unrankPermutation(rank, n, perm);
+
+      // perm is a permutation of 0..n-1
+      uint8_t sorted[MAX_SWAP_NODES];
+      std::copy(perm, perm + n, sorted);
+      std::sort(sorted, sorted + n);
+      for (int i = 0; i < n; i++) {
+        ASSERT_EQ(sorted[i], i) << "n=" << n << " rank=" << rank;
+      }
+
+      ASSERT_EQ(rankPermutation(perm, n), rank) << "n=" << n;
+
+      // ranks follow the lexicographic order, starting from the identity
+      if (rank == 0) {
+        for (int i = 0; i < n; i++) {
+          ASSERT_EQ(perm[i], i);
+        }
+      } else {
+        ASSERT_TRUE(
+            std::lexicographical_compare(prev, prev + n, perm, perm + n))
+            << "n=" << n << " rank=" << rank;
+      }
+      std::copy(perm, perm + n, prev);
+    }
+  }
+}
+
+TEST(XchgGraphTest, ShortestRestoreMatchesReplay) {
+  // two components: a cycle with a chord, and a single edge
+  const XchgPath edges = {{1, 2}, {2, 3}, {3, 4}, {4, 5}, {5, 1}, {1, 3},
+                          {7, 8}};
+  XchgGraph      shortest = buildGraph(edges, true);
+  XchgGraph      replay   = buildGraph(edges, false);
+  std::mt19937   rng(42);
+  size_t         shortestTotal = 0, replayTotal = 0;
+
+  for (int trial = 0; trial < 1000; trial++) {
+    XchgState        state;
+    std::vector<int> regs(N_REGS);
+    std::iota(regs.begin(), regs.end(), 0);
+
+    scramble(shortest, state, regs, rng, 1 + trial % 6);
+
+    XchgState stateShortest(state), stateReplay(state);
+    XchgPath  pathShortest = shortest.reorderRegisters(stateShortest);
+    XchgPath  pathReplay   = replay.reorderRegisters(stateReplay);
+
+    // both put every logical register back in place
+    std::vector<int> regsShortest(regs), regsReplay(regs);
+    applyPath(regsShortest, pathShortest);
+    applyPath(regsReplay, pathReplay);
+    ASSERT_TRUE(isIdentity(regsShortest)) << "trial " << trial;
+    ASSERT_TRUE(isIdentity(regsReplay)) << "trial " << trial;
+    ASSERT_FALSE(stateShortest.hasExchanges());
+    ASSERT_FALSE(stateReplay.hasExchanges());
+
+    // only with edges of the graph, and never with more of them
+    for (auto &edge : pathShortest) {
+      ASSERT_NE(std::find_if(edges.begin(),
+                             edges.end(),
+                             [&](const std::pair<int, int> &e) {
+                               return std::minmax(e.first, e.second) ==
+                                      std::minmax(edge.first, edge.second);
+                             }),
+                edges.end());
+    }
+    ASSERT_LE(pathShortest.size(), pathReplay.size()) << "trial " << trial;
+
+    shortestTotal += pathShortest.size();
+    replayTotal += pathReplay.size();
+  }
+
+  EXPECT_LT(shortestTotal, replayTotal);
+}
+
+TEST(XchgGraphTest, CancellingExchangesNeedNoRestore) {
+  const XchgPath edges = {{1, 2}, {2, 3}};
+  XchgGraph      graph = buildGraph(edges, true);
+  XchgState      state;
+
+  // exchanging 1 and 3 twice leaves every register in place
+  graph.getPath(state, 1, 3);
+  graph.getPath(state, 1, 3);
+
+  XchgState replayState(state);
+  EXPECT_TRUE(graph.reorderRegisters(state).empty());
+  EXPECT_EQ(buildGraph(edges, false).reorderRegisters(replayState).size(), 6u);
+}
+
+TEST(XchgGraphTest, LargeGraphFallsBackToReplay) {
+  // a path over more than MAX_SWAP_NODES registers
+  XchgPath edges;
+  for (int r = 1; r <= MAX_SWAP_NODES + 2; r++) {
+    edges.emplace_back(r, r + 1);
+  }
+
+  XchgGraph    graph = buildGraph(edges, true);
+  std::mt19937 rng(7);
+
+  for (int trial = 0; trial < 100; trial++) {
+    XchgState        state;
+    std::vector<int> regs(N_REGS);
+    std::iota(regs.begin(), regs.end(), 0);
+
+    scramble(graph, state, regs, rng, 1 + trial % 4);
+
+    applyPath(regs, graph.reorderRegisters(state));
+    ASSERT_TRUE(isIdentity(regs)) << "trial " << trial;
+    ASSERT_FALSE(state.hasExchanges());
+  }
+}
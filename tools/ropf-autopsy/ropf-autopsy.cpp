@@ -0,0 +1,574 @@
+// ==============================================================================
+//   ROPF-AUTOPSY
+//   part of the ROPfuscator project
+// ==============================================================================
+// This tool analyses one or more candidate gadget libraries with BinaryAutopsy
+// and reports, in JSON format, how well each of them fits ROPfuscator:
+//      - number of gadgets for each gadget type and register pair
+//      - connected components of the exchange graph
+//      - xchg overhead to exchange every pair of registers (and back)
+//      - expected chain length for each ROPEngine handler pattern
+//
+// The library giving the shortest chains is the one with the lowest runtime
+// overhead.
+
+#include "BinAutopsy.h"
+#include "ROPEngine.h"
+#include "ROPfuscatorConfig.h"
+#include "X86.h"
+#include "XchgGraph.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/MC/MCContext.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+using namespace ropf;
+
+extern "C" void LLVMInitializeX86TargetInfo();
+extern "C" void LLVMInitializeX86Target();
+extern "C" void LLVMInitializeX86TargetMC();
+
+namespace {
+
+// ----------------------------------------------------------------
+//  COMMAND LINE ARGUMENTS
+// ----------------------------------------------------------------
+cl::list<std::string> LibraryPaths(cl::Positional,
+                                   cl::desc("<library>..."),
+                                   cl::OneOrMore);
+
+cl::list<std::string>
+    LinkedLibraries("linked-library",
+                    cl::desc("Library linked at run-time (its symbol names "
+                             "are not used as anchors)"),
+                    cl::ZeroOrMore);
+
+cl::list<std::string> ExtraGadgetLibraries(
+    "extra-gadget-library",
+    cl::desc("Additional gadget library merged with each analysed library"),
+    cl::ZeroOrMore);
+
+cl::opt<bool> SearchSections("search-sections",
+                             cl::desc("Search gadgets in code sections "
+                                      "instead of code segments"));
+
+cl::opt<bool> AvoidMultiversion("avoid-multiversion-symbol",
+                                cl::desc("Avoid multi-versioned symbols"));
+
+cl::opt<bool> NoCache("no-cache", cl::desc("Do not use the gadget cache"));
+
+cl::opt<std::string> OutputFile("o",
+                                cl::desc("Output file (default: stdout)"),
+                                cl::value_desc("filename"),
+                                cl::init("-"));
+
+// ----------------------------------------------------------------
+//  HANDLER PATTERNS
+// ----------------------------------------------------------------
+
+// operand placeholders of a pattern step: scratch registers are numbered
+// as in ROPEngine, instruction operands are assigned by the analysis
+const int SCRATCH_1 = -1;
+const int SCRATCH_2 = -2;
+const int OPERAND_1 = -11;
+const int OPERAND_2 = -12;
+const int NONE      = X86::NoRegister;
+
+struct PatternStep {
+  enum class Kind { GADGET, IMMEDIATE, REORDER };
+
+  Kind       kind;
+  GadgetType type;
+  int        reg1, reg2;
+
+  static PatternStep gadget(GadgetType type, int reg1, int reg2 = NONE) {
+    return {Kind::GADGET, type, reg1, reg2};
+  }
+  static PatternStep immediate() {
+    return {Kind::IMMEDIATE, GadgetType::UNDEFINED, NONE, NONE};
+  }
+  static PatternStep reorder() {
+    return {Kind::REORDER, GadgetType::UNDEFINED, NONE, NONE};
+  }
+};
+
+struct HandlerPattern {
+  const char              *name;
+  std::vector<PatternStep> steps;
+};
+
+// getHandlerPatterns - virtual gadget sequences built by the ROPEngine
+// handlers for the most common operand combination of each instruction.
+// Keep in sync with ROPEngine.cpp.
+std::vector<HandlerPattern> getHandlerPatterns() {
+  using S = PatternStep;
+  using G = GadgetType;
+
+  std::vector<HandlerPattern> patterns;
+
+  for (auto op : {std::make_pair("ADD32ri", G::ADD),
+                  std::make_pair("SUB32ri", G::SUB),
+                  std::make_pair("AND32ri", G::AND),
+                  std::make_pair("OR32ri", G::OR)}) {
+    patterns.push_back({op.first,
+                        {S::gadget(G::MOV, SCRATCH_1),
+                         S::immediate(),
+                         S::gadget(op.second, OPERAND_1, SCRATCH_1),
+                         S::reorder()}});
+  }
+
+  for (auto op : {std::make_pair("ADD32rr", G::ADD),
+                  std::make_pair("SUB32rr", G::SUB),
+                  std::make_pair("AND32rr", G::AND),
+                  std::make_pair("OR32rr", G::OR)}) {
+    patterns.push_back(
+        {op.first, {S::gadget(op.second, OPERAND_1, OPERAND_2), S::reorder()}});
+  }
+
+  for (auto op : {std::make_pair("ADD32rm", G::ADD),
+                  std::make_pair("SUB32rm", G::SUB),
+                  std::make_pair("AND32rm", G::AND),
+                  std::make_pair("OR32rm", G::OR)}) {
+    patterns.push_back({op.first,
+                        {S::gadget(G::MOV, SCRATCH_1),
+                         S::immediate(),
+                         S::gadget(G::ADD, SCRATCH_1, OPERAND_2),
+                         S::gadget(G::LOAD_1, SCRATCH_1),
+                         S::gadget(op.second, OPERAND_1, SCRATCH_1),
+                         S::reorder()}});
+  }
+
+  for (auto op : {std::make_pair("INC32r", G::INC),
+                  std::make_pair("DEC32r", G::DEC),
+                  std::make_pair("NEG32r", G::NEG),
+                  std::make_pair("NOT32r", G::NOT)}) {
+    patterns.push_back(
+        {op.first, {S::gadget(op.second, OPERAND_1), S::reorder()}});
+  }
+
+  patterns.push_back(
+      {"XOR32rr", {S::gadget(G::XOR_1, OPERAND_1), S::reorder()}});
+
+  patterns.push_back({"LEA32r",
+                      {S::gadget(G::MOV, OPERAND_1),
+                       S::immediate(),
+                       S::gadget(G::ADD, OPERAND_1, OPERAND_2),
+                       S::reorder()}});
+
+  patterns.push_back({"MOV32rm",
+                      {S::gadget(G::MOV, SCRATCH_1),
+                       S::immediate(),
+                       S::gadget(G::ADD, SCRATCH_1, OPERAND_2),
+                       S::gadget(G::LOAD_1, SCRATCH_1),
+                       S::gadget(G::COPY, OPERAND_1, SCRATCH_1),
+                       S::reorder()}});
+
+  patterns.push_back({"MOV32mr",
+                      {S::gadget(G::MOV, SCRATCH_1),
+                       S::immediate(),
+                       S::gadget(G::ADD, SCRATCH_1, OPERAND_1),
+                       S::gadget(G::STORE, SCRATCH_1, OPERAND_2),
+                       S::reorder()}});
+
+  patterns.push_back({"MOV32mi",
+                      {S::gadget(G::MOV, SCRATCH_2),
+                       S::immediate(),
+                       S::gadget(G::MOV, SCRATCH_1),
+                       S::immediate(),
+                       S::gadget(G::ADD, SCRATCH_1, OPERAND_1),
+                       S::gadget(G::STORE, SCRATCH_1, SCRATCH_2),
+                       S::reorder()}});
+
+  patterns.push_back(
+      {"MOV32rr", {S::gadget(G::COPY, OPERAND_1, OPERAND_2), S::reorder()}});
+
+  patterns.push_back(
+      {"MOV32ri",
+       {S::gadget(G::MOV, OPERAND_1), S::immediate(), S::reorder()}});
+
+  patterns.push_back({"CMP32mi",
+                      {S::gadget(G::MOV, SCRATCH_2),
+                       S::immediate(),
+                       S::gadget(G::MOV, SCRATCH_1),
+                       S::immediate(),
+                       S::gadget(G::ADD, SCRATCH_1, OPERAND_1),
+                       S::gadget(G::LOAD_1, SCRATCH_1),
+                       S::gadget(G::SUB, SCRATCH_1, SCRATCH_2),
+                       S::reorder()}});
+
+  patterns.push_back({"CMP32rr",
+                      {S::gadget(G::COPY, SCRATCH_1, OPERAND_1),
+                       S::gadget(G::SUB, SCRATCH_1, OPERAND_2),
+                       S::reorder()}});
+
+  patterns.push_back({"CMP32ri",
+                      {S::gadget(G::MOV, SCRATCH_2),
+                       S::immediate(),
+                       S::gadget(G::COPY, SCRATCH_1, OPERAND_1),
+                       S::gadget(G::SUB, SCRATCH_1, SCRATCH_2),
+                       S::reorder()}});
+
+  patterns.push_back({"CMP32rm",
+                      {S::gadget(G::MOV, SCRATCH_1),
+                       S::immediate(),
+                       S::gadget(G::ADD, SCRATCH_1, OPERAND_2),
+                       S::gadget(G::LOAD_1, SCRATCH_1),
+                       S::gadget(G::COPY, SCRATCH_2, OPERAND_1),
+                       S::gadget(G::SUB, SCRATCH_2, SCRATCH_1),
+                       S::reorder()}});
+
+  for (auto op : {std::make_pair("JE_1", G::CMOVE),
+                  std::make_pair("JB_1", G::CMOVB)}) {
+    patterns.push_back({op.first,
+                        {S::gadget(G::MOV, SCRATCH_2),
+                         S::immediate(),
+                         S::gadget(G::MOV, SCRATCH_1),
+                         S::immediate(),
+                         S::gadget(op.second, SCRATCH_1, SCRATCH_2),
+                         S::reorder(),
+                         S::gadget(G::JMP, SCRATCH_1)}});
+  }
+
+  patterns.push_back({"CALLpcrel32", {S::immediate(), S::immediate()}});
+
+  patterns.push_back(
+      {"CALL32r", {S::gadget(G::JMP, OPERAND_1), S::immediate()}});
+
+  return patterns;
+}
+
+// general purpose registers usable in chains
+const std::vector<unsigned int> GPRs = {X86::EAX,
+                                        X86::EBX,
+                                        X86::ECX,
+                                        X86::EDX,
+                                        X86::ESI,
+                                        X86::EDI,
+                                        X86::EBP};
+
+int numPlaceholders(const HandlerPattern &pattern, int first, int last) {
+  int n = 0;
+  for (auto &step : pattern.steps) {
+    for (int reg : {step.reg1, step.reg2}) {
+      if (reg <= first && reg >= last) {
+        n = std::max(n, first - reg + 1);
+      }
+    }
+  }
+  return n;
+}
+
+// buildPattern - returns the number of chain elements needed by the pattern
+// with the given register assignment, or -1 if the chain cannot be built.
+// Mirrors ROPChainBuilder::buildAux().
+int buildPattern(const BinaryAutopsy         &BA,
+                 const HandlerPattern        &pattern,
+                 const std::vector<unsigned> &operands,
+                 const std::vector<unsigned> &scratch) {
+  XchgState state;
+  ROPChain  chain;
+
+  for (auto &step : pattern.steps) {
+    switch (step.kind) {
+    case PatternStep::Kind::REORDER: chain.append(BA.undoXchgs(state)); break;
+    case PatternStep::Kind::IMMEDIATE:
+      chain.emplace_back(ChainElem::fromImmediate(0));
+      break;
+    case PatternStep::Kind::GADGET: {
+      unsigned int regs[2];
+      int          i = 0;
+      for (int reg : {step.reg1, step.reg2}) {
+        if (reg <= OPERAND_1) {
+          regs[i++] = operands[OPERAND_1 - reg];
+        } else if (reg < 0) {
+          regs[i++] = scratch[-reg - 1];
+        } else {
+          regs[i++] = reg;
+        }
+      }
+
+      if (step.type == GadgetType::COPY && regs[0] == regs[1]) {
+        break;
+      }
+
+      ROPChain found =
+          BA.findGadgetPrimitive(state, step.type, regs[0], regs[1]);
+      if (!found.valid()) {
+        return -1;
+      }
+      chain.append(found);
+      break;
+    }
+    }
+  }
+
+  chain.removeDuplicates();
+  return chain.size();
+}
+
+// tryScratchRegs - assigns scratch registers in the same order as
+// ROPChainBuilder (the first assignment that works is taken).
+int tryScratchRegs(const BinaryAutopsy         &BA,
+                   const HandlerPattern        &pattern,
+                   const std::vector<unsigned> &operands,
+                   const std::vector<unsigned> &freeRegs,
+                   std::vector<unsigned>       &scratch,
+                   size_t                       numScratch) {
+  if (scratch.size() == numScratch) {
+    return buildPattern(BA, pattern, operands, scratch);
+  }
+
+  for (unsigned int r : freeRegs) {
+    if (std::find(scratch.begin(), scratch.end(), r) != scratch.end()) {
+      continue;
+    }
+    scratch.push_back(r);
+    int length =
+        tryScratchRegs(BA, pattern, operands, freeRegs, scratch, numScratch);
+    scratch.pop_back();
+    if (length >= 0) {
+      return length;
+    }
+  }
+
+  return -1;
+}
+
+// analysePattern - evaluates the pattern for every assignment of distinct
+// registers to the instruction operands, assuming that the operands are live
+// and that every other register is free.
+json::Object analysePattern(const BinaryAutopsy  &BA,
+                            const HandlerPattern &pattern) {
+  size_t numOperands = numPlaceholders(pattern, OPERAND_1, OPERAND_2);
+  size_t numScratch  = numPlaceholders(pattern, SCRATCH_1, SCRATCH_2);
+
+  std::vector<std::vector<unsigned>> assignments = {{}};
+  for (size_t i = 0; i < numOperands; i++) {
+    std::vector<std::vector<unsigned>> next;
+    for (auto &a : assignments) {
+      for (unsigned int r : GPRs) {
+        if (std::find(a.begin(), a.end(), r) == a.end()) {
+          next.push_back(a);
+          next.back().push_back(r);
+        }
+      }
+    }
+    assignments = std::move(next);
+  }
+
+  size_t feasible = 0, total = 0;
+  int    minLength = std::numeric_limits<int>::max(), maxLength = 0;
+
+  for (auto &operands : assignments) {
+    std::vector<unsigned> freeRegs, scratch;
+    for (unsigned int r : GPRs) {
+      if (std::find(operands.begin(), operands.end(), r) == operands.end()) {
+        freeRegs.push_back(r);
+      }
+    }
+
+    int length =
+        tryScratchRegs(BA, pattern, operands, freeRegs, scratch, numScratch);
+    if (length >= 0) {
+      feasible++;
+      total += length;
+      minLength = std::min(minLength, length);
+      maxLength = std::max(maxLength, length);
+    }
+  }
+
+  json::Object result{{"instances", (int64_t)assignments.size()},
+                      {"feasible", (int64_t)feasible}};
+  if (feasible > 0) {
+    result["min_length"]  = minLength;
+    result["max_length"]  = maxLength;
+    result["mean_length"] = (double)total / feasible;
+  }
+  return result;
+}
+
+// ----------------------------------------------------------------
+//  REPORTS
+// ----------------------------------------------------------------
+
+json::Object reportGadgets(const BinaryAutopsy &BA, const MCRegisterInfo &MRI) {
+  json::Object result;
+
+  for (auto &kv : BA.GadgetPrimitives) {
+    std::map<std::pair<unsigned, unsigned>, std::pair<size_t, size_t>> pairs;
+    for (auto &g : kv.second) {
+      auto &counts = pairs[{g->reg1, g->reg2}];
+      counts.first++;
+      counts.second += g->getAddresses().size();
+    }
+
+    json::Array byRegisters;
+    for (auto &p : pairs) {
+      byRegisters.push_back(
+          json::Object{{"reg1", MRI.getName(p.first.first)},
+                       {"reg2", MRI.getName(p.first.second)},
+                       {"gadgets", (int64_t)p.second.first},
+                       {"addresses", (int64_t)p.second.second}});
+    }
+
+    result[getGadgetTypeName(kv.first)] =
+        json::Object{{"gadgets", (int64_t)kv.second.size()},
+                     {"registers", std::move(byRegisters)}};
+  }
+
+  return result;
+}
+
+json::Array reportXchgComponents(const BinaryAutopsy  &BA,
+                                 const MCRegisterInfo &MRI) {
+  json::Array           result;
+  std::vector<unsigned> assigned;
+
+  for (unsigned int r : GPRs) {
+    if (std::find(assigned.begin(), assigned.end(), r) != assigned.end()) {
+      continue;
+    }
+
+    json::Array component;
+    for (unsigned int s : GPRs) {
+      if (BA.areExchangeable(r, s)) {
+        component.push_back(MRI.getName(s));
+        assigned.push_back(s);
+      }
+    }
+    result.push_back(std::move(component));
+  }
+
+  return result;
+}
+
+json::Array reportXchgOverhead(const BinaryAutopsy  &BA,
+                               const MCRegisterInfo &MRI) {
+  json::Array result;
+
+  for (unsigned int a : GPRs) {
+    for (unsigned int b : GPRs) {
+      if (a == b) {
+        continue;
+      }
+
+      json::Object pair{{"reg1", MRI.getName(a)}, {"reg2", MRI.getName(b)}};
+
+      if (BA.areExchangeable(a, b)) {
+        XchgState state;
+        pair["exchange"] = (int64_t)BA.exchangeRegs(state, a, b).size();
+        pair["restore"]  = (int64_t)BA.undoXchgs(state).size();
+      } else {
+        pair["exchange"] = nullptr;
+        pair["restore"]  = nullptr;
+      }
+      result.push_back(std::move(pair));
+    }
+  }
+
+  return result;
+}
+
+json::Object reportHandlers(const BinaryAutopsy &BA) {
+  json::Object result;
+
+  for (auto &pattern : getHandlerPatterns()) {
+    result[pattern.name] = analysePattern(BA, pattern);
+  }
+
+  return result;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+
+  LLVMInitializeX86TargetInfo();
+  LLVMInitializeX86Target();
+  LLVMInitializeX86TargetMC();
+
+  cl::ParseCommandLineOptions(argc,
+                              argv,
+                              "ropf-autopsy: gadget library analyser\n");
+
+  const std::string triple = "i386-unknown-linux-gnu";
+  std::string       error;
+  const Target     *target = TargetRegistry::lookupTarget(triple, error);
+
+  if (!target) {
+    errs() << "ropf-autopsy: " << error << "\n";
+    return 1;
+  }
+
+  std::unique_ptr<TargetMachine> TM(target->createTargetMachine(
+      triple, "generic", "", TargetOptions(), None));
+
+  std::error_code ec;
+  raw_fd_ostream  os(OutputFile, ec);
+
+  if (ec) {
+    errs() << "ropf-autopsy: " << OutputFile << ": " << ec.message() << "\n";
+    return 1;
+  }
+
+  LLVMContext llvmContext;
+  Module      module("ropf-autopsy", llvmContext);
+  json::Array libraries;
+
+  for (const std::string &path : LibraryPaths) {
+#if LLVM_VERSION_MAJOR >= 13
+    MCContext context(TM->getTargetTriple(),
+                      TM->getMCAsmInfo(),
+                      TM->getMCRegisterInfo(),
+                      TM->getMCSubtargetInfo());
+#else
+    MCContext context(TM->getMCAsmInfo(), TM->getMCRegisterInfo(), nullptr);
+#endif
+
+    GlobalConfig config;
+    config.libraryPath             = path;
+    config.linkedLibraries         = LinkedLibraries;
+    config.extraGadgetLibraries    = ExtraGadgetLibraries;
+    config.searchSegmentForGadget  = !SearchSections;
+    config.avoidMultiversionSymbol = AvoidMultiversion;
+    config.gadgetCacheEnabled      = !NoCache;
+
+    auto BAOrErr = BinaryAutopsy::create(config, module, *TM, context);
+
+    if (!BAOrErr) {
+      errs() << "ropf-autopsy: " << toString(BAOrErr.takeError()) << "\n";
+      return 1;
+    }
+
+    auto                 &BA  = *BAOrErr;
+    const MCRegisterInfo &MRI = *TM->getMCRegisterInfo();
+
+    libraries.push_back(
+        json::Object{{"library", path},
+                     {"sha1", BA->getLibraryHash()},
+                     {"symbols", (int64_t)BA->Symbols.size()},
+                     {"gadgets", reportGadgets(*BA, MRI)},
+                     {"xchg_components", reportXchgComponents(*BA, MRI)},
+                     {"xchg_overhead", reportXchgOverhead(*BA, MRI)},
+                     {"handlers", reportHandlers(*BA)}});
+  }
+
+  os << formatv("{0:2}", json::Value(std::move(libraries))) << "\n";
+
+  return 0;
+}
@@ -0,0 +1,337 @@
+// ==============================================================================
+//   ROPF-SCANBENCH
+//   part of the ROPfuscator project
+// ==============================================================================
+// This tool measures the gadget scanner (GadgetScanner.h) on the executable
+// sections of one or more libraries, e.g. the 32-bit libc used as gadget
+// library:
+//      - throughput of findGadgetSites() with each implementation supported
+//        by the host (scalar, SSE2, AVX2), checking that they all find the
+//        same RET and JMP reg sites
+//      - share of the windows before each RET rejected by mayBeRetGadget()
+//        and mayBeRetSequence(), and time spent decoding the windows with and
+//        without them, checking that no window rejected is a gadget
+//
+// The timings are the best of -repeat runs over each section.
+
+#include "BinAutopsy.h"
+#include "GadgetScanner.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/MC/MCContext.h"
+#include "llvm/MC/MCDisassembler/MCDisassembler.h"
+#include "llvm/MC/MCInst.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+using namespace ropf;
+
+extern "C" void LLVMInitializeX86TargetInfo();
+extern "C" void LLVMInitializeX86Target();
+extern "C" void LLVMInitializeX86TargetMC();
+extern "C" void LLVMInitializeX86Disassembler();
+
+namespace {
+
+// ----------------------------------------------------------------
+//  COMMAND LINE ARGUMENTS
+// ----------------------------------------------------------------
+cl::list<std::string> LibraryPaths(cl::Positional,
+                                   cl::desc("<library>..."),
+                                   cl::OneOrMore);
+
+cl::opt<unsigned> Repeat("repeat",
+                         cl::desc("Number of runs of each measurement"),
+                         cl::init(20));
+
+// CodeSection - contents of an executable section of a library
+struct CodeSection {
+  std::string       name;
+  ArrayRef<uint8_t> bytes;
+};
+
+const struct {
+  ScanImpl    impl;
+  const char *name;
+} SCAN_IMPLS[] = {{ScanImpl::SCALAR, "scalar"},
+                  {ScanImpl::SSE2, "SSE2"},
+                  {ScanImpl::AVX2, "AVX2"}};
+
+// measure - returns the best time of Repeat runs of f, in seconds
+template <typename F> double measure(F f) {
+  double best = 0;
+
+  for (unsigned i = 0; i < Repeat; i++) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    if (i == 0 || elapsed.count() < best) {
+      best = elapsed.count();
+    }
+  }
+  return best;
+}
+
+// benchScan - measures findGadgetSites() on section with every implementation
+// supported by the host. Returns false if their results differ.
+bool benchScan(const CodeSection &section) {
+  const uint8_t        *buf  = section.bytes.data();
+  uint64_t              size = section.bytes.size();
+  std::vector<uint64_t> expectedRets, expectedJmps;
+  bool                  same = true;
+
+  findGadgetSites(ScanImpl::SCALAR,
+                  buf,
+                  0,
+                  size,
+                  size,
+                  expectedRets,
+                  expectedJmps);
+
+  for (auto &scan : SCAN_IMPLS) {
+    if (!isScanImplSupported(scan.impl)) {
+      outs() << formatv("  {0,-24} {1,-8} not supported\n",
+                        section.name,
+                        scan.name);
+      continue;
+    }
+
+    std::vector<uint64_t> rets, jmps;
+    double                time = measure([&]() {
+      rets.clear();
+      jmps.clear();
+      findGadgetSites(scan.impl, buf, 0, size, size, rets, jmps);
+    });
+
+    bool match = rets == expectedRets && jmps == expectedJmps;
+    same &= match;
+
+    outs() << formatv("  {0,-24} {1,-8} {2,10:F1} MB/s {3,8} RET {4,6} JMP",
+                      section.name,
+                      scan.name,
+                      size / time / 1e6,
+                      rets.size(),
+                      jmps.size())
+           << (match ? "\n" : " MISMATCH\n");
+  }
+  return same;
+}
+
+// Window - bytes before a RET examined by BinaryAutopsy::dumpGadgets(), for a
+// gadget of one instruction or for a sequence of them
+struct Window {
+  uint64_t begin, end;
+  bool     sequence;
+};
+
+// WindowDecoder - decodes the windows like BinaryAutopsy::dumpGadgets()
+class WindowDecoder {
+  MCDisassembler   &disasm;
+  ArrayRef<uint8_t> bytes;
+
+  bool decode(uint64_t start, uint64_t end, MCInst &instr, uint64_t &size) {
+    return disasm.getInstruction(instr,
+                                 size,
+                                 bytes.slice(start, end - start),
+                                 start,
+                                 nulls()) == MCDisassembler::Success;
+  }
+
+public:
+  WindowDecoder(MCDisassembler &disasm, ArrayRef<uint8_t> bytes)
+      : disasm(disasm), bytes(bytes) {}
+
+  // isGadget - tells whether the window is a gadget
+  bool isGadget(const Window &window) {
+    MCInst   instr;
+    uint64_t size;
+    uint64_t pos   = window.begin;
+    size_t   count = 0;
+
+    if (!window.sequence) {
+      if (!decode(pos, window.end, instr, size) || pos + size >= window.end) {
+        return false;
+      }
+      unsigned opcode = instr.getOpcode();
+      if (opcode == X86::DATA16_PREFIX || opcode == X86::LOCK_PREFIX ||
+          opcode == X86::REP_PREFIX || opcode == X86::REPNE_PREFIX) {
+        return false;
+      }
+      return decode(pos + size, window.end, instr, size) &&
+             instr.getOpcode() == X86::RETL;
+    }
+
+    while (pos < window.end - 1 && count < MAXINSTRS) {
+      if (!decode(pos, window.end, instr, size) ||
+          instr.getOpcode() == X86::RETL) {
+        break;
+      }
+      count++;
+      pos += size;
+    }
+    return pos == window.end - 1 && count >= 2 &&
+           decode(pos, window.end, instr, size) &&
+           instr.getOpcode() == X86::RETL;
+  }
+};
+
+// mayBeGadget - tells whether the prefilter of the window accepts it
+bool mayBeGadget(const uint8_t *buf, const Window &window) {
+  return window.sequence ? mayBeRetSequence(buf, window.begin, window.end)
+                         : mayBeRetGadget(buf, window.begin, window.end);
+}
+
+// benchPrefilter - measures the prefilter of the windows before the RETs of
+// section. Returns false if it rejects a window that is a gadget.
+bool benchPrefilter(const CodeSection &section, MCDisassembler &disasm) {
+  const uint8_t        *buf  = section.bytes.data();
+  uint64_t              size = section.bytes.size();
+  std::vector<uint64_t> rets, jmps;
+  std::vector<Window>   windows;
+
+  findGadgetSites(buf, 0, size, size, rets, jmps);
+
+  // the same windows as BinaryAutopsy::dumpGadgets()
+  for (uint64_t ret : rets) {
+    uint64_t offset = ret + 1;
+
+    for (uint64_t depth = 1; depth <= MAXDEPTH_MULTI && depth <= offset;
+         depth++) {
+      uint64_t begin = offset - depth;
+
+      if (buf[begin] == 0xf2 || buf[begin] == 0xf3) {
+        continue;
+      }
+      if (depth <= MAXDEPTH) {
+        windows.push_back({begin, offset, false});
+      }
+      if (depth >= 3) {
+        windows.push_back({begin, offset, true});
+      }
+    }
+  }
+
+  if (windows.empty()) {
+    return true;
+  }
+
+  WindowDecoder decoder(disasm, section.bytes);
+  size_t        rejected = 0, missed = 0, gadgets = 0;
+
+  for (auto &window : windows) {
+    bool accepted = mayBeGadget(buf, window);
+    bool gadget   = decoder.isGadget(window);
+
+    rejected += !accepted;
+    missed += gadget && !accepted;
+    gadgets += gadget;
+  }
+
+  double unfiltered = measure([&]() {
+    for (auto &window : windows) {
+      decoder.isGadget(window);
+    }
+  });
+  double filtered = measure([&]() {
+    for (auto &window : windows) {
+      if (mayBeGadget(buf, window)) {
+        decoder.isGadget(window);
+      }
+    }
+  });
+
+  outs() << formatv("  {0,-24} prefilter {1,8} windows {2,5:P} rejected, "
+                    "{3,7} gadgets, {4,8:F2} ms -> {5,8:F2} ms",
+                    section.name,
+                    windows.size(),
+                    (double)rejected / windows.size(),
+                    gadgets,
+                    unfiltered * 1e3,
+                    filtered * 1e3)
+         << (missed ? formatv(" {0} MISSED\n", missed).str() : "\n");
+  return missed == 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+
+  LLVMInitializeX86TargetInfo();
+  LLVMInitializeX86Target();
+  LLVMInitializeX86TargetMC();
+  LLVMInitializeX86Disassembler();
+
+  cl::ParseCommandLineOptions(argc,
+                              argv,
+                              "ropf-scanbench: gadget scanner benchmark\n");
+
+  const std::string triple = "i386-unknown-linux-gnu";
+  std::string       error;
+  const Target     *target = TargetRegistry::lookupTarget(triple, error);
+
+  if (!target) {
+    errs() << "ropf-scanbench: " << error << "\n";
+    return 1;
+  }
+
+  std::unique_ptr<TargetMachine> TM(target->createTargetMachine(
+      triple, "generic", "", TargetOptions(), None));
+#if LLVM_VERSION_MAJOR >= 13
+  MCContext context(TM->getTargetTriple(),
+                    TM->getMCAsmInfo(),
+                    TM->getMCRegisterInfo(),
+                    TM->getMCSubtargetInfo());
+#else
+  MCContext context(TM->getMCAsmInfo(), TM->getMCRegisterInfo(), nullptr);
+#endif
+  std::unique_ptr<MCDisassembler> disasm(
+      target->createMCDisassembler(*TM->getMCSubtargetInfo(), context));
+
+  bool ok = true;
+
+  for (const std::string &path : LibraryPaths) {
+    auto binary = object::ObjectFile::createObjectFile(path);
+
+    if (!binary) {
+      errs() << "ropf-scanbench: " << path << ": "
+             << toString(binary.takeError()) << "\n";
+      return 1;
+    }
+
+    std::vector<CodeSection> sections;
+
+    for (const object::SectionRef &section : binary->getBinary()->sections()) {
+      Expected<StringRef> name     = section.getName();
+      Expected<StringRef> contents = section.getContents();
+
+      if (!name || !contents || !section.isText()) {
+        consumeError(name.takeError());
+        consumeError(contents.takeError());
+        continue;
+      }
+      sections.push_back({name->str(), arrayRefFromStringRef(*contents)});
+    }
+
+    outs() << path << "\n";
+    for (auto &section : sections) {
+      ok &= benchScan(section);
+      ok &= benchPrefilter(section, *disasm);
+    }
+  }
+
+  return ok ? 0 : 1;
+}